@@ -0,0 +1,191 @@
+#include "balloc.h" // Bitmap allocator interface
+#include "bcache.h" // Changed bitmap blocks are written through the block cache
+#include "ufs.h"    // UFS_BLOCK_SIZE
+#include <stdlib.h>
+#include <string.h>
+
+#define GROUP_WORDS (32)                                   // Words per summary group
+#define GROUP_BITS (GROUP_WORDS * 32)                      // Bits per summary group
+#define WORDS_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(unsigned int)) // Words per on-disk block
+
+struct balloc
+{
+    int nbits;                 // Usable bits
+    int nwords;                // Words in bits[] (whole 4 KB blocks)
+    int ngroups;               // Summary groups
+    unsigned int *bits;        // The bitmap, on-disk layout
+    int *group_free;           // Per group: number of free bits
+    unsigned int *group_avail; // Per group: set if group_free > 0 (MSB-first like bits)
+    char *block_dirty;         // Per 4 KB block of bits[]: changed since the last sync
+    int free_count;            // Total free bits
+};
+
+static inline unsigned int bit_mask(int i)
+{
+    return 0x80000000u >> (i % 32);
+}
+
+static void set_group_avail(balloc_t *b, int g, int avail)
+{
+    if (avail)
+        b->group_avail[g / 32] |= bit_mask(g);
+    else
+        b->group_avail[g / 32] &= ~bit_mask(g);
+}
+
+balloc_t *balloc_create(const unsigned int *words, int nbits)
+{
+    balloc_t *b = calloc(1, sizeof(balloc_t));
+    if (b == NULL)
+        return NULL;
+
+    int used_words = (nbits + 31) / 32;
+    b->nbits = nbits;
+    b->nwords = (used_words + WORDS_PER_BLOCK - 1) / WORDS_PER_BLOCK * WORDS_PER_BLOCK;
+    b->ngroups = (used_words + GROUP_WORDS - 1) / GROUP_WORDS;
+    b->bits = calloc(b->nwords, sizeof(unsigned int));
+    b->group_free = calloc(b->ngroups, sizeof(int));
+    b->group_avail = calloc((b->ngroups + 31) / 32, sizeof(unsigned int));
+    b->block_dirty = calloc(b->nwords / WORDS_PER_BLOCK, sizeof(char));
+    if (b->bits == NULL || b->group_free == NULL || b->group_avail == NULL || b->block_dirty == NULL)
+    {
+        free(b->bits);
+        free(b->group_free);
+        free(b->group_avail);
+        free(b->block_dirty);
+        free(b);
+        return NULL;
+    }
+    memcpy(b->bits, words, used_words * sizeof(unsigned int));
+
+    // Bits past nbits are never handed out: treat them as allocated
+    if (nbits % 32 != 0)
+        b->bits[used_words - 1] |= 0xffffffffu >> (nbits % 32);
+
+    for (int w = 0; w < used_words; w++)
+    {
+        int nfree = __builtin_popcount(~b->bits[w]);
+        b->group_free[w / GROUP_WORDS] += nfree;
+        b->free_count += nfree;
+    }
+    for (int g = 0; g < b->ngroups; g++)
+    {
+        set_group_avail(b, g, b->group_free[g] > 0);
+    }
+    return b;
+}
+
+// Returns the first free bit in words [from_bit / 32, end_word) at or after
+// from_bit, or -1
+static int scan_words(balloc_t *b, int from_bit, int end_word)
+{
+    int w = from_bit / 32;
+    if (w >= end_word)
+        return -1;
+
+    unsigned int avail = ~b->bits[w] & (0xffffffffu >> (from_bit % 32));
+    while (avail == 0)
+    {
+        if (++w >= end_word)
+            return -1;
+        avail = ~b->bits[w];
+    }
+    return w * 32 + __builtin_clz(avail);
+}
+
+// Returns the first group at or after g that has a free bit, or -1
+static int next_avail_group(balloc_t *b, int g)
+{
+    int nwords = (b->ngroups + 31) / 32;
+    int w = g / 32;
+    if (g >= b->ngroups)
+        return -1;
+
+    unsigned int avail = b->group_avail[w] & (0xffffffffu >> (g % 32));
+    while (avail == 0)
+    {
+        if (++w >= nwords)
+            return -1;
+        avail = b->group_avail[w];
+    }
+    int found = w * 32 + __builtin_clz(avail);
+    return found < b->ngroups ? found : -1;
+}
+
+// Searches [goal, nbits) for a free bit
+static int search_from(balloc_t *b, int goal)
+{
+    int used_words = (b->nbits + 31) / 32;
+    int g = goal / GROUP_BITS;
+
+    // Finish the goal's own group word by word, so nearby bits win
+    if (b->group_free[g] > 0)
+    {
+        int end_word = (g + 1) * GROUP_WORDS < used_words ? (g + 1) * GROUP_WORDS : used_words;
+        int bit = scan_words(b, goal, end_word);
+        if (bit != -1)
+            return bit;
+    }
+
+    // Then jump straight to the next group with room
+    g = next_avail_group(b, g + 1);
+    if (g == -1)
+        return -1;
+    return scan_words(b, g * GROUP_BITS, used_words);
+}
+
+int balloc_alloc(balloc_t *b, int goal)
+{
+    if (b->free_count == 0)
+        return -1;
+    if (goal < 0 || goal >= b->nbits)
+        goal = 0;
+
+    int bit = search_from(b, goal);
+    if (bit == -1 && goal > 0)
+        bit = search_from(b, 0);
+    if (bit == -1 || bit >= b->nbits)
+        return -1;
+
+    int g = bit / GROUP_BITS;
+    __atomic_fetch_or(&b->bits[bit / 32], bit_mask(bit), __ATOMIC_RELAXED);
+    b->block_dirty[bit / 32 / WORDS_PER_BLOCK] = 1;
+    b->free_count--;
+    if (--b->group_free[g] == 0)
+        set_group_avail(b, g, 0);
+    return bit;
+}
+
+void balloc_free(balloc_t *b, int bit)
+{
+    if (bit < 0 || bit >= b->nbits || !balloc_test(b, bit))
+        return;
+
+    int g = bit / GROUP_BITS;
+    __atomic_fetch_and(&b->bits[bit / 32], ~bit_mask(bit), __ATOMIC_RELAXED);
+    b->block_dirty[bit / 32 / WORDS_PER_BLOCK] = 1;
+    b->free_count++;
+    if (b->group_free[g]++ == 0)
+        set_group_avail(b, g, 1);
+}
+
+int balloc_test(balloc_t *b, int bit)
+{
+    return (__atomic_load_n(&b->bits[bit / 32], __ATOMIC_RELAXED) & bit_mask(bit)) != 0;
+}
+
+int balloc_free_count(balloc_t *b)
+{
+    return b->free_count;
+}
+
+void balloc_sync(balloc_t *b, unsigned int first_blk)
+{
+    for (int i = 0; i < b->nwords / (int)WORDS_PER_BLOCK; i++)
+    {
+        if (!b->block_dirty[i])
+            continue;
+        bcache_write(first_blk + i, b->bits + (size_t)i * WORDS_PER_BLOCK);
+        b->block_dirty[i] = 0;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef __balloc_h__
+#define __balloc_h__
+
+// Bitmap allocator over an on-disk allocation bitmap (data or inode bitmap).
+//
+// The bitmap uses the on-disk layout written by mkfs: an array of 32-bit
+// words, bit i stored in word i / 32 at mask 0x80000000 >> (i % 32), set
+// meaning allocated. Free bits are found a word at a time with count-leading-
+// zeros. A two-level summary (free count per group of 1024 bits, plus one bit
+// per group that still has room) lets a search skip full regions without
+// reading them. The allocator does no locking of its own; callers serialize
+// every call except balloc_test().
+
+typedef struct balloc balloc_t;
+
+// Creates an allocator for nbits bits, initialized from the on-disk words
+// (ceil(nbits / 32) of them). Returns NULL if memory runs out.
+balloc_t *balloc_create(const unsigned int *words, int nbits);
+
+// Allocates the first free bit at or after goal (wrapping around to the
+// start), so that consecutive allocations with goal = previous + 1 produce
+// contiguous runs. Returns the bit, or -1 if none is free.
+int balloc_alloc(balloc_t *b, int goal);
+
+// Marks bit as free again.
+void balloc_free(balloc_t *b, int bit);
+
+// Returns whether bit is allocated. Safe to call concurrently with the other
+// functions.
+int balloc_test(balloc_t *b, int bit);
+
+// Returns the number of free bits.
+int balloc_free_count(balloc_t *b);
+
+// Copies each 4 KB block of the bitmap changed since the last call into the
+// block cache, at image block first_blk + i for the i'th bitmap block.
+void balloc_sync(balloc_t *b, unsigned int first_blk);
+
+#endif // __balloc_h__
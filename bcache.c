@@ -0,0 +1,602 @@
+#include "bcache.h" // Buffer cache interface
+#include "diskio.h" // Dirty blocks are flushed as one batch
+#include "ufs.h"    // UFS_BLOCK_SIZE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define PREFETCH_QUEUE 256 // Runs waiting for the prefetch thread
+#define PREFETCH_RUN 64    // Blocks a prefetch thread reads per call
+#define PREFETCH_THREADS 4 // Prefetch reads in flight at once
+
+typedef struct
+{
+    unsigned int blk;    // Image block held by this frame
+    int next;            // Next frame in the same hash chain, or -1
+    char valid;          // Frame holds a block
+    char ref;            // CLOCK reference bit
+    char dirty;          // Cached copy is newer than the image
+    char prefetched;     // Loaded by the prefetch thread and not read since
+    char flushing;       // Being written by bcache_flush(); cannot be evicted
+    unsigned long wseq;  // write_seq as of the last write to the frame
+} frame_t;
+
+static int cache_fd = -1;     // Image file descriptor
+static int num_frames;        // Number of frames (0 = caching disabled)
+static frame_t *frames;       // Frame descriptors
+static char *frame_data;      // num_frames blocks, block-aligned
+static int *buckets;          // Hash bucket heads (frame index or -1)
+static unsigned long *gens;   // Per bucket: writes to the blocks hashing there
+static unsigned int hash_mask; // Number of buckets - 1
+static int clock_hand;        // Next frame the CLOCK sweep looks at
+static bcache_stats_t stats;  // Counters, protected by cache_lock
+static unsigned long write_seq; // Writes so far, protected by cache_lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Prefetch queue: a ring of runs of adjacent blocks, protected by
+// prefetch_lock and drained by the prefetch_thread()s
+static struct
+{
+    unsigned int blk;
+    int n;
+} prefetch_queue[PREFETCH_QUEUE];
+static int prefetch_head;  // Next run to read
+static int prefetch_count; // Runs queued
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static inline char *frame_block(int f)
+{
+    return frame_data + (size_t)f * UFS_BLOCK_SIZE;
+}
+
+static inline unsigned int hash_blk(unsigned int blk)
+{
+    return (blk * 2654435761u) & hash_mask;
+}
+
+// A reader that missed notes gen_of() before reading the image without the
+// lock, and caches what it read only if no write to the block (or another in
+// its bucket) came in meanwhile: that write may have reached the image before
+// or after the read, so the copy read could be stale. Caller holds
+// cache_lock.
+static inline unsigned long gen_of(unsigned int blk)
+{
+    return gens[hash_blk(blk)];
+}
+
+// Returns the frame holding blk, or -1. Caller holds cache_lock.
+static int lookup(unsigned int blk)
+{
+    for (int f = buckets[hash_blk(blk)]; f != -1; f = frames[f].next)
+    {
+        if (frames[f].blk == blk)
+            return f;
+    }
+    return -1;
+}
+
+static void unhash(int f)
+{
+    int *p = &buckets[hash_blk(frames[f].blk)];
+    while (*p != f)
+        p = &frames[*p].next;
+    *p = frames[f].next;
+}
+
+// Writes frame f back to the image. Caller holds cache_lock.
+static int write_back(int f)
+{
+    if (pwrite(cache_fd, frame_block(f), UFS_BLOCK_SIZE, (off_t)frames[f].blk * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE)
+    {
+        perror("bcache: pwrite");
+        return -1;
+    }
+    frames[f].dirty = 0;
+    stats.dirty--;
+    stats.writebacks++;
+    return 0;
+}
+
+// Picks a frame for a new block, evicting with CLOCK. Clean frames are
+// preferred; a dirty victim is only taken (and written back) after two full
+// sweeps found nothing clean. Frames that bcache_flush() is writing are never
+// taken, since a write-back could then be overtaken by the flush's older
+// copy; returns -1 if every other frame failed to give way within three
+// sweeps. Caller holds cache_lock.
+static int get_victim(void)
+{
+    for (int scanned = 0; scanned < 3 * num_frames; scanned++)
+    {
+        int f = clock_hand;
+        clock_hand = (clock_hand + 1) % num_frames;
+
+        if (!frames[f].valid)
+            return f;
+        if (frames[f].ref)
+        {
+            frames[f].ref = 0;
+            continue;
+        }
+        if (frames[f].flushing || (frames[f].dirty && scanned < 2 * num_frames))
+            continue;
+        if (frames[f].dirty && write_back(f) < 0)
+            continue;
+
+        unhash(f);
+        frames[f].valid = 0;
+        stats.evictions++;
+        stats.prefetch_unused += frames[f].prefetched;
+        frames[f].prefetched = 0;
+        return f;
+    }
+    return -1;
+}
+
+// Installs blk into a fresh frame and returns it, or -1 if no frame can be
+// freed right now. Caller holds cache_lock.
+static int insert(unsigned int blk)
+{
+    int f = get_victim();
+    if (f == -1)
+        return -1;
+    unsigned int h = hash_blk(blk);
+    frames[f].blk = blk;
+    frames[f].valid = 1;
+    frames[f].ref = 0; // Must be hit again to survive the next sweep
+    frames[f].dirty = 0;
+    frames[f].prefetched = 0;
+    frames[f].next = buckets[h];
+    buckets[h] = f;
+    return f;
+}
+
+// Reads the queued runs into the cache, one at a time. Blocks cached by the
+// time a read completes keep their cached copy, which may be newer.
+static void *prefetch_thread(void *arg)
+{
+    char *buf = arg; // PREFETCH_RUN blocks
+    for (;;)
+    {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_count == 0)
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        unsigned int blk = prefetch_queue[prefetch_head].blk;
+        int n = prefetch_queue[prefetch_head].n;
+        prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+        prefetch_count--;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        // Trim the run to the blocks not cached yet, from both ends
+        unsigned long gen[PREFETCH_RUN];
+        pthread_mutex_lock(&cache_lock);
+        while (n > 0 && lookup(blk) != -1)
+        {
+            blk++;
+            n--;
+        }
+        while (n > 0 && lookup(blk + n - 1) != -1)
+            n--;
+        for (int i = 0; i < n; i++)
+            gen[i] = gen_of(blk + i);
+        pthread_mutex_unlock(&cache_lock);
+        if (n == 0)
+            continue;
+
+        ssize_t got = pread(cache_fd, buf, (size_t)n * UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE);
+        int nread = got > 0 ? got / UFS_BLOCK_SIZE : 0; // Stop at the end of the image
+
+        // One block per lock hold, so that the workers' hits are not held up
+        for (int i = 0; i < nread; i++)
+        {
+            pthread_mutex_lock(&cache_lock);
+            int f = lookup(blk + i) == -1 && gen_of(blk + i) == gen[i] ? insert(blk + i) : -1;
+            if (f != -1)
+            {
+                memcpy(frame_block(f), buf + (size_t)i * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
+                frames[f].prefetched = 1;
+                stats.prefetched++;
+            }
+            pthread_mutex_unlock(&cache_lock);
+        }
+    }
+    return NULL;
+}
+
+int bcache_init(int fd, size_t budget)
+{
+    cache_fd = fd;
+    num_frames = budget / UFS_BLOCK_SIZE;
+    stats.frames = num_frames;
+    if (num_frames == 0)
+        return 0;
+
+    unsigned int num_buckets = 1;
+    while (num_buckets < (unsigned int)num_frames * 2)
+        num_buckets <<= 1;
+    hash_mask = num_buckets - 1;
+
+    frames = calloc(num_frames, sizeof(frame_t));
+    buckets = malloc(num_buckets * sizeof(int));
+    gens = calloc(num_buckets, sizeof(unsigned long));
+    if (frames == NULL || buckets == NULL || gens == NULL ||
+        posix_memalign((void **)&frame_data, UFS_BLOCK_SIZE, (size_t)num_frames * UFS_BLOCK_SIZE) != 0)
+    {
+        perror("bcache: alloc");
+        return -1;
+    }
+    memset(buckets, -1, num_buckets * sizeof(int));
+
+    for (int i = 0; i < PREFETCH_THREADS; i++)
+    {
+        pthread_t tid;
+        char *buf;
+        if (posix_memalign((void **)&buf, UFS_BLOCK_SIZE, PREFETCH_RUN * UFS_BLOCK_SIZE) != 0 ||
+            pthread_create(&tid, NULL, prefetch_thread, buf) != 0)
+        {
+            perror("bcache: prefetch thread");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+int bcache_read(unsigned int blk, void *buf)
+{
+    if (num_frames == 0)
+    {
+        return pread(cache_fd, buf, UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int f = lookup(blk);
+    if (f != -1)
+    {
+        frames[f].ref = 1;
+        memcpy(buf, frame_block(f), UFS_BLOCK_SIZE);
+        stats.hits++;
+        stats.prefetch_hits += frames[f].prefetched;
+        frames[f].prefetched = 0;
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    stats.misses++;
+    unsigned long gen = gen_of(blk);
+    pthread_mutex_unlock(&cache_lock);
+
+    // Read outside the lock so that misses do not serialize every other hit
+    if (pread(cache_fd, buf, UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int rc = 0;
+    f = lookup(blk);
+    if (f != -1)
+    {
+        // Someone cached it meanwhile; their copy may be newer than the image
+        memcpy(buf, frame_block(f), UFS_BLOCK_SIZE);
+    }
+    else if (gen_of(blk) != gen)
+    {
+        // Written and gone from the cache meanwhile; read it again, now
+        // that no write can overtake the read
+        rc = pread(cache_fd, buf, UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE ? 0 : -1;
+    }
+    else if ((f = insert(blk)) != -1)
+    {
+        memcpy(frame_block(f), buf, UFS_BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+// Replaces the contents of frame f with buf and marks it dirty. Caller holds
+// cache_lock.
+static void mark_written(int f, const void *buf)
+{
+    memcpy(frame_block(f), buf, UFS_BLOCK_SIZE);
+    frames[f].ref = 1;
+    frames[f].prefetched = 0;
+    frames[f].wseq = ++write_seq;
+    gens[hash_blk(frames[f].blk)]++;
+    if (!frames[f].dirty)
+    {
+        frames[f].dirty = 1;
+        stats.dirty++;
+    }
+}
+
+// Writes blk straight to the image, for when every frame is being flushed
+// (that block is not, so the image copy is the newest). Caller holds
+// cache_lock, so that no reader's miss can overtake the write.
+static int write_through(unsigned int blk, const void *buf)
+{
+    gens[hash_blk(blk)]++;
+    return pwrite(cache_fd, buf, UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE ? 0 : -1;
+}
+
+int bcache_write(unsigned int blk, const void *buf)
+{
+    if (num_frames == 0)
+    {
+        return pwrite(cache_fd, buf, UFS_BLOCK_SIZE, (off_t)blk * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int f = lookup(blk);
+    if (f == -1)
+        f = insert(blk);
+    int rc = 0;
+    if (f != -1)
+        mark_written(f, buf);
+    else
+        rc = write_through(blk, buf);
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+// Returns the length of the run of adjacent image blocks starting at blks[i]
+static int run_length(const unsigned int *blks, int i, int n)
+{
+    int run = 1;
+    while (i + run < n && blks[i + run] == blks[i] + run)
+        run++;
+    return run;
+}
+
+int bcache_read_range(const unsigned int *blks, int n, void *buf)
+{
+    char *out = buf;
+    char *miss = calloc(n, sizeof(char));
+    unsigned long *gen = calloc(n, sizeof(unsigned long)); // gen_of() each missed block
+    if (miss == NULL || gen == NULL)
+    {
+        free(miss);
+        free(gen);
+        return -1;
+    }
+
+    // Copy out the cached blocks and note the rest
+    int nmiss = n;
+    if (num_frames > 0)
+    {
+        pthread_mutex_lock(&cache_lock);
+        for (int i = 0; i < n; i++)
+        {
+            int f = lookup(blks[i]);
+            if (f == -1)
+            {
+                miss[i] = 1;
+                gen[i] = gen_of(blks[i]);
+                continue;
+            }
+            frames[f].ref = 1;
+            memcpy(out + (size_t)i * UFS_BLOCK_SIZE, frame_block(f), UFS_BLOCK_SIZE);
+            stats.prefetch_hits += frames[f].prefetched;
+            frames[f].prefetched = 0;
+            nmiss--;
+        }
+        stats.hits += n - nmiss;
+        stats.misses += nmiss;
+        pthread_mutex_unlock(&cache_lock);
+    }
+    else
+    {
+        memset(miss, 1, n);
+    }
+
+    // Read each run of missed adjacent blocks with one call, outside the lock
+    int rc = 0;
+    for (int i = 0; i < n && rc == 0;)
+    {
+        if (!miss[i])
+        {
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < n && miss[i + run] && blks[i + run] == blks[i] + run)
+            run++;
+        size_t len = (size_t)run * UFS_BLOCK_SIZE;
+        if (pread(cache_fd, out + (size_t)i * UFS_BLOCK_SIZE, len, (off_t)blks[i] * UFS_BLOCK_SIZE) != (ssize_t)len)
+            rc = -1;
+        i += run;
+    }
+
+    if (rc == 0 && num_frames > 0 && nmiss > 0)
+    {
+        pthread_mutex_lock(&cache_lock);
+        for (int i = 0; i < n; i++)
+        {
+            if (!miss[i])
+                continue;
+            char *b = out + (size_t)i * UFS_BLOCK_SIZE;
+            int f = lookup(blks[i]);
+            if (f != -1)
+            {
+                memcpy(b, frame_block(f), UFS_BLOCK_SIZE); // Cached meanwhile, maybe newer
+            }
+            else if (gen_of(blks[i]) != gen[i])
+            {
+                // Written meanwhile, as in bcache_read()
+                if (pread(cache_fd, b, UFS_BLOCK_SIZE, (off_t)blks[i] * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE)
+                    rc = -1;
+            }
+            else if ((f = insert(blks[i])) != -1)
+            {
+                memcpy(frame_block(f), b, UFS_BLOCK_SIZE);
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    free(miss);
+    free(gen);
+    return rc;
+}
+
+int bcache_write_range(const unsigned int *blks, int n, const void *buf)
+{
+    const char *in = buf;
+    if (num_frames == 0)
+    {
+        for (int i = 0; i < n;)
+        {
+            int run = run_length(blks, i, n);
+            size_t len = (size_t)run * UFS_BLOCK_SIZE;
+            if (pwrite(cache_fd, in + (size_t)i * UFS_BLOCK_SIZE, len, (off_t)blks[i] * UFS_BLOCK_SIZE) != (ssize_t)len)
+                return -1;
+            i += run;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int rc = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int f = lookup(blks[i]);
+        if (f == -1)
+            f = insert(blks[i]);
+        if (f != -1)
+            mark_written(f, in + (size_t)i * UFS_BLOCK_SIZE);
+        else if (write_through(blks[i], in + (size_t)i * UFS_BLOCK_SIZE) < 0)
+            rc = -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+int bcache_prefetch(unsigned int blk, int n)
+{
+    if (num_frames == 0)
+    {
+        posix_fadvise(cache_fd, (off_t)blk * UFS_BLOCK_SIZE, (off_t)n * UFS_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+        return n;
+    }
+
+    // A run larger than the cache would only evict itself
+    if (n > num_frames / 4)
+        n = num_frames / 4;
+    int queued = 0;
+    pthread_mutex_lock(&prefetch_lock);
+    while (queued < n && prefetch_count < PREFETCH_QUEUE)
+    {
+        int tail = (prefetch_head + prefetch_count) % PREFETCH_QUEUE;
+        prefetch_queue[tail].blk = blk + queued;
+        prefetch_queue[tail].n = n - queued < PREFETCH_RUN ? n - queued : PREFETCH_RUN;
+        queued += prefetch_queue[tail].n;
+        prefetch_count++;
+    }
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+    return queued;
+}
+
+// A dirty block as bcache_flush() found it
+typedef struct
+{
+    int frame;
+    unsigned int blk;
+    unsigned long wseq;
+} flush_ent_t;
+
+// Orders flush entries by block
+static int cmp_flush_blk(const void *a, const void *b)
+{
+    unsigned int x = ((const flush_ent_t *)a)->blk, y = ((const flush_ent_t *)b)->blk;
+    return x < y ? -1 : x > y;
+}
+
+int bcache_flush(void)
+{
+    // Copy the dirty blocks out and pin their frames; the cache stays
+    // usable while they are written
+    pthread_mutex_lock(&cache_lock);
+    int ndirty = stats.dirty;
+    struct iovec *iov = malloc((ndirty > 0 ? ndirty : 1) * sizeof(struct iovec));
+    flush_ent_t *dirty = malloc((ndirty > 0 ? ndirty : 1) * sizeof(flush_ent_t));
+    char *copy = NULL;
+    if (iov == NULL || dirty == NULL ||
+        posix_memalign((void **)&copy, UFS_BLOCK_SIZE, (size_t)(ndirty > 0 ? ndirty : 1) * UFS_BLOCK_SIZE) != 0)
+    {
+        pthread_mutex_unlock(&cache_lock);
+        free(iov);
+        free(dirty);
+        return -1;
+    }
+    int n = 0;
+    for (int f = 0; f < num_frames && n < ndirty; f++)
+    {
+        if (frames[f].valid && frames[f].dirty)
+        {
+            dirty[n++] = (flush_ent_t){f, frames[f].blk, frames[f].wseq};
+            frames[f].flushing = 1;
+        }
+    }
+
+    // Sort by block, so that blocks adjacent in the image go out as one
+    // vectored write
+    qsort(dirty, n, sizeof(flush_ent_t), cmp_flush_blk);
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(copy + (size_t)i * UFS_BLOCK_SIZE, frame_block(dirty[i].frame), UFS_BLOCK_SIZE);
+        iov[i].iov_base = copy + (size_t)i * UFS_BLOCK_SIZE;
+        iov[i].iov_len = UFS_BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Hand every run to the disk backend at once
+    diskio_batch_t batch;
+    diskio_batch_init(&batch);
+    int queued = 0, runs = 0;
+    while (queued < n)
+    {
+        int run = 1;
+        while (queued + run < n && run < UIO_MAXIOV && dirty[queued + run].blk == dirty[queued].blk + run)
+            run++;
+        if (diskio_add_write(&batch, &iov[queued], run, (off_t)dirty[queued].blk * UFS_BLOCK_SIZE) < 0)
+            break; // The rest stay dirty for the next flush
+        queued += run;
+        runs++;
+    }
+    int rc = diskio_submit(&batch);
+    diskio_batch_free(&batch);
+
+    // A frame written again meanwhile stays dirty with its newer contents
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < n; i++)
+    {
+        frame_t *fr = &frames[dirty[i].frame];
+        fr->flushing = 0;
+        if (rc == 0 && i < queued && fr->dirty && fr->wseq == dirty[i].wseq)
+        {
+            fr->dirty = 0;
+            stats.dirty--;
+        }
+    }
+    if (rc == 0)
+    {
+        stats.writebacks += queued;
+        stats.flush_writes += runs;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(iov);
+    free(dirty);
+    free(copy);
+    // Blocks that could not be queued are not on disk yet
+    return queued < n ? -1 : rc;
+}
+
+void bcache_get_stats(bcache_stats_t *st)
+{
+    pthread_mutex_lock(&cache_lock);
+    *st = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
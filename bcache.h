@@ -0,0 +1,69 @@
+#ifndef __bcache_h__
+#define __bcache_h__
+
+#include <stddef.h>
+
+// Server-side buffer cache of 4 KB image blocks, keyed by block address.
+//
+// Blocks are copied in and out under a single mutex, so callers never hold
+// pointers into the cache. Writes only dirty the cached copy; they reach the
+// image on bcache_flush() (or when a dirty block has to be evicted), which
+// the server calls right before fsync(). Eviction is CLOCK with new blocks
+// inserted unreferenced: a block must be hit again before it survives a
+// sweep, so one large scan cannot flush out the hot directory blocks.
+//
+// bcache_prefetch() loads blocks ahead of use from a background thread.
+// Prefetched blocks are inserted unreferenced too, and are counted as prefetch
+// hits when first read or as unused if evicted before that. Misses and
+// prefetches read the image without the lock, and drop what they read instead
+// of caching it if the block was written in the meantime.
+
+typedef struct
+{
+    unsigned long hits;            // Reads served from memory
+    unsigned long misses;          // Reads that had to go to the image
+    unsigned long evictions;       // Frames reused for another block
+    unsigned long writebacks;      // Dirty blocks written to the image
+    unsigned long flush_writes;    // Vectored writes bcache_flush() issued for them
+    unsigned long dirty;           // Dirty blocks currently cached
+    unsigned long frames;          // Cache capacity in blocks
+    unsigned long prefetched;      // Blocks loaded by bcache_prefetch()
+    unsigned long prefetch_hits;   // Reads served by a prefetched block
+    unsigned long prefetch_unused; // Prefetched blocks evicted unread
+} bcache_stats_t;
+
+// Sets up a cache of budget bytes over the image open on fd. A budget smaller
+// than one block disables caching: reads and writes go straight to the image.
+int bcache_init(int fd, size_t budget);
+
+// Copies block blk into buf, reading it from the image on a miss.
+int bcache_read(unsigned int blk, void *buf);
+
+// Replaces the contents of block blk with buf and marks it dirty.
+int bcache_write(unsigned int blk, const void *buf);
+
+// Range versions of bcache_read() and bcache_write(): buf holds n blocks, the
+// i'th being image block blks[i]. Misses of a read, and every write when
+// caching is disabled, go to the image as one call per run of adjacent blocks.
+int bcache_read_range(const unsigned int *blks, int n, void *buf);
+int bcache_write_range(const unsigned int *blks, int n, const void *buf);
+
+// Queues the n adjacent blocks from blk on to be read into the cache in the
+// background, skipping those already cached. Returns at once, with the number
+// of blocks queued from blk on; the rest did not fit in the queue (or would
+// not fit in the cache) and are dropped. With caching disabled, the kernel is
+// asked to read the blocks ahead into the page cache instead.
+int bcache_prefetch(unsigned int blk, int n);
+
+// Writes every dirty block back to the image, as one diskio batch (see
+// diskio.h) with one vectored write per run of adjacent blocks. The blocks
+// are copied out first, so other threads keep using the cache during the
+// I/O; a block written again meanwhile stays dirty. Does not fsync. Calls
+// must be serialized like diskio_submit(). Fails if any dirty block was
+// left unwritten.
+int bcache_flush(void);
+
+// Copies the current counters into st.
+void bcache_get_stats(bcache_stats_t *st);
+
+#endif // __bcache_h__
@@ -0,0 +1,235 @@
+#include "mfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NAME_LEN 28   // Names must be shorter than this
+#define FILE_BLOCKS 8 // Blocks each client cycles through
+#define MAX_RANGE 30  // Blocks in a file
+#define MAX_REPLICAS 8
+
+static char *replicas[MAX_REPLICAS]; // -R: backups of the server
+static int nreplicas;
+
+// Load generator for the server: each of -c client processes runs -n
+// operations back to back and the totals are printed at the end.
+//
+//   write  - MFS_Write of 4 KB blocks into one file per client
+//   read   - MFS_Read of blocks written beforehand
+//   creat  - MFS_Creat followed by MFS_Unlink of a fresh name
+//   stat   - MFS_Lookup of the client's file followed by MFS_Stat of it
+//
+// With -q depth, write and read keep that many requests in flight through the
+// asynchronous API instead of waiting for each reply. With -r blocks, each
+// write or read operation moves that many blocks with MFS_WriteRange or
+// MFS_ReadRange instead. -b blocks turns on the client block cache. Each
+// -R host:port adds a backup whose reads the clients share with the server.
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c clients] [-n ops] [-m write|read|creat|stat] [-q depth] [-r blocks] [-b cache-blocks] [-R backup-host:port]...\n", prog);
+    exit(1);
+}
+
+// Runs one client; returns the number of failed operations
+static int run_client(const char *host, int port, int id, int ops, const char *mode, int depth, int range,
+                      int cache_blocks)
+{
+    if (MFS_Init((char *)host, port) != 0 || MFS_SetBlockCache(cache_blocks) != 0)
+        return ops;
+    for (int i = 0; i < nreplicas; i++)
+    {
+        if (MFS_AddReplica(0, replicas[i], port) != 0)
+            return ops;
+    }
+
+    char name[NAME_LEN];
+    snprintf(name, sizeof(name), "bench%d", id);
+    if (MFS_Creat(0, MFS_REGULAR_FILE, name) != 0)
+        return ops;
+    int inum = MFS_Lookup(0, name);
+    if (inum < 0)
+        return ops;
+
+    char buf[MFS_BLOCK_SIZE];
+    memset(buf, 'a' + id % 26, sizeof(buf));
+    if (strcmp(mode, "read") == 0)
+    {
+        for (int b = 0; b < FILE_BLOCKS; b++)
+            MFS_Write(inum, buf, b);
+    }
+
+    int failed = 0;
+    int data_mode = strcmp(mode, "write") == 0 || strcmp(mode, "read") == 0;
+    if (range > 1 && data_mode)
+    {
+        static char big[MAX_RANGE * MFS_BLOCK_SIZE];
+        memset(big, 'a' + id % 26, sizeof(big));
+        if (strcmp(mode, "read") == 0 && MFS_WriteRange(inum, big, 0, range) != 0)
+            return ops;
+        for (int i = 0; i < ops; i++)
+        {
+            int rc = strcmp(mode, "write") == 0 ? MFS_WriteRange(inum, big, 0, range) : MFS_ReadRange(inum, big, 0, range);
+            if (rc != 0)
+                failed++;
+        }
+        MFS_Unlink(0, name);
+        return failed;
+    }
+
+    if (depth > 1 && data_mode)
+    {
+        // Handles and buffers of in-flight requests, oldest collected first
+        int handles[MFS_MAX_INFLIGHT];
+        char bufs[MFS_MAX_INFLIGHT][MFS_BLOCK_SIZE];
+        for (int i = 0; i < ops + depth; i++)
+        {
+            int slot = i % depth;
+            if (i >= depth && MFS_Wait(handles[slot]) != 0)
+                failed++;
+            if (i >= ops)
+                continue;
+            if (strcmp(mode, "write") == 0)
+            {
+                memcpy(bufs[slot], buf, MFS_BLOCK_SIZE);
+                handles[slot] = MFS_WriteAsync(inum, bufs[slot], i % FILE_BLOCKS);
+            }
+            else
+            {
+                handles[slot] = MFS_ReadAsync(inum, bufs[slot], i % FILE_BLOCKS);
+            }
+        }
+        MFS_Unlink(0, name);
+        return failed;
+    }
+
+    for (int i = 0; i < ops; i++)
+    {
+        int rc;
+        if (strcmp(mode, "write") == 0)
+        {
+            rc = MFS_Write(inum, buf, i % FILE_BLOCKS);
+        }
+        else if (strcmp(mode, "read") == 0)
+        {
+            rc = MFS_Read(inum, buf, i % FILE_BLOCKS);
+        }
+        else if (strcmp(mode, "stat") == 0)
+        {
+            MFS_Stat_t m;
+            rc = MFS_Lookup(0, name) == inum && MFS_Stat(inum, &m) == 0 ? 0 : -1;
+        }
+        else
+        {
+            char tmp[NAME_LEN];
+            snprintf(tmp, sizeof(tmp), "b%d.%d", id, i);
+            rc = MFS_Creat(0, MFS_REGULAR_FILE, tmp);
+            if (rc == 0)
+                rc = MFS_Unlink(0, tmp);
+        }
+        if (rc != 0)
+            failed++;
+    }
+
+    MFS_Unlink(0, name);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "localhost";
+    const char *mode = "write";
+    int port = 12345;
+    int clients = 1;
+    int ops = 1000;
+    int depth = 1;
+    int range = 1;
+    int cache_blocks = 0;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "h:p:c:n:m:q:r:b:R:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            range = atoi(optarg);
+            break;
+        case 'b':
+            cache_blocks = atoi(optarg);
+            break;
+        case 'R':
+            if (nreplicas == MAX_REPLICAS)
+                usage(argv[0]);
+            replicas[nreplicas++] = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (clients < 1 || ops < 1 || depth < 1 || depth > MFS_MAX_INFLIGHT || range < 1 || range > MAX_RANGE ||
+        (strcmp(mode, "write") != 0 && strcmp(mode, "read") != 0 && strcmp(mode, "creat") != 0 &&
+         strcmp(mode, "stat") != 0))
+    {
+        usage(argv[0]);
+    }
+
+    double start = now();
+    for (int i = 0; i < clients; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0)
+        {
+            int failed = run_client(host, port, i, ops, mode, depth, range, cache_blocks);
+            exit(failed > 255 ? 255 : failed);
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        int status;
+        if (wait(&status) > 0 && WIFEXITED(status))
+            failed += WEXITSTATUS(status);
+    }
+    double elapsed = now() - start;
+
+    long total = (long)clients * ops;
+    printf("%s: %d client(s) x %d ops in %.3f s: %.0f ops/s, ", mode, clients, ops, elapsed, total / elapsed);
+    if (strcmp(mode, "write") == 0 || strcmp(mode, "read") == 0)
+        printf("%.1f MB/s, ", total * range * (MFS_BLOCK_SIZE / 1048576.0) / elapsed);
+    printf("%.1f us/op per client, %d failed\n", elapsed * 1e6 / ops, failed);
+    return failed != 0;
+}
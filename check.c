@@ -0,0 +1,533 @@
+#include "mfs.h"
+#include "proto.h" // Raw requests for the duplicate request cache check
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FILE_BLOCKS 40  // Blocks of d/f, written one at a time
+#define DIR_FILES 200   // d/e0.. are created and every third one removed
+#define RANGE_BLOCKS 40 // Blocks of d/r, written with one range
+#define HOLES 20        // d/h has every other block from HOLES_START on
+#define HOLES_START 60
+#define ASYNC_BLOCKS 16 // Blocks of "a" written and read asynchronously
+#define ROOT_DIRS 8     // Root directories s0.., spread over the shards
+#define MAX_REPLICAS 8
+#define MAX_CLIENTS 64 // Blocks of the shared file, one per client
+
+static char *replicas[MAX_REPLICAS]; // -R: backups of shard 0
+static int nreplicas;
+static int client; // -c: this client's number among concurrent ones
+static char prefix[8]; // Put before the names this client makes in the root
+static int failures;
+
+// Checks of the server and libmfs, for check.sh: "write" exercises the
+// requests on a fresh image and checks the answers, "verify" checks that a
+// restarted server (or a promoted backup) still has everything "write" left,
+// "wait" waits until servers just started answer, and "stop" shuts the
+// servers down.
+//
+//   d/f      - CREAT, LOOKUP, STAT, WRITE and READ
+//   d/e*     - a directory grown past one block, with entries removed
+//   d/r      - WRITE_RANGE and READ_RANGE
+//   d/h      - holes, and enough extents to need extent blocks
+//   d        - READDIR (plus)
+//   /d/f     - LOOKUP_PATH
+//   a, d/gone - the asynchronous API
+//   s*       - root entries, which a sharded namespace spreads over the
+//              shards; a non-empty one cannot be removed
+//   drc*     - a CREAT and an UNLINK each sent twice with one request id, the
+//              second answered from the duplicate request cache
+//   shared   - a file whose block N client N writes, and a directory common
+//              holding an entry cN for each client
+//
+// Clients run at once are told apart with -c N, which puts cN. before the
+// names above they make in the root; shared and common are the same for all.
+//
+// Without -R, "write" also checks that a block cached by this client is
+// called back when another client writes it.
+
+static void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Fills a block with contents that depend on tag and block
+static void fill(char *buf, int tag, int block)
+{
+    for (int i = 0; i < MFS_BLOCK_SIZE; i++)
+        buf[i] = (char)(tag * 31 + block * 7 + i % 251);
+}
+
+// Returns name with this client's prefix; the result lasts until the next call
+static char *in_root(const char *name)
+{
+    static char buf[MFS_NAME_LEN];
+    snprintf(buf, sizeof(buf), "%s%s", prefix, name);
+    return buf;
+}
+
+// Checks a block read back against fill(tag, block)
+static int same(const char *buf, int tag, int block)
+{
+    char want[MFS_BLOCK_SIZE];
+    fill(want, tag, block);
+    return memcmp(buf, want, MFS_BLOCK_SIZE) == 0;
+}
+
+// Sends req to the first of the comma-separated servers twice with the same
+// request id, and stores both statuses
+static int send_twice(const char *servers, mfs_hdr_t *req, int *first, int *second)
+{
+    char host[256];
+    snprintf(host, sizeof(host), "%s", servers);
+    host[strcspn(host, ",")] = '\0';
+    char *colon = strrchr(host, ':');
+    if (colon == NULL)
+        return -1;
+    *colon = '\0';
+
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        return -1;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval tv = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int rc = 0;
+    mfs_hdr_t reply;
+    for (int i = 0; i < 2 && rc == 0; i++)
+    {
+        if (sendto(fd, req, sizeof(*req), 0, res->ai_addr, res->ai_addrlen) != sizeof(*req) ||
+            recv(fd, &reply, sizeof(reply), 0) < (int)sizeof(reply))
+            rc = -1;
+        else
+            *(i == 0 ? first : second) = reply.status;
+    }
+    close(fd);
+    freeaddrinfo(res);
+    return rc;
+}
+
+// Returns the drc_replays counter of shard 0's server, or -1
+static long drc_replays(void)
+{
+    char buf[MFS_BLOCK_SIZE];
+    if (MFS_Stats(buf, sizeof(buf)) < 0)
+        return -1;
+    char *p = strstr(buf, "drc_replays ");
+    return p == NULL ? -1 : atol(p + strlen("drc_replays "));
+}
+
+static int connect_servers(const char *servers)
+{
+    if (MFS_Init((char *)servers, 0) != 0)
+        return -1;
+    for (int i = 0; i < nreplicas; i++)
+    {
+        if (MFS_AddReplica(0, replicas[i], 0) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Retries a STAT of the root of each shard, for up to 10 s, until it answers
+static void wait_servers(const char *servers)
+{
+    MFS_Timeouts_t quick = {100, 5, 100, 1};
+    MFS_SetTimeouts(&quick);
+    int ok = 1;
+    for (int shard = 0; ok; shard++)
+    {
+        MFS_Stat_t st;
+        ok = 0;
+        for (int i = 0; i < 100 && !ok; i++)
+            ok = MFS_Stat(shard * MFS_SHARD_SPAN, &st) == 0;
+        check(ok, "the servers answer");
+        if ((servers = strchr(servers, ',')) == NULL)
+            break;
+        servers++;
+    }
+}
+
+// d/f and the d/e* entries
+static void write_files(void)
+{
+    char buf[MFS_BLOCK_SIZE];
+
+    check(MFS_Creat(0, MFS_DIRECTORY, in_root("d")) == 0, "creat d");
+    int d = MFS_Lookup(0, in_root("d"));
+    check(MFS_Creat(d, MFS_REGULAR_FILE, "f") == 0, "creat d/f");
+    check(MFS_Creat(d, MFS_REGULAR_FILE, "f") == 0, "creat of an existing name succeeds");
+    int f = MFS_Lookup(d, "f");
+    int ok = 1;
+    for (int b = 0; b < FILE_BLOCKS; b++)
+    {
+        fill(buf, 1, b);
+        ok &= MFS_Write(f, buf, b) == 0;
+    }
+    check(ok, "write d/f");
+
+    char name[16];
+    for (int i = 0; i < DIR_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "e%d", i);
+        check(MFS_Creat(d, MFS_REGULAR_FILE, name) == 0, "creat d/e*");
+    }
+    for (int i = 0; i < DIR_FILES; i += 3)
+    {
+        snprintf(name, sizeof(name), "e%d", i);
+        check(MFS_Unlink(d, name) == 0, "unlink d/e*");
+    }
+    check(MFS_Unlink(d, "e0") == -1, "unlink of a missing name fails");
+    check(MFS_Unlink(0, in_root("d")) == -1, "unlink of a non-empty directory fails");
+}
+
+static void verify_files(void)
+{
+    char buf[MFS_BLOCK_SIZE];
+    MFS_Stat_t st;
+
+    int d = MFS_Lookup(0, in_root("d"));
+    int f = MFS_Lookup(d, "f");
+    check(d >= 0 && f >= 0, "lookup d/f");
+    check(MFS_Stat(d, &st) == 0 && st.type == MFS_DIRECTORY, "stat d");
+    check(MFS_Stat(f, &st) == 0 && st.type == MFS_REGULAR_FILE && st.size == FILE_BLOCKS * MFS_BLOCK_SIZE,
+          "stat d/f");
+    int ok = 1;
+    for (int b = 0; ok && b < FILE_BLOCKS; b++)
+        ok = MFS_Read(f, buf, b) == 0 && same(buf, 1, b);
+    check(ok, "read d/f");
+    check(MFS_Read(f, buf, FILE_BLOCKS) == -1, "a read past the end fails");
+
+    int live = 0, bad = 0;
+    for (int i = 0; i < DIR_FILES; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "e%d", i);
+        int e = MFS_Lookup(d, name);
+        live += e >= 0;
+        bad += (e >= 0) == (i % 3 == 0) || (e >= 0 && (MFS_Stat(e, &st) != 0 || st.type != MFS_REGULAR_FILE));
+    }
+    check(bad == 0 && live == DIR_FILES - (DIR_FILES + 2) / 3, "lookup d/e*");
+}
+
+// d/r, written and read as one range each
+static void write_range(void)
+{
+    static char range[RANGE_BLOCKS * MFS_BLOCK_SIZE];
+    int d = MFS_Lookup(0, in_root("d"));
+    check(MFS_Creat(d, MFS_REGULAR_FILE, "r") == 0, "creat d/r");
+    for (int b = 0; b < RANGE_BLOCKS; b++)
+        fill(range + (size_t)b * MFS_BLOCK_SIZE, 5, b);
+    check(MFS_WriteRange(MFS_Lookup(d, "r"), range, 0, RANGE_BLOCKS) == 0, "write range of d/r");
+}
+
+static void verify_range(void)
+{
+    static char range[RANGE_BLOCKS * MFS_BLOCK_SIZE];
+    MFS_Stat_t st;
+    int r = MFS_Lookup(MFS_Lookup(0, in_root("d")), "r");
+    check(MFS_Stat(r, &st) == 0 && st.size == RANGE_BLOCKS * MFS_BLOCK_SIZE, "stat d/r");
+    int ok = MFS_ReadRange(r, range, 0, RANGE_BLOCKS) == 0;
+    for (int b = 0; ok && b < RANGE_BLOCKS; b++)
+        ok = same(range + (size_t)b * MFS_BLOCK_SIZE, 5, b);
+    check(ok, "read range of d/r");
+    check(MFS_ReadRange(r, range, RANGE_BLOCKS - 1, 2) == -1, "a range read past the end fails");
+}
+
+// d/h: every other block, so that each is an extent of its own
+static void write_holes(void)
+{
+    char buf[MFS_BLOCK_SIZE];
+    int d = MFS_Lookup(0, in_root("d"));
+    check(MFS_Creat(d, MFS_REGULAR_FILE, "h") == 0, "creat d/h");
+    int h = MFS_Lookup(d, "h");
+    int ok = 1;
+    for (int i = 0; i < HOLES; i++)
+    {
+        fill(buf, 6, HOLES_START + 2 * i);
+        ok &= MFS_Write(h, buf, HOLES_START + 2 * i) == 0;
+    }
+    check(ok, "write d/h after its holes");
+}
+
+static void verify_holes(void)
+{
+    char buf[MFS_BLOCK_SIZE];
+    MFS_Stat_t st;
+    int h = MFS_Lookup(MFS_Lookup(0, in_root("d")), "h");
+    check(MFS_Stat(h, &st) == 0 && st.size == (HOLES_START + 2 * HOLES - 1) * MFS_BLOCK_SIZE, "stat d/h");
+    int ok = 1;
+    for (int i = 0; ok && i < HOLES; i++)
+        ok = MFS_Read(h, buf, HOLES_START + 2 * i) == 0 && same(buf, 6, HOLES_START + 2 * i);
+    check(ok, "read the blocks of d/h");
+    check(MFS_Read(h, buf, 0) == -1 && MFS_Read(h, buf, HOLES_START + 1) == -1, "a hole reads as an error");
+}
+
+// Lists d in small pieces, with attributes
+static void verify_readdir(void)
+{
+    int d = MFS_Lookup(0, in_root("d"));
+    int f = MFS_Lookup(d, "f");
+    MFS_DirEnt_t ents[50];
+    int cookie = 0, live = 0, bad = 0;
+    while (cookie != -1)
+    {
+        int n = MFS_ReadDir(d, &cookie, ents, 50, 1);
+        if (n < 0)
+        {
+            bad++;
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (ents[i].name[0] == 'e')
+            {
+                live++;
+                bad += atoi(ents[i].name + 1) % 3 == 0 || ents[i].type != MFS_REGULAR_FILE || ents[i].size != 0;
+            }
+            else if (strcmp(ents[i].name, "f") == 0)
+            {
+                bad += ents[i].inum != f || ents[i].size != FILE_BLOCKS * MFS_BLOCK_SIZE;
+            }
+        }
+    }
+    check(bad == 0 && live == DIR_FILES - (DIR_FILES + 2) / 3, "readdir of d");
+}
+
+static void verify_lookup_path(void)
+{
+    int d = MFS_Lookup(0, in_root("d"));
+    int f = MFS_Lookup(d, "f");
+    int inums[2], resolved = -1;
+    char path[64];
+    snprintf(path, sizeof(path), "/%sd//f", prefix);
+    check(MFS_LookupPath(0, path, inums, 2, &resolved) == f && resolved == 2 && inums[0] == d && inums[1] == f,
+          "lookup path /d//f");
+    snprintf(path, sizeof(path), "%sd/nope/f", prefix);
+    check(MFS_LookupPath(0, path, NULL, 0, &resolved) == -1 && resolved == 1, "lookup path d/nope/f");
+}
+
+// "a", written and read with requests in flight together, and d/gone
+static void write_async(void)
+{
+    static char bufs[ASYNC_BLOCKS][MFS_BLOCK_SIZE];
+    int h[ASYNC_BLOCKS];
+    check(MFS_Creat(0, MFS_REGULAR_FILE, in_root("a")) == 0, "creat a");
+    int a = MFS_Lookup(0, in_root("a"));
+    for (int b = 0; b < ASYNC_BLOCKS; b++)
+    {
+        fill(bufs[b], 3, b);
+        h[b] = MFS_WriteAsync(a, bufs[b], b);
+    }
+    int ok = 1;
+    for (int b = 0; b < ASYNC_BLOCKS; b++)
+        ok &= MFS_Wait(h[b]) == 0;
+    check(ok, "asynchronous writes of a");
+    int d = MFS_Lookup(0, in_root("d"));
+    check(MFS_Wait(MFS_CreatAsync(d, MFS_REGULAR_FILE, "gone")) == 0, "asynchronous creat");
+    check(MFS_Wait(MFS_UnlinkAsync(d, "gone")) == 0, "asynchronous unlink");
+}
+
+static void verify_async(void)
+{
+    static char bufs[ASYNC_BLOCKS][MFS_BLOCK_SIZE];
+    int h[ASYNC_BLOCKS];
+    int a = MFS_Lookup(0, in_root("a"));
+    for (int b = 0; b < ASYNC_BLOCKS; b++)
+        h[b] = MFS_ReadAsync(a, bufs[b], b);
+    int ok = a >= 0;
+    for (int b = 0; b < ASYNC_BLOCKS; b++)
+        ok &= MFS_Wait(h[b]) == 0 && same(bufs[b], 3, b);
+    check(ok, "asynchronous reads of a");
+    check(MFS_Lookup(MFS_Lookup(0, in_root("d")), "gone") == -1, "d/gone is gone");
+}
+
+// s0.., each holding a file x
+static void write_root_dirs(void)
+{
+    char buf[MFS_BLOCK_SIZE], name[MFS_NAME_LEN];
+    for (int i = 0; i < ROOT_DIRS; i++)
+    {
+        snprintf(name, sizeof(name), "%ss%d", prefix, i);
+        check(MFS_Creat(0, MFS_DIRECTORY, name) == 0, "creat s*");
+        int s = MFS_Lookup(0, name);
+        check(MFS_Creat(s, MFS_REGULAR_FILE, "x") == 0, "creat s*/x");
+        fill(buf, 4 + i, 0);
+        check(MFS_Write(MFS_Lookup(s, "x"), buf, 0) == 0, "write s*/x");
+        check(MFS_Unlink(0, name) == -1 && MFS_Lookup(0, name) == s, "a non-empty s* stays");
+    }
+}
+
+static void verify_root_dirs(void)
+{
+    char buf[MFS_BLOCK_SIZE], name[MFS_NAME_LEN];
+    int ok = 1;
+    for (int i = 0; i < ROOT_DIRS; i++)
+    {
+        snprintf(name, sizeof(name), "%ss%d", prefix, i);
+        int s = MFS_Lookup(0, name);
+        int x = MFS_Lookup(s, "x");
+        ok &= s >= 0 && x >= 0 && MFS_Read(x, buf, 0) == 0 && same(buf, 4 + i, 0);
+    }
+    check(ok, "root directories s*");
+}
+
+// drc and drc2, each changed by a request sent twice
+static void write_drc(const char *servers)
+{
+    mfs_hdr_t req = {0};
+    req.magic = MFS_PROTO_MAGIC;
+    req.version = MFS_PROTO_VERSION;
+    req.opcode = MFS_OP_CREAT;
+    req.client_id = getpid() ^ 0x5a5a0000;
+    req.req_id = 1;
+    req.inum = 0;
+    req.arg0 = MFS_REGULAR_FILE;
+    strcpy(req.name, in_root("drc"));
+    // A CREAT run again would succeed too, so the replay is told by the
+    // counter, which other clients' retransmissions may also raise
+    long replays = drc_replays();
+    int first = -2, second = -2;
+    check(send_twice(servers, &req, &first, &second) == 0 && first == 0 && second == 0,
+          "a retransmitted creat gets the first reply");
+    check(replays >= 0 && drc_replays() > replays, "the retransmitted creat was replayed");
+    check(MFS_Creat(0, MFS_REGULAR_FILE, in_root("drc2")) == 0, "creat drc2");
+    req.opcode = MFS_OP_UNLINK;
+    req.req_id = 2;
+    strcpy(req.name, in_root("drc2"));
+    replays = drc_replays();
+    first = second = -2;
+    check(send_twice(servers, &req, &first, &second) == 0 && first == 0 && second == 0,
+          "a retransmitted unlink gets the first reply");
+    check(replays >= 0 && drc_replays() > replays, "the retransmitted unlink was replayed");
+}
+
+static void verify_drc(void)
+{
+    check(MFS_Lookup(0, in_root("drc")) >= 0 && MFS_Lookup(0, in_root("drc2")) == -1, "drc exists and drc2 does not");
+}
+
+// Block client of shared, and the entry for this client in common
+static void write_shared(void)
+{
+    char buf[MFS_BLOCK_SIZE], name[16];
+    check(MFS_Creat(0, MFS_REGULAR_FILE, "shared") == 0, "creat shared");
+    fill(buf, 8, client);
+    check(MFS_Write(MFS_Lookup(0, "shared"), buf, client) == 0, "write shared");
+    check(MFS_Creat(0, MFS_DIRECTORY, "common") == 0, "creat common");
+    int common = MFS_Lookup(0, "common");
+    snprintf(name, sizeof(name), "c%d", client);
+    check(MFS_Creat(common, MFS_REGULAR_FILE, name) == 0, "creat common/c*");
+}
+
+static void verify_shared(void)
+{
+    char buf[MFS_BLOCK_SIZE], name[16];
+    check(MFS_Read(MFS_Lookup(0, "shared"), buf, client) == 0 && same(buf, 8, client), "read shared");
+    snprintf(name, sizeof(name), "c%d", client);
+    check(MFS_Lookup(MFS_Lookup(0, "common"), name) >= 0, "lookup common/c*");
+}
+
+// Another client writes a block of d/f this one has cached
+static void write_callback(const char *servers)
+{
+    char buf[MFS_BLOCK_SIZE];
+    int f = MFS_Lookup(MFS_Lookup(0, in_root("d")), "f");
+    check(MFS_SetBlockCache(64) == 0 && MFS_Read(f, buf, 0) == 0 && MFS_Read(f, buf, 0) == 0, "cache a block");
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        MFS_Init((char *)servers, 0);
+        fill(buf, 2, 0);
+        exit(MFS_Write(f, buf, 0) == 0 ? 0 : 1);
+    }
+    int status;
+    check(pid > 0 && waitpid(pid, &status, 0) == pid && status == 0, "another client writes the block");
+    usleep(100000); // Room for the callback to arrive
+    check(MFS_Read(f, buf, 0) == 0 && same(buf, 2, 0), "the cached block was called back");
+    fill(buf, 1, 0);
+    check(MFS_Write(f, buf, 0) == 0, "rewrite d/f block 0");
+    MFS_SetBlockCache(0);
+}
+
+// Checks everything "write" left
+static void verify(void)
+{
+    verify_files();
+    verify_range();
+    verify_holes();
+    verify_readdir();
+    verify_lookup_path();
+    verify_async();
+    verify_root_dirs();
+    verify_drc();
+    verify_shared();
+}
+
+static void write_phase(const char *servers)
+{
+    write_files();
+    write_range();
+    write_holes();
+    write_async();
+    write_root_dirs();
+    write_drc(servers);
+    write_shared();
+    if (nreplicas == 0)
+        write_callback(servers); // A backup gives no callbacks
+    verify();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c client] [-R backup-host:port]... host:port[,host:port]... write|verify|wait|stop\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+    int ch;
+    while ((ch = getopt(argc, argv, "c:R:")) != -1)
+    {
+        if (ch == 'c' && (client = atoi(optarg)) >= 0 && client < MAX_CLIENTS)
+            snprintf(prefix, sizeof(prefix), "c%d.", client);
+        else if (ch == 'R' && nreplicas < MAX_REPLICAS)
+            replicas[nreplicas++] = optarg;
+        else
+            usage(argv[0]);
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+    const char *servers = argv[optind], *phase = argv[optind + 1];
+    if (connect_servers(servers) != 0)
+    {
+        printf("FAIL: cannot reach %s\n", servers);
+        return 1;
+    }
+
+    if (strcmp(phase, "write") == 0)
+        write_phase(servers);
+    else if (strcmp(phase, "verify") == 0)
+        verify();
+    else if (strcmp(phase, "wait") == 0)
+        wait_servers(servers);
+    else if (strcmp(phase, "stop") == 0)
+        check(MFS_Shutdown() == 0, "shutdown");
+    else
+        usage(argv[0]);
+    printf("%s %s: %d failure(s)\n", servers, phase, failures);
+    return failures > 0;
+}
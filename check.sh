@@ -0,0 +1,167 @@
+#!/bin/sh
+# Scripted checks of the server, run by "make test". Each setup makes fresh
+# images, starts the servers, exercises the requests with "./check write",
+# shuts the servers down, restarts them on the same images and checks with
+# "./check verify" that everything is still there. "./check wait" waits for
+# servers just started to answer, and the script waits for stopped servers
+# to exit:
+#
+#   fixed       - an image made by mkfs
+#   lfs         - a log-structured image made by the server (-L)
+#   sharded     - two shards (-S)
+#   replicated  - a primary with one backup (-B/-R); the backup's image is
+#                 verified on its own afterwards, by restarting it as a primary
+#   threaded    - four worker threads (-t) and a second port (-P), with four
+#                 clients at once, two on each port
+#   grouped     - four worker threads committing in groups (-g/-G) through
+#                 io_uring (-U), with the inode table read lazily (-l) and
+#                 four clients at once
+#   uncached    - no block cache (-c 0)
+#
+# Servers listen on ports from $CHECK_PORT (23400) on. Prints a line per
+# setup and exits non-zero if any check failed.
+
+cd "$(dirname "$0")" || exit 1
+port=${CHECK_PORT:-23400}
+dir=$(mktemp -d /tmp/mfs-check.XXXXXX) || exit 1
+failed=0
+pids=
+trap 'kill $pids 2>/dev/null' EXIT # Servers a failed check left running
+
+# start PORT IMAGE [OPTION]...: starts a server in the background
+start() {
+    p=$1
+    img=$2
+    shift 2
+    ./server "$@" "$p" "$dir/$img" >>"$dir/$img.log" 2>&1 &
+    pids="$pids $!"
+}
+
+# stopped: waits for the servers a "./check stop" shut down to exit
+stopped() {
+    wait $pids
+    pids=
+}
+
+# run SETUP CHECK-ARGUMENT...: runs ./check, noting a failure
+run() {
+    setup=$1
+    shift
+    if ! ./check "$@" >>"$dir/$setup.out" 2>&1; then
+        failed=1
+        echo "$setup: ./check $* failed:"
+        grep FAIL "$dir/$setup.out"
+    fi
+}
+
+# work SETUP SERVERS PHASE: runs ./check PHASE on SERVERS or, if $clients
+# lists server lists, in one client per list at once (./check -c N)
+work() {
+    if [ -z "$clients" ]; then
+        run "$@"
+        return
+    fi
+    c=0
+    cpids=
+    for servers in $clients; do
+        (failed=0; run "$1.$c" -c $c "$servers" "$3"; exit $failed) &
+        cpids="$cpids $!"
+        c=$((c + 1))
+    done
+    for cpid in $cpids; do
+        wait "$cpid" || failed=1
+    done
+}
+
+# cycle SETUP SERVERS RESTART: write, stop, run RESTART, verify, stop
+cycle() {
+    run "$1" "$2" wait
+    work "$1" "$2" write
+    run "$1" "$2" stop
+    stopped
+    $3
+    run "$1" "$2" wait
+    work "$1" "$2" verify
+    run "$1" "$2" stop
+    stopped
+    echo "$1: done"
+}
+
+fixed() {
+    start $port fixed.img
+}
+./mkfs -f "$dir/fixed.img" -d 4096 -i 1024 >/dev/null
+fixed
+cycle fixed localhost:$port fixed
+
+lfs() {
+    start $port lfs.img
+}
+start $port lfs.img -L
+cycle lfs localhost:$port lfs
+
+sharded() {
+    start $port shard0.img -S 0
+    start $((port + 1)) shard1.img -S 1
+}
+./mkfs -f "$dir/shard0.img" -d 4096 -i 1024 >/dev/null
+./mkfs -f "$dir/shard1.img" -d 4096 -i 1024 >/dev/null
+sharded
+cycle sharded localhost:$port,localhost:$((port + 1)) sharded
+
+primary() {
+    start $((port + 1)) backup.img -R $((port + 2))
+    run replicated localhost:$((port + 1)) wait
+    start $port primary.img -B localhost:$((port + 2))
+    run replicated localhost:$port wait
+}
+./mkfs -f "$dir/primary.img" -d 4096 -i 1024 >/dev/null
+cp "$dir/primary.img" "$dir/backup.img"
+primary
+run replicated -R localhost:$((port + 1)) localhost:$port write
+run replicated localhost:$port stop # The backup stops with the stream
+stopped
+primary
+run replicated -R localhost:$((port + 1)) localhost:$port verify
+run replicated localhost:$port stop
+stopped
+start $port backup.img
+run replicated localhost:$port wait
+run replicated localhost:$port verify
+run replicated localhost:$port stop
+stopped
+echo "replicated: done"
+
+threaded() {
+    start $port threaded.img -t 4 -P $((port + 1))
+    run threaded localhost:$((port + 1)) wait
+}
+./mkfs -f "$dir/threaded.img" -d 4096 -i 2048 >/dev/null
+threaded
+clients="localhost:$port localhost:$((port + 1)) localhost:$port localhost:$((port + 1))"
+cycle threaded localhost:$port threaded
+clients=
+
+grouped() {
+    start $port grouped.img -t 4 -g 2000 -G 8 -U -l
+}
+./mkfs -f "$dir/grouped.img" -d 4096 -i 2048 >/dev/null
+grouped
+clients="localhost:$port localhost:$port localhost:$port localhost:$port"
+cycle grouped localhost:$port grouped
+clients=
+
+uncached() {
+    start $port uncached.img -c 0
+}
+./mkfs -f "$dir/uncached.img" -d 4096 -i 1024 >/dev/null
+uncached
+cycle uncached localhost:$port uncached
+
+if [ $failed -eq 0 ]; then
+    echo "All checks passed"
+    rm -rf "$dir"
+else
+    echo "Some checks failed; output and server logs are in $dir"
+fi
+exit $failed
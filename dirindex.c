@@ -0,0 +1,225 @@
+#include "dirindex.h" // Directory index interface
+#include "bcache.h"   // Directory blocks are read through the block cache
+#include "ufs.h"      // dir_ent_t, UFS_BLOCK_SIZE
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    dir_ent_t entries[DIRINDEX_ENTS_PER_BLOCK];
+} dir_block_t;
+
+struct dir_index
+{
+    int capacity;      // Number of positions (blocks * 128)
+    int count;         // Used positions
+    unsigned int mask; // Number of hash buckets - 1
+    int *buckets;      // Hash chain heads (position or -1)
+    int *next;         // Per position: next position in the same chain
+    int *inum;         // Per position: inode number, -1 if unused
+    char (*names)[28]; // Per position: entry name
+    int *free_stack;   // Unused positions
+    int nfree;         // Entries on free_stack
+};
+
+// FNV-1a over the name
+static unsigned int hash_name(const char *name)
+{
+    unsigned int h = 2166136261u;
+    for (; *name; name++)
+    {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+dir_index_t *dirindex_build(const unsigned int *blocks, int nblocks)
+{
+    dir_index_t *idx = calloc(1, sizeof(dir_index_t));
+    if (idx == NULL)
+        return NULL;
+
+    idx->capacity = nblocks * DIRINDEX_ENTS_PER_BLOCK;
+    unsigned int num_buckets = 256;
+    while (num_buckets < (unsigned int)idx->capacity)
+        num_buckets <<= 1;
+    idx->mask = num_buckets - 1;
+
+    idx->buckets = malloc(num_buckets * sizeof(int));
+    idx->next = malloc(idx->capacity * sizeof(int));
+    idx->inum = malloc(idx->capacity * sizeof(int));
+    idx->names = malloc(idx->capacity * sizeof(*idx->names));
+    idx->free_stack = malloc(idx->capacity * sizeof(int));
+    if (idx->buckets == NULL || idx->next == NULL || idx->inum == NULL || idx->names == NULL || idx->free_stack == NULL)
+    {
+        dirindex_free(idx);
+        return NULL;
+    }
+    memset(idx->buckets, -1, num_buckets * sizeof(int));
+
+    for (int i = 0; i < nblocks; i++)
+    {
+        dir_block_t dir_block;
+        bcache_read(blocks[i], &dir_block);
+        for (int j = 0; j < DIRINDEX_ENTS_PER_BLOCK; j++)
+        {
+            int pos = i * DIRINDEX_ENTS_PER_BLOCK + j;
+            if (dir_block.entries[j].inum == -1)
+            {
+                idx->inum[pos] = -1;
+                continue;
+            }
+            dir_block.entries[j].name[27] = '\0';
+            dirindex_insert(idx, pos, dir_block.entries[j].name, dir_block.entries[j].inum);
+        }
+    }
+
+    // Push free positions highest first so that the lowest is handed out first
+    for (int pos = idx->capacity - 1; pos >= 0; pos--)
+    {
+        if (idx->inum[pos] == -1)
+            idx->free_stack[idx->nfree++] = pos;
+    }
+    return idx;
+}
+
+void dirindex_free(dir_index_t *idx)
+{
+    if (idx == NULL)
+        return;
+    free(idx->buckets);
+    free(idx->next);
+    free(idx->inum);
+    free(idx->names);
+    free(idx->free_stack);
+    free(idx);
+}
+
+int dirindex_find(dir_index_t *idx, const char *name)
+{
+    for (int pos = idx->buckets[hash_name(name) & idx->mask]; pos != -1; pos = idx->next[pos])
+    {
+        if (strcmp(idx->names[pos], name) == 0)
+            return pos;
+    }
+    return -1;
+}
+
+int dirindex_inum(dir_index_t *idx, int pos)
+{
+    return idx->inum[pos];
+}
+
+int dirindex_next(dir_index_t *idx, int pos)
+{
+    for (; pos < idx->capacity; pos++)
+    {
+        if (idx->inum[pos] != -1)
+            return pos;
+    }
+    return -1;
+}
+
+const char *dirindex_name(dir_index_t *idx, int pos)
+{
+    return idx->names[pos];
+}
+
+int dirindex_count(dir_index_t *idx)
+{
+    return idx->count;
+}
+
+int dirindex_capacity(dir_index_t *idx)
+{
+    return idx->capacity;
+}
+
+int dirindex_add_block(dir_index_t *idx)
+{
+    int old = idx->capacity;
+    int capacity = old + DIRINDEX_ENTS_PER_BLOCK;
+
+    int *next = realloc(idx->next, capacity * sizeof(int));
+    if (next != NULL)
+        idx->next = next;
+    int *inum = realloc(idx->inum, capacity * sizeof(int));
+    if (inum != NULL)
+        idx->inum = inum;
+    char(*names)[28] = realloc(idx->names, capacity * sizeof(*idx->names));
+    if (names != NULL)
+        idx->names = names;
+    int *free_stack = realloc(idx->free_stack, capacity * sizeof(int));
+    if (free_stack != NULL)
+        idx->free_stack = free_stack;
+    if (next == NULL || inum == NULL || names == NULL || free_stack == NULL)
+        return -1;
+
+    // Keep chains short: double the buckets and rehash once positions outnumber them
+    if ((unsigned int)capacity > idx->mask + 1)
+    {
+        unsigned int num_buckets = (idx->mask + 1) * 2;
+        int *buckets = malloc(num_buckets * sizeof(int));
+        if (buckets == NULL)
+            return -1;
+        memset(buckets, -1, num_buckets * sizeof(int));
+        idx->mask = num_buckets - 1;
+        for (int pos = 0; pos < old; pos++)
+        {
+            if (idx->inum[pos] == -1)
+                continue;
+            unsigned int h = hash_name(idx->names[pos]) & idx->mask;
+            idx->next[pos] = buckets[h];
+            buckets[h] = pos;
+        }
+        free(idx->buckets);
+        idx->buckets = buckets;
+    }
+
+    idx->capacity = capacity;
+    for (int pos = capacity - 1; pos >= old; pos--)
+    {
+        idx->inum[pos] = -1;
+        idx->free_stack[idx->nfree++] = pos;
+    }
+    return 0;
+}
+
+int dirindex_alloc_slot(dir_index_t *idx)
+{
+    while (idx->nfree > 0)
+    {
+        int pos = idx->free_stack[--idx->nfree];
+        if (idx->inum[pos] == -1)
+            return pos;
+    }
+    return -1;
+}
+
+void dirindex_release_slot(dir_index_t *idx, int pos)
+{
+    idx->free_stack[idx->nfree++] = pos;
+}
+
+void dirindex_insert(dir_index_t *idx, int pos, const char *name, int inum)
+{
+    unsigned int h = hash_name(name) & idx->mask;
+    strncpy(idx->names[pos], name, sizeof(idx->names[pos]) - 1);
+    idx->names[pos][sizeof(idx->names[pos]) - 1] = '\0';
+    idx->inum[pos] = inum;
+    idx->next[pos] = idx->buckets[h];
+    idx->buckets[h] = pos;
+    idx->count++;
+}
+
+void dirindex_remove(dir_index_t *idx, int pos)
+{
+    int *p = &idx->buckets[hash_name(idx->names[pos]) & idx->mask];
+    while (*p != pos)
+        p = &idx->next[*p];
+    *p = idx->next[pos];
+    idx->inum[pos] = -1;
+    idx->count--;
+    idx->free_stack[idx->nfree++] = pos;
+}
@@ -0,0 +1,62 @@
+#ifndef __dirindex_h__
+#define __dirindex_h__
+
+// In-memory hash index over the entries of one directory.
+//
+// Every entry slot of the directory has a position, pos = block * 128 + slot,
+// where block is the block's number within the directory. The index maps
+// names to positions and keeps a stack of unused positions, so lookups,
+// duplicate checks and free-slot searches cost O(1) instead of a scan over
+// every directory block. The server builds an index the first time a
+// directory is used and keeps it in step with CREAT and UNLINK; the index
+// does no locking of its own.
+
+#define DIRINDEX_ENTS_PER_BLOCK (128)
+
+typedef struct dir_index dir_index_t;
+
+// Builds the index by reading the directory's blocks through the cache.
+// Returns NULL if memory runs out.
+dir_index_t *dirindex_build(const unsigned int *blocks, int nblocks);
+
+// Releases an index.
+void dirindex_free(dir_index_t *idx);
+
+// Returns the position of name, or -1 if it is not in the directory.
+int dirindex_find(dir_index_t *idx, const char *name);
+
+// Returns the inode number stored at pos.
+int dirindex_inum(dir_index_t *idx, int pos);
+
+// Returns the first used position at or after pos, or -1 if there is none.
+// Positions do not move, so a listing can resume from one.
+int dirindex_next(dir_index_t *idx, int pos);
+
+// Returns the name stored at pos.
+const char *dirindex_name(dir_index_t *idx, int pos);
+
+// Returns the number of used entries (including "." and "..").
+int dirindex_count(dir_index_t *idx);
+
+// Returns the number of positions (128 per directory block).
+int dirindex_capacity(dir_index_t *idx);
+
+// Adds the positions of one more, empty, directory block. Returns 0, or -1 if
+// memory runs out.
+int dirindex_add_block(dir_index_t *idx);
+
+// Takes an unused position off the free stack, or returns -1 if all
+// positions in the directory's blocks are in use.
+int dirindex_alloc_slot(dir_index_t *idx);
+
+// Puts back a position taken with dirindex_alloc_slot() that was never
+// filled.
+void dirindex_release_slot(dir_index_t *idx, int pos);
+
+// Records that pos now holds name -> inum.
+void dirindex_insert(dir_index_t *idx, int pos, const char *name, int inum);
+
+// Records that pos is unused again and puts it back on the free stack.
+void dirindex_remove(dir_index_t *idx, int pos);
+
+#endif // __dirindex_h__
@@ -0,0 +1,247 @@
+#include "diskio.h" // Batched image writes
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 256 // Submission queue size; larger batches go in chunks
+
+struct diskio_op
+{
+    int fsync;                // 1: fsync, 0: write
+    const struct iovec *iov;  // Write: buffers
+    int iovcnt;               // Write: entries in iov
+    off_t off;                // Write: image offset
+    size_t len;               // Write: total bytes
+};
+
+// The io_uring, driven with raw system calls
+static struct
+{
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} ring = {.fd = -1};
+
+static int image_fd = -1;
+static diskio_stats_t stats; // Counters, updated atomically
+
+static int ring_setup(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0)
+        return -1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_size > sq_size)
+        sq_size = cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    ring.fd = fd;
+    ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring.sqes = sqes;
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+int diskio_init(int fd, int use_uring)
+{
+    image_fd = fd;
+    if (use_uring && ring_setup() < 0)
+        perror("io_uring_setup (falling back to pwritev)");
+    stats.uring = ring.fd >= 0;
+    return stats.uring;
+}
+
+void diskio_batch_init(diskio_batch_t *b)
+{
+    b->ops = NULL;
+    b->count = 0;
+    b->capacity = 0;
+}
+
+static diskio_op_t *add_op(diskio_batch_t *b)
+{
+    if (b->count == b->capacity)
+    {
+        int capacity = b->capacity ? b->capacity * 2 : 16;
+        diskio_op_t *ops = realloc(b->ops, capacity * sizeof(diskio_op_t));
+        if (ops == NULL)
+            return NULL;
+        b->ops = ops;
+        b->capacity = capacity;
+    }
+    diskio_op_t *op = &b->ops[b->count++];
+    memset(op, 0, sizeof(*op));
+    return op;
+}
+
+int diskio_add_write(diskio_batch_t *b, const struct iovec *iov, int iovcnt, off_t off)
+{
+    diskio_op_t *op = add_op(b);
+    if (op == NULL)
+        return -1;
+    op->iov = iov;
+    op->iovcnt = iovcnt;
+    op->off = off;
+    for (int i = 0; i < iovcnt; i++)
+        op->len += iov[i].iov_len;
+    return 0;
+}
+
+int diskio_add_fsync(diskio_batch_t *b)
+{
+    diskio_op_t *op = add_op(b);
+    if (op == NULL)
+        return -1;
+    op->fsync = 1;
+    return 0;
+}
+
+static int submit_sync(diskio_batch_t *b)
+{
+    for (int i = 0; i < b->count; i++)
+    {
+        diskio_op_t *op = &b->ops[i];
+        __atomic_add_fetch(&stats.submits, 1, __ATOMIC_RELAXED);
+        if (op->fsync ? fsync(image_fd) < 0 : pwritev(image_fd, op->iov, op->iovcnt, op->off) != (ssize_t)op->len)
+        {
+            perror(op->fsync ? "diskio: fsync" : "diskio: pwritev");
+            return -1;
+        }
+        __atomic_add_fetch(&stats.ops, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Submits ops[0..n), at most RING_ENTRIES, and waits for all of them
+static int submit_chunk(diskio_op_t *ops, int n, int chain)
+{
+    unsigned int tail = *ring.sq_tail;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned int idx = tail & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = image_fd;
+        if (ops[i].fsync)
+        {
+            sqe->opcode = IORING_OP_FSYNC;
+            if (!chain)
+                sqe->flags = IOSQE_IO_DRAIN;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = (unsigned long)ops[i].iov;
+            sqe->len = ops[i].iovcnt;
+            sqe->off = ops[i].off;
+        }
+        if (chain && i < n - 1)
+            sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = i;
+        ring.sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    int rc = 0;
+    int submitted = 0, completed = 0;
+    while (completed < n)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring.fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0)
+        {
+            perror("diskio: io_uring_enter");
+            return -1;
+        }
+        submitted += ret;
+        __atomic_add_fetch(&stats.submits, 1, __ATOMIC_RELAXED);
+
+        unsigned int head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            diskio_op_t *op = &ops[cqe->user_data];
+            if (cqe->res < 0 || (!op->fsync && (size_t)cqe->res != op->len))
+            {
+                fprintf(stderr, "diskio: %s failed: %s\n", op->fsync ? "fsync" : "write",
+                        cqe->res < 0 ? strerror(-cqe->res) : "short write");
+                rc = -1;
+            }
+            else
+            {
+                __atomic_add_fetch(&stats.ops, 1, __ATOMIC_RELAXED);
+            }
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+
+int diskio_submit(diskio_batch_t *b)
+{
+    int rc = 0;
+    if (ring.fd < 0)
+    {
+        rc = submit_sync(b);
+    }
+    else
+    {
+        // One write per group: link the whole batch so a failure cancels the rest
+        int chain = 1;
+        for (int i = 0; i + 1 < b->count; i++)
+        {
+            if (!b->ops[i].fsync && !b->ops[i + 1].fsync)
+                chain = 0;
+        }
+
+        // A chunk boundary waits for everything before it, so ordering holds
+        for (int i = 0; i < b->count && rc == 0; i += RING_ENTRIES)
+        {
+            int n = b->count - i < RING_ENTRIES ? b->count - i : RING_ENTRIES;
+            rc = submit_chunk(b->ops + i, n, chain);
+        }
+    }
+    b->count = 0;
+    return rc;
+}
+
+void diskio_batch_free(diskio_batch_t *b)
+{
+    free(b->ops);
+    diskio_batch_init(b);
+}
+
+void diskio_get_stats(diskio_stats_t *st)
+{
+    st->uring = stats.uring;
+    st->submits = __atomic_load_n(&stats.submits, __ATOMIC_RELAXED);
+    st->ops = __atomic_load_n(&stats.ops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,64 @@
+#ifndef __diskio_h__
+#define __diskio_h__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Batched image writes for the commit path.
+//
+// A batch is a list of vectored writes and fsyncs. Writes between two fsyncs
+// may complete in any order; an fsync only starts once every earlier write
+// has completed, and nothing after it starts before it has. diskio_submit()
+// runs the whole batch and waits for it.
+//
+// With the io_uring backend the batch reaches the kernel in one
+// io_uring_enter() and the writes of a group run concurrently. The ring is
+// used synchronously, like the fallback: diskio_submit() still waits for
+// every completion, and reads do not go through it. A batch in
+// which every group is a single write (write, fsync, write, fsync, ...) is
+// submitted as one linked chain, so a failed write cancels everything after
+// it; otherwise each fsync is a drain barrier. The fallback backend issues
+// the same operations with pwritev() and fsync(), stopping at the first
+// failure. Calls to diskio_submit() must be serialized by the caller.
+
+typedef struct diskio_op diskio_op_t;
+
+typedef struct
+{
+    diskio_op_t *ops; // Queued operations
+    int count;        // Entries in ops
+    int capacity;     // Allocated entries
+} diskio_batch_t;
+
+typedef struct
+{
+    int uring;             // io_uring backend in use
+    unsigned long submits; // io_uring_enter() calls, or operations on the fallback path
+    unsigned long ops;     // Writes and fsyncs completed
+} diskio_stats_t;
+
+// Selects the backend for the image open on fd. With use_uring set, an
+// io_uring is set up; if the kernel does not allow it, the pwritev() path is
+// used instead. Returns 1 if io_uring is in use, 0 otherwise.
+int diskio_init(int fd, int use_uring);
+
+void diskio_batch_init(diskio_batch_t *b);
+
+// Queues a write of iov[0..iovcnt) at off. iov and the buffers it points to
+// must stay valid until diskio_submit() returns.
+int diskio_add_write(diskio_batch_t *b, const struct iovec *iov, int iovcnt, off_t off);
+
+// Queues an fsync of the image, ordered after every write queued before it.
+int diskio_add_fsync(diskio_batch_t *b);
+
+// Runs every queued operation, waits for them and empties the batch.
+// Returns 0, or -1 if any operation failed.
+int diskio_submit(diskio_batch_t *b);
+
+// Releases the batch's memory.
+void diskio_batch_free(diskio_batch_t *b);
+
+// Copies the current counters into st.
+void diskio_get_stats(diskio_stats_t *st);
+
+#endif // __diskio_h__
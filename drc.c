@@ -0,0 +1,115 @@
+#include "drc.h" // Duplicate request cache
+#include <pthread.h>
+#include <stdlib.h>
+
+#define WAYS 8          // Entries per set
+#define LOCK_STRIPES 64 // Set i is guarded by locks[i % LOCK_STRIPES]
+
+typedef struct
+{
+    int state;          // 0: unused, else DRC_RUNNING or DRC_DONE
+    uint32_t client_id; // Request holding the entry
+    uint32_t req_id;
+    int32_t status;     // DRC_DONE: result of the request
+    unsigned long age;  // When the entry was claimed
+} drc_entry_t;
+
+static drc_entry_t *table;
+static unsigned int mask;    // Sets - 1
+static unsigned long claims; // Requests cached so far
+static pthread_mutex_t locks[LOCK_STRIPES];
+static drc_stats_t stats; // Counters, updated atomically
+
+int drc_init(int entries)
+{
+    if (entries <= 0)
+        return 0;
+    unsigned int n = WAYS;
+    while (n < (unsigned int)entries)
+        n <<= 1;
+    table = calloc(n, sizeof(drc_entry_t));
+    if (table == NULL)
+        return -1;
+    mask = n / WAYS - 1;
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        pthread_mutex_init(&locks[i], NULL);
+    stats.entries = n;
+    return 0;
+}
+
+// Set of a request; the low bits of req_id vary fastest, so mix both ids
+static unsigned int set_index(uint32_t client_id, uint32_t req_id)
+{
+    uint32_t h = (client_id * 2654435761u) ^ req_id;
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h & mask;
+}
+
+int drc_begin(uint32_t client_id, uint32_t req_id, int32_t *status)
+{
+    if (table == NULL)
+        return DRC_NEW;
+
+    unsigned int i = set_index(client_id, req_id);
+    drc_entry_t *set = &table[(size_t)i * WAYS];
+    drc_entry_t *victim = NULL;
+    int rc = DRC_NEW;
+    pthread_mutex_lock(&locks[i % LOCK_STRIPES]);
+    for (int w = 0; w < WAYS; w++)
+    {
+        drc_entry_t *e = &set[w];
+        if (e->state != 0 && e->client_id == client_id && e->req_id == req_id)
+        {
+            rc = e->state;
+            *status = e->status;
+            break;
+        }
+        // Replace an unused entry, or else the oldest finished one
+        if (e->state != DRC_RUNNING &&
+            (victim == NULL || (victim->state != 0 && (e->state == 0 || e->age < victim->age))))
+            victim = e;
+    }
+    if (rc == DRC_NEW && victim != NULL)
+    {
+        victim->state = DRC_RUNNING;
+        victim->client_id = client_id;
+        victim->req_id = req_id;
+        victim->age = __atomic_add_fetch(&claims, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&locks[i % LOCK_STRIPES]);
+
+    if (rc == DRC_DONE)
+        __atomic_add_fetch(&stats.replays, 1, __ATOMIC_RELAXED);
+    else if (rc == DRC_RUNNING)
+        __atomic_add_fetch(&stats.drops, 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+void drc_finish(uint32_t client_id, uint32_t req_id, int32_t status)
+{
+    if (table == NULL)
+        return;
+
+    unsigned int i = set_index(client_id, req_id);
+    drc_entry_t *set = &table[(size_t)i * WAYS];
+    pthread_mutex_lock(&locks[i % LOCK_STRIPES]);
+    for (int w = 0; w < WAYS; w++)
+    {
+        if (set[w].state != 0 && set[w].client_id == client_id && set[w].req_id == req_id)
+        {
+            set[w].state = DRC_DONE;
+            set[w].status = status;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&locks[i % LOCK_STRIPES]);
+}
+
+void drc_get_stats(drc_stats_t *st)
+{
+    st->entries = stats.entries;
+    st->replays = __atomic_load_n(&stats.replays, __ATOMIC_RELAXED);
+    st->drops = __atomic_load_n(&stats.drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,53 @@
+#ifndef __drc_h__
+#define __drc_h__
+
+#include <stdint.h>
+
+// Duplicate request cache for mutations.
+//
+// A client retransmits a request whose reply is late, with the same client
+// and request ids. Executing a mutation again would repeat its disk writes
+// and its commit, and an UNLINK would fail the second time. drc_begin()
+// claims a new request before it runs; drc_finish() records its result once
+// the reply has been sent, which for a mutation is after it is durable. A
+// duplicate of a request still running is dropped (the client retransmits
+// again), and a duplicate of a finished one is answered with the recorded
+// result.
+//
+// The table is fixed-size and 8-way set-associative on the ids. A new
+// request replaces the oldest finished entry of its set, so a retransmission
+// arriving after its entry has been replaced runs again, as it would without
+// the cache. A request whose set is entirely held by requests still running
+// is not cached at all. All functions are thread-safe.
+
+enum
+{
+    DRC_NEW,     // Not seen before: execute it
+    DRC_RUNNING, // Duplicate of a request still running: drop it
+    DRC_DONE,    // Duplicate of a finished request: resend the result
+};
+
+typedef struct
+{
+    int entries;           // Size of the table (0: cache disabled)
+    unsigned long replays; // Duplicates answered from the cache
+    unsigned long drops;   // Duplicates dropped while running
+} drc_stats_t;
+
+// Sets up a table of at least entries entries, rounded up to a power of
+// two; 0 disables the cache. Returns 0, or -1 if memory runs out.
+int drc_init(int entries);
+
+// Looks up request (client_id, req_id) and claims an entry for it if it is
+// new. Returns DRC_NEW, DRC_RUNNING, or DRC_DONE with *status set to the
+// recorded result.
+int drc_begin(uint32_t client_id, uint32_t req_id, int32_t *status);
+
+// Records the result of a request claimed with drc_begin(). Does nothing for
+// a request that holds no entry.
+void drc_finish(uint32_t client_id, uint32_t req_id, int32_t status);
+
+// Copies the current counters into st.
+void drc_get_stats(drc_stats_t *st);
+
+#endif // __drc_h__
@@ -0,0 +1,152 @@
+#include "extmap.h" // Extent map interface
+#include <stdlib.h>
+#include <string.h>
+
+struct extent_map
+{
+    extent_t *e;  // Extents, sorted by lblk
+    int count;    // Entries in e
+    int capacity; // Allocated entries
+};
+
+extent_map_t *extmap_create(const extent_t *e, int n)
+{
+    extent_map_t *m = calloc(1, sizeof(extent_map_t));
+    if (m == NULL)
+        return NULL;
+    m->capacity = n > 8 ? n : 8;
+    m->e = malloc(m->capacity * sizeof(extent_t));
+    if (m->e == NULL)
+    {
+        free(m);
+        return NULL;
+    }
+    memcpy(m->e, e, n * sizeof(extent_t));
+    m->count = n;
+    return m;
+}
+
+void extmap_free(extent_map_t *m)
+{
+    if (m == NULL)
+        return;
+    free(m->e);
+    free(m);
+}
+
+// Returns the index of the last extent starting at or before lblk, or -1
+static int find(extent_map_t *m, unsigned int lblk)
+{
+    int lo = 0, hi = m->count; // The answer is lo - 1 once lo == hi
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (m->e[mid].lblk <= lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+unsigned int extmap_lookup(extent_map_t *m, unsigned int lblk, unsigned int *run)
+{
+    int i = find(m, lblk);
+    if (i < 0 || lblk - m->e[i].lblk >= m->e[i].len)
+    {
+        if (run != NULL)
+            *run = 0;
+        return -1;
+    }
+    unsigned int off = lblk - m->e[i].lblk;
+    if (run != NULL)
+        *run = m->e[i].len - off;
+    return m->e[i].pblk + off;
+}
+
+static void remove_at(extent_map_t *m, int i)
+{
+    memmove(&m->e[i], &m->e[i + 1], (m->count - i - 1) * sizeof(extent_t));
+    m->count--;
+}
+
+static void insert_at(extent_map_t *m, int i, extent_t x)
+{
+    memmove(&m->e[i + 1], &m->e[i], (m->count - i) * sizeof(extent_t));
+    m->e[i] = x;
+    m->count++;
+}
+
+int extmap_set(extent_map_t *m, unsigned int lblk, unsigned int pblk)
+{
+    // A split and an insertion add at most two extents
+    if (m->count + 2 > m->capacity)
+    {
+        int capacity = m->capacity * 2;
+        extent_t *e = realloc(m->e, capacity * sizeof(extent_t));
+        if (e == NULL)
+            return -1;
+        m->e = e;
+        m->capacity = capacity;
+    }
+
+    int first = m->count;
+    int i = find(m, lblk);
+    int pos = i + 1; // Where an extent starting at lblk goes
+
+    // Take lblk out of the extent holding it, if any
+    if (i >= 0 && lblk - m->e[i].lblk < m->e[i].len)
+    {
+        extent_t *x = &m->e[i];
+        unsigned int off = lblk - x->lblk;
+        if (x->pblk + off == pblk)
+            return m->count; // Already mapped there
+        extent_t right = {lblk + 1, x->pblk + off + 1, x->len - off - 1};
+        x->len = off;
+        first = i;
+        if (x->len == 0)
+        {
+            remove_at(m, i);
+            pos = i;
+        }
+        if (right.len > 0)
+            insert_at(m, pos, right);
+    }
+    if (pblk == (unsigned int)-1)
+        return first;
+
+    // Insert the new block, then merge it with its neighbours
+    insert_at(m, pos, (extent_t){lblk, pblk, 1});
+    if (pos < first)
+        first = pos;
+    if (pos + 1 < m->count && m->e[pos + 1].lblk == lblk + 1 && m->e[pos + 1].pblk == pblk + 1)
+    {
+        m->e[pos].len += m->e[pos + 1].len;
+        remove_at(m, pos + 1);
+    }
+    if (pos > 0 && m->e[pos - 1].lblk + m->e[pos - 1].len == lblk &&
+        m->e[pos - 1].pblk + m->e[pos - 1].len == pblk)
+    {
+        m->e[pos - 1].len += m->e[pos].len;
+        remove_at(m, pos);
+        first = pos - 1;
+    }
+    return first;
+}
+
+int extmap_count(extent_map_t *m)
+{
+    return m->count;
+}
+
+const extent_t *extmap_extents(extent_map_t *m)
+{
+    return m->e;
+}
+
+unsigned int extmap_end(extent_map_t *m)
+{
+    if (m->count == 0)
+        return 0;
+    return m->e[m->count - 1].lblk + m->e[m->count - 1].len;
+}
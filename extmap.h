@@ -0,0 +1,45 @@
+#ifndef __extmap_h__
+#define __extmap_h__
+
+#include "ufs.h" // extent_t
+
+// In-memory extent map of one file.
+//
+// Holds the file's extents (see inode_t) in one sorted array, whether the
+// inode keeps them inline or in extent blocks, so that mapping a file block
+// is a binary search. The array is always in canonical form: extents are
+// sorted by file block and two extents that are contiguous both in the file
+// and on disk are merged, so the same mapping always gives the same list.
+// The server builds a map the first time an inode's blocks are used and
+// writes the list back to the inode after each change; the map does no
+// locking of its own.
+
+typedef struct extent_map extent_map_t;
+
+// Creates a map holding extents e[0..n), which must be in canonical form.
+// Returns NULL if memory runs out.
+extent_map_t *extmap_create(const extent_t *e, int n);
+
+// Releases a map.
+void extmap_free(extent_map_t *m);
+
+// Returns the image block holding file block lblk, or -1 for a hole. If run
+// is not NULL, it is set to the number of blocks from lblk on that are
+// stored consecutively (0 for a hole).
+unsigned int extmap_lookup(extent_map_t *m, unsigned int lblk, unsigned int *run);
+
+// Maps file block lblk to image block pblk, or makes it a hole if pblk is -1,
+// splitting and merging extents as needed. Returns the index from which the
+// list differs from before (at least the number of extents if it does not
+// differ at all), or -1 if memory runs out, in which case the map is
+// unchanged.
+int extmap_set(extent_map_t *m, unsigned int lblk, unsigned int pblk);
+
+// Returns the number of extents and the extents themselves.
+int extmap_count(extent_map_t *m);
+const extent_t *extmap_extents(extent_map_t *m);
+
+// Returns the number of file blocks up to the end of the last extent.
+unsigned int extmap_end(extent_map_t *m);
+
+#endif // __extmap_h__
@@ -0,0 +1,318 @@
+#include "lfs.h"    // Log-structured engine interface
+#include "diskio.h" // The commit is one write, fsync, write, fsync chain
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INODES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(inode_t))
+#define PIECES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(imap_piece_t))
+#define LOG_RESERVE 4096 // Blocks at the end of the log kept from data blocks
+#define LOAD_RUN 64      // Most blocks lfs_load() reads with one call
+
+typedef struct
+{
+    dir_ent_t entries[128];
+} dir_block_t;
+
+static checkpoint_t cr;                    // In-memory checkpoint region
+static imap_piece_t imap[LFS_IMAP_PIECES]; // The whole inode map
+static char piece_dirty[LFS_IMAP_PIECES];  // Pieces changed since the last checkpoint
+static unsigned int log_end;               // Next free block; advanced atomically
+static unsigned long checkpoints;          // Checkpoints written since boot
+
+int lfs_is_image(int fd)
+{
+    unsigned int magic;
+    return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == LFS_MAGIC;
+}
+
+int lfs_format(int fd)
+{
+    // Block 0: checkpoint, 1: root directory, 2: root inode, 3: imap piece 0
+    char *blocks = calloc(4, UFS_BLOCK_SIZE);
+    if (blocks == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    dir_block_t *root_dir = (dir_block_t *)(blocks + 1 * UFS_BLOCK_SIZE);
+    strcpy(root_dir->entries[0].name, ".");
+    root_dir->entries[0].inum = 0;
+    strcpy(root_dir->entries[1].name, "..");
+    root_dir->entries[1].inum = 0;
+    for (int i = 2; i < 128; i++)
+        root_dir->entries[i].inum = -1;
+
+    inode_t *root = (inode_t *)(blocks + 2 * UFS_BLOCK_SIZE);
+    root->type = UFS_DIRECTORY;
+    root->size = 2 * sizeof(dir_ent_t);
+    root->nextents = 1;
+    root->extents[0] = (extent_t){0, 1, 1};
+
+    imap_piece_t *piece = (imap_piece_t *)(blocks + 3 * UFS_BLOCK_SIZE);
+    piece->inode_addr[0] = 2 * INODES_PER_BLOCK;
+
+    checkpoint_t *c = (checkpoint_t *)blocks;
+    c->magic = LFS_MAGIC;
+    c->log_end = 4;
+    c->imap[0] = 3 * PIECES_PER_BLOCK;
+
+    // Write the log first and the checkpoint last, as every commit does
+    int rc = 0;
+    if (pwrite(fd, blocks + UFS_BLOCK_SIZE, 3 * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE) != 3 * UFS_BLOCK_SIZE ||
+        fsync(fd) < 0 || pwrite(fd, blocks, UFS_BLOCK_SIZE, 0) != UFS_BLOCK_SIZE || fsync(fd) < 0)
+    {
+        perror("lfs_format");
+        rc = -1;
+    }
+    free(blocks);
+    return rc;
+}
+
+// An object lfs_load() reads: addr is in units of the object's size
+typedef struct
+{
+    unsigned int addr;
+    void *dst;
+} load_ent_t;
+
+static int cmp_load_addr(const void *a, const void *b)
+{
+    unsigned int x = ((const load_ent_t *)a)->addr, y = ((const load_ent_t *)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+// Reads the n objects of the given size listed in ents into their dst. Sorted
+// by address, the objects of one commit sit together in the log, so each run
+// of adjacent blocks that holds any is read with one call.
+static int load_objects(int fd, load_ent_t *ents, int n, size_t size)
+{
+    char *buf = malloc((size_t)LOAD_RUN * UFS_BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    qsort(ents, n, sizeof(load_ent_t), cmp_load_addr);
+    for (int i = 0; i < n;)
+    {
+        off_t first = (off_t)ents[i].addr * size / UFS_BLOCK_SIZE, last = first;
+        int j = i;
+        while (j < n)
+        {
+            off_t b = (off_t)ents[j].addr * size / UFS_BLOCK_SIZE;
+            if (b > last + 1 || b - first >= LOAD_RUN)
+                break;
+            last = b;
+            j++;
+        }
+        size_t len = (size_t)(last - first + 1) * UFS_BLOCK_SIZE;
+        if (pread(fd, buf, len, first * UFS_BLOCK_SIZE) != (ssize_t)len)
+        {
+            free(buf);
+            return -1;
+        }
+        for (; i < j; i++)
+            memcpy(ents[i].dst, buf + ((off_t)ents[i].addr * size - first * UFS_BLOCK_SIZE), size);
+    }
+    free(buf);
+    return 0;
+}
+
+int lfs_load(int fd, inode_t *inodes)
+{
+    if (pread(fd, &cr, sizeof(cr), 0) != sizeof(cr) || cr.magic != LFS_MAGIC)
+    {
+        fprintf(stderr, "lfs_load: bad checkpoint region\n");
+        return -1;
+    }
+    log_end = cr.log_end;
+    if (log_end >= LFS_MAX_BLOCKS - LOG_RESERVE)
+    {
+        fprintf(stderr, "lfs_load: the log is full (%u of %u blocks) and there is no cleaner; copy the files to a new image\n",
+                log_end, LFS_MAX_BLOCKS);
+        return -1;
+    }
+
+    load_ent_t *ents = malloc(LFS_MAX_INODES * sizeof(load_ent_t));
+    if (ents == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    memset(imap, 0, sizeof(imap));
+    int n = 0;
+    for (int p = 0; p < LFS_IMAP_PIECES; p++)
+    {
+        if (cr.imap[p] != 0)
+            ents[n++] = (load_ent_t){cr.imap[p], &imap[p]};
+    }
+    if (load_objects(fd, ents, n, sizeof(imap_piece_t)) < 0)
+    {
+        perror("lfs_load: imap");
+        free(ents);
+        return -1;
+    }
+
+    n = 0;
+    for (int i = 0; i < LFS_MAX_INODES; i++)
+    {
+        unsigned int addr = imap[i / LFS_IMAP_PIECE_ENTRIES].inode_addr[i % LFS_IMAP_PIECE_ENTRIES];
+        if (addr == 0)
+        {
+            memset(&inodes[i], 0, sizeof(inode_t));
+            inodes[i].type = -1; // Free
+            continue;
+        }
+        ents[n++] = (load_ent_t){addr, &inodes[i]};
+    }
+    int rc = load_objects(fd, ents, n, sizeof(inode_t));
+    if (rc < 0)
+        perror("lfs_load: inode");
+    free(ents);
+    return rc;
+}
+
+unsigned int lfs_alloc_block(int reserved)
+{
+    unsigned int limit = reserved ? LFS_MAX_BLOCKS - LOG_RESERVE / 2 : LFS_MAX_BLOCKS - LOG_RESERVE;
+    unsigned int blk = __atomic_load_n(&log_end, __ATOMIC_RELAXED);
+    do
+    {
+        if (blk >= limit)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&log_end, &blk, blk + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return blk;
+}
+
+// Gives back the segment lfs_commit() took at the end of the log, unless
+// blocks have been allocated after it since
+static void log_release(unsigned int start, int nblocks)
+{
+    unsigned int end = start + nblocks;
+    __atomic_compare_exchange_n(&log_end, &end, start, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+int lfs_commit(const int *inums, const inode_t *inodes, int n)
+{
+    // The inodes fill whole blocks at the start of this commit's segment and
+    // the dirty imap pieces follow them
+    int inode_blocks = (n + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    for (int i = 0; i < n; i++)
+    {
+        piece_dirty[inums[i] / LFS_IMAP_PIECE_ENTRIES] = 1;
+    }
+    int npieces = 0;
+    for (int p = 0; p < LFS_IMAP_PIECES; p++)
+    {
+        npieces += piece_dirty[p];
+    }
+    int piece_blocks = (npieces + PIECES_PER_BLOCK - 1) / PIECES_PER_BLOCK;
+    int nblocks = inode_blocks + piece_blocks;
+
+    // The log must be durable before the checkpoint can point into it. The
+    // new inode and piece locations are only built in the segment and in
+    // next; imap and cr take them once the batch is on disk, so a failed
+    // commit leaves the pieces dirty and the checkpoint as it was.
+    diskio_batch_t batch;
+    diskio_batch_init(&batch);
+    char *segment = NULL;
+    struct iovec seg_iov, cp_iov;
+    char block[UFS_BLOCK_SIZE] = {0};
+    checkpoint_t next = cr;
+    unsigned int start = 0;
+    int queued = 0;
+    if (nblocks > 0)
+    {
+        segment = calloc(nblocks, UFS_BLOCK_SIZE);
+        if (segment == NULL)
+        {
+            perror("calloc");
+            return -1;
+        }
+        start = __atomic_load_n(&log_end, __ATOMIC_RELAXED);
+        do
+        {
+            if (start + nblocks > LFS_MAX_BLOCKS)
+            {
+                fprintf(stderr, "lfs_commit: the log is full\n");
+                free(segment);
+                return -1;
+            }
+        } while (!__atomic_compare_exchange_n(&log_end, &start, start + nblocks, 1, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(segment + i * sizeof(inode_t), &inodes[i], sizeof(inode_t));
+        }
+
+        imap_piece_t *pieces = (imap_piece_t *)(segment + (size_t)inode_blocks * UFS_BLOCK_SIZE);
+        unsigned int piece_base = (start + inode_blocks) * PIECES_PER_BLOCK;
+        int slot[LFS_IMAP_PIECES];
+        for (int p = 0, k = 0; p < LFS_IMAP_PIECES; p++)
+        {
+            if (!piece_dirty[p])
+                continue;
+            pieces[k] = imap[p];
+            next.imap[p] = piece_base + k;
+            slot[p] = k++;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            pieces[slot[inums[i] / LFS_IMAP_PIECE_ENTRIES]].inode_addr[inums[i] % LFS_IMAP_PIECE_ENTRIES] =
+                inodes[i].type == -1 ? 0 : start * INODES_PER_BLOCK + i;
+        }
+
+        // One sequential write appends the whole segment
+        seg_iov.iov_base = segment;
+        seg_iov.iov_len = (size_t)nblocks * UFS_BLOCK_SIZE;
+        queued |= diskio_add_write(&batch, &seg_iov, 1, (off_t)start * UFS_BLOCK_SIZE);
+    }
+    queued |= diskio_add_fsync(&batch);
+
+    // Without a remapped inode the checkpoint is still current
+    if (nblocks > 0)
+    {
+        next.log_end = __atomic_load_n(&log_end, __ATOMIC_RELAXED);
+        memcpy(block, &next, sizeof(next));
+        cp_iov.iov_base = block;
+        cp_iov.iov_len = UFS_BLOCK_SIZE;
+        queued |= diskio_add_write(&batch, &cp_iov, 1, 0);
+        queued |= diskio_add_fsync(&batch);
+    }
+
+    int rc = queued < 0 ? -1 : diskio_submit(&batch);
+    diskio_batch_free(&batch);
+    if (rc < 0)
+    {
+        fprintf(stderr, "lfs_commit: commit failed\n");
+        if (nblocks > 0)
+            log_release(start, nblocks);
+        free(segment);
+        return -1;
+    }
+    if (nblocks > 0)
+    {
+        imap_piece_t *pieces = (imap_piece_t *)(segment + (size_t)inode_blocks * UFS_BLOCK_SIZE);
+        for (int p = 0, k = 0; p < LFS_IMAP_PIECES; p++)
+        {
+            if (!piece_dirty[p])
+                continue;
+            imap[p] = pieces[k++];
+            piece_dirty[p] = 0;
+        }
+        cr = next;
+        checkpoints++;
+    }
+    free(segment);
+    return 0;
+}
+
+void lfs_get_stats(unsigned int *end, unsigned long *count)
+{
+    *end = __atomic_load_n(&log_end, __ATOMIC_RELAXED);
+    *count = checkpoints;
+}
@@ -0,0 +1,48 @@
+#ifndef __lfs_h__
+#define __lfs_h__
+
+#include "ufs.h"
+
+// Log-structured storage engine.
+//
+// Data and directory blocks are never overwritten: every write goes to a new
+// block taken from the end of the log with lfs_alloc_block(), and the server
+// points the inode at it. lfs_commit() then appends the changed inodes and
+// the inode map pieces that reference them, makes the log durable and
+// finally rewrites the checkpoint region in place. A crash before the
+// checkpoint write leaves the previous checkpoint, and everything it
+// references, untouched.
+//
+// There is no cleaner: blocks superseded by later writes are never reused, so
+// the log only grows, up to LFS_MAX_BLOCKS (ufs.h). Once it gets there every
+// write fails, and the server refuses to start on such an image.
+
+// Returns 1 if the image open on fd starts with a checkpoint region.
+int lfs_is_image(int fd);
+
+// Writes a fresh image to fd: checkpoint region, root directory (inode 0)
+// with "." and "..", and the inode map piece that points to it.
+int lfs_format(int fd);
+
+// Reads the checkpoint region and the whole inode map into memory, then
+// every live inode into inodes[0..LFS_MAX_INODES). Free inodes get type -1.
+// Fails, with a message printed, if the log is full.
+int lfs_load(int fd, inode_t *inodes);
+
+// Returns the address of a fresh block at the end of the log, or -1 if the
+// log is full. Data blocks stop short of the end, so that the inodes and
+// inode map pieces of the last commits still fit; reserved blocks (the
+// extent blocks of an inode, written at commit time) may use that room.
+unsigned int lfs_alloc_block(int reserved);
+
+// Appends the given inodes (type -1 frees the inode) and the inode map pieces
+// covering them, fsyncs the log, then writes and fsyncs the checkpoint, all as
+// one diskio batch (see diskio.h). Dirty
+// cached blocks must already have been flushed by the caller. Calls must be
+// serialized by the caller.
+int lfs_commit(const int *inums, const inode_t *inodes, int n);
+
+// Returns the current end of the log and the number of checkpoints written.
+void lfs_get_stats(unsigned int *log_end, unsigned long *checkpoints);
+
+#endif // __lfs_h__
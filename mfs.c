@@ -1,4 +1,7 @@
+#define _GNU_SOURCE // sendmmsg()
+
 #include "mfs.h"        // Header file for MFS functions and definitions
+#include "proto.h"      // Wire protocol shared with the server
 #include <arpa/inet.h>  // Definitions for internet operations
 #include <netdb.h>      // Definitions for network database operations like getaddrinfo
 #include <netinet/in.h> // Internet address family
@@ -6,85 +9,759 @@
 #include <stdlib.h>     // Standard library for memory allocation and process control
 #include <string.h>     // String manipulation functions
 #include <sys/socket.h> // Socket functions and data structures
+#include <sys/time.h>   // gettimeofday for seeding the client id
+#include <sys/uio.h>    // Scatter/gather I/O vectors
+#include <time.h>       // clock_gettime for retransmission deadlines
 #include <unistd.h>     // Standard symbolic constants and types
 
-#define TIMEOUT 5 // Timeout for socket operations in seconds
+#define RCVBUF_BYTES (4 << 20) // Room for the replies of many outstanding requests
+#define RANGE_WINDOW 4         // Range requests kept in flight by MFS_ReadRange/WriteRange
+#define MAX_FRAGS (MFS_MAX_RANGE / MFS_FRAG_BLOCKS)
+
+int sockfd;         // Socket file descriptor
+uint32_t client_id; // Identifies this client in request headers
+uint32_t next_seq;  // Sequence number of the next request id
+
+// Outstanding table: one slot per request that has been submitted and not
+// yet collected with MFS_Wait() or MFS_Poll(). A request id is the slot
+// index in the low bits and a sequence number above them, so a reply finds
+// its slot directly and a late reply to an earlier user of the slot is
+// recognized and dropped.
+#define SLOT_BITS 6 // 1 << SLOT_BITS == MFS_MAX_INFLIGHT
+typedef struct
+{
+    int in_use;           // Slot holds a request
+    int done;             // Reply received (or retries exhausted)
+    int result;           // Value the synchronous call would return
+    int retries;          // Transmissions left
+    int sent;             // Transmissions so far
+    double first_sent;    // Time of the first transmission
+    double deadline;      // When to retransmit
+    mfs_hdr_t req;        // Request header, kept for retransmission
+    const char *data;     // Request payload (req.len bytes, or a whole WRITE_RANGE)
+    char *reply_data;     // Where the reply payload goes, or NULL
+    int reply_cap;        // Room at reply_data
+    MFS_Stat_t *stat;     // STAT: where the attributes go
+    unsigned int have;    // READ_RANGE: bit i set once fragment i has arrived
+    int nocache;          // READ: a callback for the inode came in meanwhile
+    int cookie;           // READDIR: where the listing continues
+    int resolved;         // LOOKUP_PATH: components resolved
+    int last;             // LOOKUP_PATH: inode of the last component resolved
+    int shard;            // Shard the request goes to
+    int replica;          // Its server: 0 for the primary, i for backup i - 1
+} slot_t;
+
+static slot_t slots[MFS_MAX_INFLIGHT];
+
+// Retransmission timeout (see MFS_Timeouts_t), estimated as in RFC 6298.
+// Only requests that were sent once are timed, since a reply to a
+// retransmitted one could answer either transmission (Karn's algorithm). So
+// that requests slower than the timeout still get timed eventually, a
+// timeout also doubles the base timeout until the next measurement.
+typedef struct
+{
+    int valid;     // At least one round trip measured
+    double srtt;   // Smoothed round-trip time, in seconds
+    double rttvar; // Its smoothed mean deviation
+    double rto;    // Timeout of a first transmission
+} rtt_t;
+
+// Servers, one per shard in the order given to MFS_Init(); a request goes
+// to the shard owning its inode number (see MFS_SHARD_SPAN), and each server
+// has a timeout of its own. Reads may also go to a shard's backups (see
+// MFS_AddReplica()).
+#define MAX_REPLICAS 8
+typedef struct
+{
+    struct sockaddr_in addr;
+    rtt_t rtt;
+    double down_until; // Backup: skipped for reads until then, after a timeout
+} server_t;
 
-int sockfd;                     // Socket file descriptor
-struct sockaddr_in server_addr; // Server address structure
+static MFS_Timeouts_t policy = {1000, 5, 5000, 10};
+static server_t shards[MFS_MAX_SHARDS];
+static int nshards;
+static server_t replicas[MFS_MAX_SHARDS][MAX_REPLICAS];
+static int nreplicas[MFS_MAX_SHARDS];
+static unsigned int next_replica; // Round-robin position for reads
+static unsigned long retransmit_count;
+static uint32_t jitter_state; // xorshift32 state, never 0
 
-// Function to send a request to the server and receive a response
-int send_receive(char *send_buffer, char *recv_buffer)
+// Derives the timeout from the estimate, within the policy's bounds
+static void rtt_update_rto(rtt_t *e)
 {
-    struct sockaddr_in from;          // Address structure for the source of the response
-    socklen_t fromlen = sizeof(from); // Length of the address structure
-    fd_set read_fds;                  // File descriptor set for select
-    struct timeval tv;                // Timeout structure
+    e->rto = e->srtt + 4 * e->rttvar;
+    if (e->rto < policy.min_ms / 1000.0)
+        e->rto = policy.min_ms / 1000.0;
+    if (e->rto > policy.max_ms / 1000.0)
+        e->rto = policy.max_ms / 1000.0;
+}
+
+// Folds a measured round trip of r seconds into the estimate
+static void rtt_sample(rtt_t *e, double r)
+{
+    if (!e->valid)
+    {
+        e->srtt = r;
+        e->rttvar = r / 2;
+        e->valid = 1;
+    }
+    else
+    {
+        double err = e->srtt - r;
+        e->rttvar = 0.75 * e->rttvar + 0.25 * (err < 0 ? -err : err);
+        e->srtt = 0.875 * e->srtt + 0.125 * r;
+    }
+    rtt_update_rto(e);
+}
 
-    int retries = 5; // Number of retries
-    while (retries > 0)
+// Timeout of the sent'th transmission of a request: the base timeout
+// doubled for each earlier one, capped, then jittered by up to 25%
+static double rtt_timeout(const rtt_t *e, int sent)
+{
+    double t = e->valid ? e->rto : policy.initial_ms / 1000.0;
+    for (int i = 1; i < sent && t < policy.max_ms / 1000.0; i++)
+        t *= 2;
+    if (t > policy.max_ms / 1000.0)
+        t = policy.max_ms / 1000.0;
+    if (sent > 1)
     {
-        // Send the request to the server
-        if (sendto(sockfd, send_buffer, strlen(send_buffer), 0, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        jitter_state ^= jitter_state << 13;
+        jitter_state ^= jitter_state >> 17;
+        jitter_state ^= jitter_state << 5;
+        t *= 0.75 + 0.5 * (jitter_state / 4294967296.0);
+    }
+    return t;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Lookup and attribute cache. LOOKUP and STAT answers are reused for as long
+// as the server's lease allows (see mfs_lease_t). Each is tagged with the
+// version of the directory or inode it was read at; the latest version seen
+// of every inode is recorded, and an entry tagged with any other version is
+// stale. This client's own CREAT, UNLINK and WRITE drop what they change right
+// away. The tables are direct-mapped: a new entry replaces whatever was in
+// its slot.
+#define CACHE_SLOTS 1024
+
+typedef struct
+{
+    int valid;
+    int pinum;               // Directory searched
+    char name[MFS_NAME_LEN]; // Name looked up
+    int inum;                // Answer
+    uint32_t version;        // Directory version of the answer
+    double expires;          // End of the lease
+} name_entry_t;
+
+typedef struct
+{
+    int valid;
+    int inum;         // Inode
+    int type;         // Attributes
+    int size;
+    uint32_t version; // Inode version of the attributes
+    double expires;   // End of the lease
+} attr_entry_t;
+
+typedef struct
+{
+    int valid;
+    int inum;         // Inode
+    uint32_t version; // Latest version seen
+} version_entry_t;
+
+static name_entry_t name_cache[CACHE_SLOTS];
+static attr_entry_t attr_cache[CACHE_SLOTS];
+static version_entry_t versions[CACHE_SLOTS];
+static unsigned long cache_hits, cache_misses;
+
+static unsigned int name_slot(int pinum, const char *name)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)pinum;
+    for (; *name; name++)
+    {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h % CACHE_SLOTS;
+}
+
+// Records the version of inum carried by a reply
+static void note_version(int inum, uint32_t version)
+{
+    version_entry_t *v = &versions[(unsigned int)inum % CACHE_SLOTS];
+    v->valid = 1;
+    v->inum = inum;
+    v->version = version;
+}
+
+// Returns whether version is still the latest known version of inum
+static int version_current(int inum, uint32_t version)
+{
+    version_entry_t *v = &versions[(unsigned int)inum % CACHE_SLOTS];
+    return !v->valid || v->inum != inum || v->version == version;
+}
+
+// Returns the cached inode number of name in pinum, or -1
+static int name_cache_get(int pinum, const char *name)
+{
+    name_entry_t *e = &name_cache[name_slot(pinum, name)];
+    if (!e->valid || e->pinum != pinum || strcmp(e->name, name) != 0 || e->expires < now() ||
+        !version_current(pinum, e->version))
+    {
+        cache_misses++;
+        return -1;
+    }
+    cache_hits++;
+    return e->inum;
+}
+
+// Records that name in pinum is inum, as of directory version version
+static void name_cache_put(int pinum, const char *name, int inum, uint32_t version, int lease_ms)
+{
+    name_entry_t *e = &name_cache[name_slot(pinum, name)];
+    e->valid = 1;
+    e->pinum = pinum;
+    strcpy(e->name, name);
+    e->inum = inum;
+    e->version = version;
+    e->expires = now() + lease_ms / 1000.0;
+}
+
+// Copies the next component of the path at *p into name and advances *p
+// past it, skipping empty components. Returns 1, 0 at the end of the path,
+// or -1 if the component is too long.
+static int path_component(const char **p, char *name)
+{
+    *p += strspn(*p, "/");
+    size_t n = strcspn(*p, "/");
+    if (n == 0)
+        return 0;
+    if (n >= MFS_NAME_LEN)
+        return -1;
+    memcpy(name, *p, n);
+    name[n] = '\0';
+    *p += n;
+    return 1;
+}
+
+// Returns the cached attributes of inum, or NULL
+static attr_entry_t *attr_cache_get(int inum)
+{
+    attr_entry_t *e = &attr_cache[(unsigned int)inum % CACHE_SLOTS];
+    if (!e->valid || e->inum != inum || e->expires < now() || !version_current(inum, e->version))
+    {
+        cache_misses++;
+        return NULL;
+    }
+    cache_hits++;
+    return e;
+}
+
+static void attr_cache_drop(int inum)
+{
+    attr_entry_t *e = &attr_cache[(unsigned int)inum % CACHE_SLOTS];
+    if (e->inum == inum)
+        e->valid = 0;
+}
+
+// Data block cache, off until MFS_SetBlockCache() sizes it. READs ask for a
+// callback promise (see proto.h); a block read under one is kept until the
+// promise lapses or the server's CALLBACK for its inode arrives. This
+// client's own writes drop what they overwrite. Direct-mapped like the
+// tables above.
+typedef struct
+{
+    int valid;
+    int inum;       // Key
+    int block;
+    double expires; // When the callback promise lapses
+    char *data;     // MFS_BLOCK_SIZE bytes
+} block_entry_t;
+
+static block_entry_t *block_cache;
+static char *block_data;
+static int block_slots;
+static unsigned long block_hits, block_misses;
+
+static block_entry_t *block_entry(int inum, int block)
+{
+    return &block_cache[((unsigned int)inum * 2654435761u + (unsigned int)block) % block_slots];
+}
+
+static void block_cache_drop(int inum, int block)
+{
+    block_entry_t *e = block_entry(inum, block);
+    if (e->inum == inum && e->block == block)
+        e->valid = 0;
+}
+
+// Drops every cached block of inum, or of every inode if inum is -1
+static void block_cache_drop_inode(int inum)
+{
+    for (int i = 0; i < block_slots; i++)
+    {
+        if (inum == -1 || block_cache[i].inum == inum)
+            block_cache[i].valid = 0;
+    }
+}
+
+// Number of fragments the payload of a count-block range travels in
+static int range_frags(int count)
+{
+    return (count + MFS_FRAG_BLOCKS - 1) / MFS_FRAG_BLOCKS;
+}
+
+// Payload bytes of fragment frag of a count-block range
+static uint32_t range_frag_len(int count, int frag)
+{
+    int blocks = count - frag * MFS_FRAG_BLOCKS;
+    return (blocks < MFS_FRAG_BLOCKS ? blocks : MFS_FRAG_BLOCKS) * MFS_BLOCK_SIZE;
+}
+
+// Returns the server that slot s's request goes to
+static server_t *slot_server(const slot_t *s)
+{
+    return s->replica == 0 ? &shards[s->shard] : &replicas[s->shard][s->replica - 1];
+}
+
+// Sends the request in slot s: one datagram, or one per fragment of a
+// WRITE_RANGE, all with a single sendmmsg()
+static int transmit(slot_t *s)
+{
+    server_t *server = slot_server(s);
+    int n = s->req.opcode == MFS_OP_WRITE_RANGE ? range_frags(s->req.arg1) : 1;
+    mfs_hdr_t hdrs[MAX_FRAGS];
+    struct iovec iov[MAX_FRAGS][2];
+    struct mmsghdr msgs[MAX_FRAGS];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < n; i++)
+    {
+        hdrs[i] = s->req;
+        const char *data = s->data;
+        if (s->req.opcode == MFS_OP_WRITE_RANGE)
         {
-            perror("sendto failed");
+            hdrs[i].frag = i;
+            hdrs[i].len = range_frag_len(s->req.arg1, i);
+            data += (size_t)i * MFS_MAX_PAYLOAD;
+        }
+        iov[i][0] = (struct iovec){&hdrs[i], sizeof(hdrs[i])};
+        iov[i][1] = (struct iovec){(void *)data, hdrs[i].len};
+        msgs[i].msg_hdr.msg_name = &server->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(server->addr);
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = hdrs[i].len > 0 ? 2 : 1;
+    }
+    for (int sent = 0; sent < n;)
+    {
+        int rc = sendmmsg(sockfd, msgs + sent, n - sent, 0);
+        if (rc < 0)
+        {
+            perror("sendmmsg failed");
             return -1;
         }
+        sent += rc;
+    }
+    double t = now();
+    if (s->sent++ == 0)
+        s->first_sent = t;
+    s->deadline = t + rtt_timeout(&server->rtt, s->sent);
+    return 0;
+}
+
+// Takes a free slot of the outstanding table, or returns -1
+static int alloc_slot(void)
+{
+    int h = 0;
+    while (h < MFS_MAX_INFLIGHT && slots[h].in_use)
+        h++;
+    if (h == MFS_MAX_INFLIGHT)
+    {
+        fprintf(stderr, "libmfs: more than %d requests outstanding\n", MFS_MAX_INFLIGHT);
+        return -1;
+    }
+    memset(&slots[h], 0, sizeof(slots[h]));
+    slots[h].in_use = 1;
+    return h;
+}
+
+// Returns a handle for a request answered without the server
+static int submit_local(int result)
+{
+    int h = alloc_slot();
+    if (h != -1)
+    {
+        slots[h].done = 1;
+        slots[h].result = result;
+    }
+    return h;
+}
+
+// Returns the shard owning inode inum, or -1 if there is no such server
+static int shard_of(int inum)
+{
+    int shard = inum / MFS_SHARD_SPAN;
+    return inum >= 0 && shard < nshards ? shard : -1;
+}
+
+// Function to send a request without waiting for the reply. req is sent to
+// the shard owning req->inum, followed by req->len bytes of data (for
+// WRITE_RANGE, the whole range in fragments); up to reply_cap bytes of reply
+// payload go to reply_data. A read goes to the shard's primary or one of
+// its backups if spread is set, otherwise to the primary. Returns the slot,
+// which is the caller's handle, or -1.
+static int submit_to(mfs_hdr_t *req, const char *data, char *reply_data, int reply_cap, MFS_Stat_t *stat,
+                     int spread)
+{
+    int shard = shard_of(req->inum);
+    if (shard == -1)
+    {
+        return -1;
+    }
+    int h = alloc_slot();
+    if (h == -1)
+    {
+        return -1;
+    }
 
-        FD_ZERO(&read_fds);        // Clear the file descriptor set
-        FD_SET(sockfd, &read_fds); // Add the socket to the set
+    slot_t *s = &slots[h];
+    s->retries = policy.attempts;
+    s->req = *req;
+    s->req.magic = MFS_PROTO_MAGIC;
+    s->req.version = MFS_PROTO_VERSION;
+    s->req.client_id = client_id;
+    s->req.req_id = next_seq++ << SLOT_BITS | h;
+    s->data = data;
+    s->reply_data = reply_data;
+    s->reply_cap = reply_cap;
+    s->stat = stat;
+    s->shard = shard;
+
+    // Reads are spread over the shard's primary and its backups
+    int op = req->opcode;
+    if (spread && nreplicas[shard] > 0 && (op == MFS_OP_LOOKUP || op == MFS_OP_STAT || op == MFS_OP_READ ||
+                                 op == MFS_OP_READ_RANGE || op == MFS_OP_READDIR || op == MFS_OP_LOOKUP_PATH))
+    {
+        s->replica = next_replica++ % (nreplicas[shard] + 1);
+        if (s->replica > 0 && replicas[shard][s->replica - 1].down_until > now())
+            s->replica = 0;
+    }
+    if (transmit(s) < 0)
+    {
+        s->in_use = 0;
+        return -1;
+    }
+    return h;
+}
 
-        tv.tv_sec = TIMEOUT; // Set the timeout duration
-        tv.tv_usec = 0;
+static int submit(mfs_hdr_t *req, const char *data, char *reply_data, int reply_cap, MFS_Stat_t *stat)
+{
+    return submit_to(req, data, reply_data, reply_cap, stat, 1);
+}
 
-        // Wait for a response with a timeout
-        int rv = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
-        if (rv == -1)
+// Records the reply to slot s
+static void complete(slot_t *s, mfs_hdr_t *reply, const char *payload)
+{
+    s->done = 1;
+    s->result = reply->status;
+    const mfs_lease_t *lease = reply->len == sizeof(mfs_lease_t) ? (const mfs_lease_t *)payload : NULL;
+    switch (s->req.opcode)
+    {
+    case MFS_OP_LOOKUP:
+        if (lease != NULL)
         {
-            perror("select failed");
-            return -1;
+            note_version(s->req.inum, lease->version);
+            if (reply->status >= 0 && lease->lease_ms > 0)
+                name_cache_put(s->req.inum, s->req.name, reply->status, lease->version, lease->lease_ms);
         }
-        else if (rv == 0)
+        break;
+    case MFS_OP_LOOKUP_PATH:
+    {
+        // Every step resolved is a LOOKUP answer of its own
+        const mfs_pathstep_t *steps = (const mfs_pathstep_t *)payload;
+        int n = reply->len / sizeof(mfs_pathstep_t);
+        if (n > reply->arg0)
+            n = reply->arg0;
+        int pinum = s->req.inum;
+        const char *p = s->data;
+        char name[MFS_NAME_LEN];
+        for (int i = 0; i < n && path_component(&p, name) == 1; i++)
         {
-            // Timeout occurred, retry
-            printf("Timeout, retrying...\n");
-            retries--;
-            continue;
+            note_version(pinum, steps[i].version);
+            if (reply->arg1 > 0)
+                name_cache_put(pinum, name, steps[i].inum, steps[i].version, reply->arg1);
+            if ((i + 1) * (int)sizeof(int) <= s->reply_cap)
+                ((int *)s->reply_data)[i] = steps[i].inum;
+            pinum = steps[i].inum;
         }
-        else
+        s->resolved = n;
+        s->last = pinum;
+        break;
+    }
+    case MFS_OP_STAT:
+        if (reply->status == 0)
         {
-            // Receive the response from the server
-            int len = recvfrom(sockfd, recv_buffer, MFS_BLOCK_SIZE, 0, (struct sockaddr *)&from, &fromlen);
-            if (len < 0)
+            s->stat->type = reply->arg0;
+            s->stat->size = reply->arg1;
+        }
+        if (reply->status == 0 && lease != NULL)
+        {
+            note_version(s->req.inum, lease->version);
+            if (lease->lease_ms > 0)
             {
-                perror("recvfrom failed");
-                return -1;
+                attr_entry_t *e = &attr_cache[(unsigned int)s->req.inum % CACHE_SLOTS];
+                e->valid = 1;
+                e->inum = s->req.inum;
+                e->type = reply->arg0;
+                e->size = reply->arg1;
+                e->version = lease->version;
+                e->expires = now() + lease->lease_ms / 1000.0;
             }
-            recv_buffer[len] = '\0'; // Null-terminate the received data
-            return 0;
         }
+        break;
+    case MFS_OP_READ:
+        if (reply->status == 0 && reply->len != MFS_BLOCK_SIZE)
+            s->result = -1; // Short reply
+        else if (reply->status == 0)
+            memcpy(s->reply_data, payload, MFS_BLOCK_SIZE);
+        if (s->result == 0 && reply->arg1 > 0 && block_slots > 0 && !s->nocache)
+        {
+            block_entry_t *e = block_entry(s->req.inum, s->req.arg0);
+            e->valid = 1;
+            e->inum = s->req.inum;
+            e->block = s->req.arg0;
+            e->expires = now() + reply->arg1 / 1000.0;
+            memcpy(e->data, payload, MFS_BLOCK_SIZE);
+        }
+        break;
+    case MFS_OP_STATS:
+        if (reply->status == 0)
+        {
+            int n = (int)reply->len < s->reply_cap ? (int)reply->len : s->reply_cap;
+            memcpy(s->reply_data, payload, n);
+            s->result = n;
+        }
+        break;
+    case MFS_OP_READDIR:
+        if (reply->status >= 0)
+        {
+            int n = reply->len / sizeof(mfs_dirent_t);
+            if (n > reply->status)
+                n = reply->status;
+            if (n * (int)sizeof(mfs_dirent_t) > s->reply_cap)
+                n = s->reply_cap / sizeof(mfs_dirent_t);
+            memcpy(s->reply_data, payload, n * sizeof(mfs_dirent_t));
+            s->result = n;
+            s->cookie = n < reply->status ? -2 : reply->arg0; // -2: entries were lost
+        }
+        break;
+    case MFS_OP_READ_RANGE:
+        if (reply->status != 0)
+            break; // Failed as a whole
+        if (reply->frag >= range_frags(s->req.arg1) || reply->len != range_frag_len(s->req.arg1, reply->frag))
+        {
+            s->done = 0; // Malformed fragment
+            break;
+        }
+        memcpy(s->reply_data + (size_t)reply->frag * MFS_MAX_PAYLOAD, payload, reply->len);
+        s->have |= 1u << reply->frag;
+        s->done = s->have == (1u << range_frags(s->req.arg1)) - 1;
+        break;
     }
+}
 
-    return -1; // Exceeded retries
+// Handles a CALLBACK from the server: inum has changed
+static void callback(int inum)
+{
+    block_cache_drop_inode(inum);
+    attr_cache_drop(inum);
+
+    // A READ of the inode in flight may carry data from before the change
+    for (int h = 0; h < MFS_MAX_INFLIGHT; h++)
+    {
+        if (slots[h].in_use && !slots[h].done && slots[h].req.opcode == MFS_OP_READ && slots[h].req.inum == inum)
+            slots[h].nocache = 1;
+    }
 }
 
-// Function to initialize the MFS client
-int MFS_Init(char *hostname, int port)
+// Takes every datagram that has arrived: replies and callbacks. A reply not
+// matching an outstanding request is a late reply to a retransmitted one.
+static void receive_all(void)
 {
-    printf("Initializing with hostname: %s, port: %d\n", hostname, port);
+    static char payload[MFS_MAX_PAYLOAD];
+    while (1)
+    {
+        mfs_hdr_t reply;
+        struct iovec iov[2] = {{&reply, sizeof(reply)}, {payload, MFS_MAX_PAYLOAD}};
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t len = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+        if (len < 0)
+            break;
+        if (len < (ssize_t)sizeof(reply) || reply.magic != MFS_PROTO_MAGIC || reply.version != MFS_PROTO_VERSION ||
+            reply.len != (uint32_t)len - sizeof(reply))
+        {
+            continue; // Malformed reply
+        }
+        if (reply.opcode == MFS_OP_CALLBACK)
+        {
+            if (reply.client_id == client_id)
+                callback(reply.inum);
+            continue;
+        }
+        slot_t *s = &slots[reply.req_id & ((1 << SLOT_BITS) - 1)];
+        if (s->in_use && !s->done && s->req.req_id == reply.req_id)
+        {
+            complete(s, &reply, payload);
+            if (s->done && s->sent == 1)
+                rtt_sample(&slot_server(s)->rtt, now() - s->first_sent);
+        }
+    }
+}
 
-    // Create a socket
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
+// Function to receive replies and retransmit overdue requests. With wait
+// set, blocks until a reply arrives or the next retransmission is due.
+static int pump(int wait)
+{
+    // Sleep no longer than the earliest retransmission deadline
+    double t = now(), deadline = -1;
+    for (int h = 0; h < MFS_MAX_INFLIGHT; h++)
     {
-        perror("socket creation failed");
+        if (slots[h].in_use && !slots[h].done && (deadline < 0 || slots[h].deadline < deadline))
+            deadline = slots[h].deadline;
+    }
+    if (deadline < 0)
+    {
+        receive_all(); // Nothing in flight, but callbacks may be waiting
+        return 0;
+    }
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sockfd, &read_fds);
+    double left = wait && deadline > t ? deadline - t : 0;
+    struct timeval tv = {(time_t)left, (suseconds_t)((left - (time_t)left) * 1e6)};
+    if (select(sockfd + 1, &read_fds, NULL, NULL, &tv) < 0)
+    {
+        perror("select failed");
+        return -1;
+    }
+    receive_all();
+
+    t = now();
+    char backed_off[MFS_MAX_SHARDS][MAX_REPLICAS + 1] = {{0}}; // Servers whose timeout has doubled
+    for (int h = 0; h < MFS_MAX_INFLIGHT; h++)
+    {
+        slot_t *s = &slots[h];
+        if (!s->in_use || s->done || s->deadline > t)
+            continue;
+        rtt_t *rtt = &slot_server(s)->rtt;
+        if (!backed_off[s->shard][s->replica]++ && rtt->valid)
+        {
+            rtt->rto *= 2;
+            if (rtt->rto > policy.max_ms / 1000.0)
+                rtt->rto = policy.max_ms / 1000.0;
+        }
+        if (--s->retries == 0)
+        {
+            s->done = 1; // Exceeded retries
+            s->result = -1;
+            continue;
+        }
+        retransmit_count++;
+        if (s->replica > 0)
+        {
+            // A backup that does not answer may be gone; the primary has
+            // the data, and takes the backup's reads for a while
+            replicas[s->shard][s->replica - 1].down_until = t + policy.max_ms / 1000.0;
+            s->replica = 0;
+        }
+        if (transmit(s) < 0)
+        {
+            s->done = 1;
+            s->result = -1;
+        }
+    }
+    return 0;
+}
+
+int MFS_Poll(int handle)
+{
+    if (handle < 0 || handle >= MFS_MAX_INFLIGHT || !slots[handle].in_use)
+        return -1;
+    if (!slots[handle].done && pump(0) < 0)
         return -1;
+    if (!slots[handle].done)
+        return MFS_PENDING;
+    slots[handle].in_use = 0;
+    return slots[handle].result;
+}
+
+// Waits like MFS_Wait(), first copying the slot into out for callers that
+// need more of the reply than the result: once freed, the slot can be taken
+// by the next request. The caller passes a handle it owns.
+static int wait_slot(int handle, slot_t *out)
+{
+    while (!slots[handle].done)
+    {
+        if (pump(1) < 0)
+        {
+            *out = slots[handle];
+            return -1;
+        }
     }
+    *out = slots[handle];
+    slots[handle].in_use = 0;
+    return out->result;
+}
+
+int MFS_Wait(int handle)
+{
+    if (handle < 0 || handle >= MFS_MAX_INFLIGHT || !slots[handle].in_use)
+        return -1;
+    slot_t done;
+    return wait_slot(handle, &done);
+}
+
+// Builds a request carrying a name, failing if the name does not fit
+static int set_name(mfs_hdr_t *req, const char *name)
+{
+    if (name == NULL || strlen(name) >= MFS_NAME_LEN)
+    {
+        return -1; // Name is too long
+    }
+    strcpy(req->name, name);
+    return 0;
+}
+
+// Resolves "host" or "host:port" into addr, port being the default
+static int resolve(const char *server, int port, struct sockaddr_in *addr)
+{
+    char host[256];
+    const char *colon = strrchr(server, ':');
+    size_t len = colon != NULL ? (size_t)(colon - server) : strlen(server);
+    if (len >= sizeof(host))
+    {
+        fprintf(stderr, "Host name is too long: %s\n", server);
+        return -1;
+    }
+    memcpy(host, server, len);
+    host[len] = '\0';
+    if (colon != NULL)
+        port = atoi(colon + 1);
 
     // Initialize the server address structure
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
 
     struct addrinfo hints, *res;
     memset(&hints, 0, sizeof(hints));
@@ -92,7 +769,7 @@ int MFS_Init(char *hostname, int port)
     hints.ai_socktype = SOCK_DGRAM; // Datagram socket
 
     // Resolve the hostname to an IP address
-    int err = getaddrinfo(hostname, NULL, &hints, &res);
+    int err = getaddrinfo(host, NULL, &hints, &res);
     if (err != 0)
     {
         fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(err));
@@ -101,155 +778,628 @@ int MFS_Init(char *hostname, int port)
 
     // Copy the resolved IP address to the server address structure
     struct sockaddr_in *ipv4 = (struct sockaddr_in *)res->ai_addr;
-    server_addr.sin_addr = ipv4->sin_addr;
+    addr->sin_addr = ipv4->sin_addr;
     freeaddrinfo(res); // Free the address info structure
-
     return 0;
 }
 
-// Function to lookup a directory entry
-int MFS_Lookup(int pinum, char *name)
+// Function to initialize the MFS client
+int MFS_Init(char *hostname, int port)
 {
-    char send_buffer[BUFFER_SIZE];
-    snprintf(send_buffer, BUFFER_SIZE, "LOOKUP %d %s", pinum, name); // Format the request
+    printf("Initializing with hostname: %s, port: %d\n", hostname, port);
+
+    // One server per shard, separated by commas
+    char list[MFS_MAX_SHARDS * 64];
+    if (strlen(hostname) >= sizeof(list))
+    {
+        fprintf(stderr, "Server list is too long\n");
+        return -1;
+    }
+    strcpy(list, hostname);
+    nshards = 0;
+    char *save;
+    for (char *server = strtok_r(list, ",", &save); server != NULL; server = strtok_r(NULL, ",", &save))
+    {
+        if (nshards == MFS_MAX_SHARDS)
+        {
+            fprintf(stderr, "More than %d servers\n", MFS_MAX_SHARDS);
+            return -1;
+        }
+        memset(&shards[nshards], 0, sizeof(shards[nshards]));
+        nreplicas[nshards] = 0;
+        if (resolve(server, port, &shards[nshards].addr) < 0)
+        {
+            return -1;
+        }
+        nshards++;
+    }
+    if (nshards == 0)
+    {
+        fprintf(stderr, "No server given\n");
+        return -1;
+    }
+
+    // Create a socket
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket creation failed");
+        return -1;
+    }
 
-    char recv_buffer[BUFFER_SIZE];
-    struct sockaddr_in response_addr;
-    socklen_t addr_len = sizeof(response_addr);
+    // Pick a client id that differs between processes and runs
+    struct timeval tod;
+    gettimeofday(&tod, NULL);
+    client_id = (uint32_t)getpid() * 2654435761u ^ (uint32_t)(tod.tv_sec * 1000000 + tod.tv_usec);
+    next_seq = 1;
+    memset(slots, 0, sizeof(slots));
+    retransmit_count = 0;
+    jitter_state = client_id | 1;
+    memset(name_cache, 0, sizeof(name_cache));
+    memset(attr_cache, 0, sizeof(attr_cache));
+    memset(versions, 0, sizeof(versions));
+    cache_hits = cache_misses = 0;
+    block_cache_drop_inode(-1);
 
-    // Send the lookup request to the server
-    sendto(sockfd, send_buffer, strlen(send_buffer), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    // Receive the response from the server
-    recvfrom(sockfd, recv_buffer, BUFFER_SIZE, 0, (struct sockaddr *)&response_addr, &addr_len);
+    // Leave room for the replies to a full outstanding table
+    int rcvbuf = RCVBUF_BYTES;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
-    int inum;
-    sscanf(recv_buffer, "%d", &inum); // Parse the response to get the inode number
-    return inum;
+    return 0;
 }
 
-// Function to get the status of an inode
-int MFS_Stat(int inum, MFS_Stat_t *m)
+int MFS_AddReplica(int shard, char *hostname, int port)
 {
-    char send_buffer[BUFFER_SIZE];
-    snprintf(send_buffer, BUFFER_SIZE, "STAT %d", inum); // Format the request
-
-    char recv_buffer[BUFFER_SIZE];
-    struct sockaddr_in response_addr;
-    socklen_t addr_len = sizeof(response_addr);
+    if (shard < 0 || shard >= nshards || nreplicas[shard] == MAX_REPLICAS)
+    {
+        return -1;
+    }
+    server_t *r = &replicas[shard][nreplicas[shard]];
+    memset(r, 0, sizeof(*r));
+    if (resolve(hostname, port, &r->addr) < 0)
+    {
+        return -1;
+    }
+    nreplicas[shard]++;
+    return 0;
+}
 
-    // Send the stat request to the server
-    sendto(sockfd, send_buffer, strlen(send_buffer), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    // Receive the response from the server
-    recvfrom(sockfd, recv_buffer, BUFFER_SIZE, 0, (struct sockaddr *)&response_addr, &addr_len);
+// Function to lookup a directory entry
+int MFS_LookupAsync(int pinum, char *name)
+{
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_LOOKUP;
+    req.inum = pinum;
+    if (set_name(&req, name) < 0)
+    {
+        return -1;
+    }
+    int inum = name_cache_get(pinum, name);
+    if (inum != -1)
+    {
+        return submit_local(inum);
+    }
+    return submit(&req, NULL, NULL, 0, NULL);
+}
 
-    int type, size;
-    sscanf(recv_buffer, "%d %d", &type, &size); // Parse the response to get the inode type and size
-    m->type = type;
-    m->size = size;
-    return 0;
+int MFS_Lookup(int pinum, char *name)
+{
+    return MFS_Wait(MFS_LookupAsync(pinum, name)); // Inode number of name, or -1
 }
 
-// Function to write data to a file
-int MFS_Write(int inum, char *buffer, int block)
+// Function to get the status of an inode
+int MFS_StatAsync(int inum, MFS_Stat_t *m)
 {
-    char send_buffer[BUFFER_SIZE + MFS_BLOCK_SIZE];
-    snprintf(send_buffer, BUFFER_SIZE, "WRITE %d %d", inum, block);        // Format the request
-    memcpy(send_buffer + strlen(send_buffer) + 1, buffer, MFS_BLOCK_SIZE); // Copy the data to be written
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_STAT;
+    req.inum = inum;
+    attr_entry_t *e = attr_cache_get(inum);
+    if (e != NULL)
+    {
+        m->type = e->type;
+        m->size = e->size;
+        return submit_local(0);
+    }
+    return submit(&req, NULL, NULL, 0, m);
+}
 
-    char recv_buffer[BUFFER_SIZE];
-    struct sockaddr_in response_addr;
-    socklen_t addr_len = sizeof(response_addr);
+int MFS_Stat(int inum, MFS_Stat_t *m)
+{
+    return MFS_Wait(MFS_StatAsync(inum, m)) == 0 ? 0 : -1;
+}
 
-    // Send the write request to the server
-    sendto(sockfd, send_buffer, BUFFER_SIZE + MFS_BLOCK_SIZE, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    // Receive the response from the server
-    recvfrom(sockfd, recv_buffer, BUFFER_SIZE, 0, (struct sockaddr *)&response_addr, &addr_len);
+// Function to write data to a file
+int MFS_WriteAsync(int inum, char *buffer, int block)
+{
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_WRITE;
+    req.inum = inum;
+    req.arg0 = block;
+    req.len = MFS_BLOCK_SIZE;
+    attr_cache_drop(inum); // The size may change
+    if (block_slots > 0)
+        block_cache_drop(inum, block);
+    return submit(&req, buffer, NULL, 0, NULL);
+}
 
-    int result;
-    sscanf(recv_buffer, "%d", &result); // Parse the response to get the result
-    return result;
+int MFS_Write(int inum, char *buffer, int block)
+{
+    return MFS_Wait(MFS_WriteAsync(inum, buffer, block));
 }
 
 // Function to read data from a file
+int MFS_ReadAsync(int inum, char *buffer, int block)
+{
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_READ;
+    req.inum = inum;
+    req.arg0 = block;
+    if (block_slots > 0)
+    {
+        receive_all(); // Apply any callbacks before trusting the cache
+        block_entry_t *e = block_entry(inum, block);
+        if (e->valid && e->inum == inum && e->block == block && e->expires >= now())
+        {
+            block_hits++;
+            memcpy(buffer, e->data, MFS_BLOCK_SIZE);
+            return submit_local(0);
+        }
+        block_misses++;
+        req.flags = MFS_FLAG_CALLBACK;
+    }
+    return submit(&req, NULL, buffer, MFS_BLOCK_SIZE, NULL);
+}
+
 int MFS_Read(int inum, char *buffer, int block)
 {
-    char send_buffer[BUFFER_SIZE];
-    snprintf(send_buffer, BUFFER_SIZE, "READ %d %d", inum, block); // Format the request
+    return MFS_Wait(MFS_ReadAsync(inum, buffer, block));
+}
 
-    char recv_buffer[BUFFER_SIZE + MFS_BLOCK_SIZE];
-    struct sockaddr_in response_addr;
-    socklen_t addr_len = sizeof(response_addr);
+// Returns the shard on which a new entry name of directory pinum goes: the
+// entries of the root are spread over all shards by a hash of their names,
+// and everything else stays on its parent's shard
+static int placement(int pinum, const char *name)
+{
+    if (pinum != 0)
+    {
+        return shard_of(pinum);
+    }
+    uint32_t h = 2166136261u; // FNV-1a
+    for (const char *c = name; *c != '\0'; c++)
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    return h % nshards;
+}
 
-    // Send the read request to the server
-    sendto(sockfd, send_buffer, strlen(send_buffer), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    // Receive the response from the server
-    recvfrom(sockfd, recv_buffer, BUFFER_SIZE + MFS_BLOCK_SIZE, 0, (struct sockaddr *)&response_addr, &addr_len);
+// Creates an entry of directory pinum for a new inode on another shard:
+// ALLOC there, then LINK here, and FREE if the entry could not be made or
+// already existed. Returns what CREAT would.
+static int creat_remote(int pinum, int type, char *name, int shard)
+{
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_ALLOC;
+    req.inum = shard * MFS_SHARD_SPAN;
+    req.arg0 = type;
+    req.arg1 = pinum;
+    int child = MFS_Wait(submit(&req, NULL, NULL, 0, NULL));
+    if (child < 0)
+    {
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.opcode = MFS_OP_LINK;
+    req.inum = pinum;
+    req.arg0 = child;
+    set_name(&req, name);
+    int rc = MFS_Wait(submit(&req, NULL, NULL, 0, NULL));
+    if (rc != 0)
+    {
+        memset(&req, 0, sizeof(req));
+        req.opcode = MFS_OP_FREE;
+        req.inum = child;
+        MFS_Wait(submit(&req, NULL, NULL, 0, NULL));
+    }
+    return rc == 1 ? 0 : rc; // The name existed: like CREAT, not an error
+}
 
-    int result;
-    sscanf(recv_buffer, "%d", &result); // Parse the response to get the result
-    if (result == 0)
+// Function to create a new file or directory. One that goes on another
+// shard than its directory takes several round trips, made before this
+// returns.
+int MFS_CreatAsync(int pinum, int type, char *name)
+{
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_CREAT;
+    req.inum = pinum;
+    req.arg0 = type;
+    if (set_name(&req, name) < 0)
     {
-        memcpy(buffer, recv_buffer + sizeof(int), MFS_BLOCK_SIZE); // Copy the data to the buffer if successful
+        return -1;
     }
-    return result;
+    attr_cache_drop(pinum); // The directory may grow
+    int shard = placement(pinum, name);
+    if (shard != -1 && shard != shard_of(pinum))
+    {
+        return submit_local(creat_remote(pinum, type, name, shard));
+    }
+    return submit(&req, NULL, NULL, 0, NULL);
 }
 
-// Function to create a new file or directory
 int MFS_Creat(int pinum, int type, char *name)
 {
-    char send_buffer[BUFFER_SIZE];
-    snprintf(send_buffer, BUFFER_SIZE, "CREAT %d %d %s", pinum, type, name); // Format the request
+    return MFS_Wait(MFS_CreatAsync(pinum, type, name));
+}
 
-    char recv_buffer[BUFFER_SIZE];
-    struct sockaddr_in response_addr;
-    socklen_t addr_len = sizeof(response_addr);
+// Function to unlink (delete) a file or directory. With several shards the
+// inode is looked up first; one on another shard than its directory is
+// freed there once the entry is removed, before this returns.
+int MFS_UnlinkAsync(int pinum, char *name)
+{
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_UNLINK;
+    req.inum = pinum;
+    if (set_name(&req, name) < 0)
+    {
+        return -1;
+    }
 
-    // Send the create request to the server
-    sendto(sockfd, send_buffer, strlen(send_buffer), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    // Receive the response from the server
-    recvfrom(sockfd, recv_buffer, BUFFER_SIZE, 0, (struct sockaddr *)&response_addr, &addr_len);
+    // With several shards, the inode is asked of the directory's primary: a
+    // cached or backup's answer may name one the entry no longer holds
+    int child = -1;
+    if (nshards > 1)
+    {
+        mfs_hdr_t lookup = req;
+        lookup.opcode = MFS_OP_LOOKUP;
+        child = MFS_Wait(submit_to(&lookup, NULL, NULL, 0, NULL, 0));
+    }
 
-    int result;
-    sscanf(recv_buffer, "%d", &result); // Parse the response to get the result
-    return result;
+    // Forget the entry and the inode it named; if that is not known, the
+    // inode number may be reused by the next CREAT, so forget all attributes
+    name_entry_t *e = &name_cache[name_slot(pinum, name)];
+    if (e->valid && e->pinum == pinum && strcmp(e->name, name) == 0)
+    {
+        attr_cache_drop(e->inum);
+        block_cache_drop_inode(e->inum);
+        e->valid = 0;
+    }
+    else
+    {
+        memset(attr_cache, 0, sizeof(attr_cache));
+        block_cache_drop_inode(-1);
+    }
+    attr_cache_drop(pinum);
+
+    if (child == -1 || shard_of(child) == shard_of(pinum))
+    {
+        return submit(&req, NULL, NULL, 0, NULL);
+    }
+
+    // The entry goes first, so no name reaches a freed inode. If the inode
+    // cannot be freed after all (a directory that is not empty), the entry
+    // is put back.
+    if (MFS_Wait(submit(&req, NULL, NULL, 0, NULL)) != 0)
+    {
+        return submit_local(-1);
+    }
+    mfs_hdr_t other = {0};
+    other.opcode = MFS_OP_FREE;
+    other.inum = child;
+    if (MFS_Wait(submit(&other, NULL, NULL, 0, NULL)) != 0)
+    {
+        other = req;
+        other.opcode = MFS_OP_LINK;
+        other.arg0 = child;
+        MFS_Wait(submit(&other, NULL, NULL, 0, NULL));
+        return submit_local(-1);
+    }
+    return submit_local(0);
 }
 
-// Function to unlink (delete) a file or directory
 int MFS_Unlink(int pinum, char *name)
 {
-    char send_buffer[BUFFER_SIZE];
-    snprintf(send_buffer, BUFFER_SIZE, "UNLINK %d %s", pinum, name); // Format the request
+    return MFS_Wait(MFS_UnlinkAsync(pinum, name));
+}
+
+// Function to resolve a path
+int MFS_LookupPath(int pinum, char *path, int *inums, int max, int *resolved)
+{
+    size_t len = strlen(path) + 1;
+    if (len > MFS_MAX_PATH)
+    {
+        return -1;
+    }
+
+    // Answered locally if every component is cached
+    int inum = pinum;
+    int n = 0;
+    int rc;
+    const char *p = path;
+    char name[MFS_NAME_LEN];
+    while ((rc = path_component(&p, name)) == 1 && (inum = name_cache_get(inum, name)) != -1)
+    {
+        if (inums != NULL && n < max)
+            inums[n] = inum;
+        n++;
+    }
+    if (rc == 0)
+    {
+        if (resolved != NULL)
+            *resolved = n;
+        return inum;
+    }
 
-    char recv_buffer[BUFFER_SIZE];
-    struct sockaddr_in response_addr;
-    socklen_t addr_len = sizeof(response_addr);
+    // A server resolves the path as far as its shard goes; the rest is
+    // resolved by the shard that the last component resolved is on
+    n = 0;
+    p = path;
+    while (1)
+    {
+        mfs_hdr_t req = {0};
+        req.opcode = MFS_OP_LOOKUP_PATH;
+        req.inum = pinum;
+        req.len = strlen(p) + 1;
+        int cap = inums != NULL && n < max ? (max - n) * (int)sizeof(int) : 0;
+        int h = submit(&req, p, cap > 0 ? (char *)(inums + n) : NULL, cap, NULL);
+        if (h == -1)
+        {
+            return -1;
+        }
+        slot_t done;
+        inum = wait_slot(h, &done);
+        int got = done.resolved;
+        n += got;
+        if (inum != -1 || got == 0 || shard_of(done.last) == shard_of(pinum))
+        {
+            break;
+        }
+        for (int i = 0; i < got; i++)
+            path_component(&p, name);
+        pinum = done.last;
+    }
+    if (resolved != NULL)
+    {
+        *resolved = n;
+    }
+    return inum;
+}
 
-    // Send the unlink request to the server
-    sendto(sockfd, send_buffer, strlen(send_buffer), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    // Receive the response from the server
-    recvfrom(sockfd, recv_buffer, BUFFER_SIZE, 0, (struct sockaddr *)&response_addr, &addr_len);
+_Static_assert(sizeof(MFS_DirEnt_t) == sizeof(mfs_dirent_t), "MFS_DirEnt_t must match the wire format");
 
-    int result;
-    sscanf(recv_buffer, "%d", &result); // Parse the response to get the result
-    return result;
+// Function to list a directory
+int MFS_ReadDir(int inum, int *cookie, MFS_DirEnt_t *entries, int max, int plus)
+{
+    if (cookie == NULL || *cookie < 0 || max < 1)
+    {
+        return -1;
+    }
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_READDIR;
+    req.inum = inum;
+    req.arg0 = *cookie;
+    req.arg1 = max;
+    req.flags = plus ? MFS_FLAG_PLUS : 0;
+    int h = submit(&req, NULL, (char *)entries, max * sizeof(MFS_DirEnt_t), NULL);
+    if (h == -1)
+    {
+        return -1;
+    }
+    slot_t done;
+    int n = wait_slot(h, &done);
+    if (n < 0 || done.cookie == -2)
+    {
+        return -1;
+    }
+    *cookie = done.cookie;
+
+    // The server leaves out the attributes of entries on other shards; those
+    // are asked for there, RANGE_WINDOW at a time
+    int handles[RANGE_WINDOW];
+    int which[RANGE_WINDOW];
+    MFS_Stat_t st[RANGE_WINDOW];
+    int pending = 0;
+    for (int i = 0; plus && i <= n; i++)
+    {
+        if (pending == RANGE_WINDOW || (i == n && pending > 0))
+        {
+            for (int w = 0; w < pending; w++)
+            {
+                if (MFS_Wait(handles[w]) == 0)
+                {
+                    entries[which[w]].type = st[w].type;
+                    entries[which[w]].size = st[w].size;
+                }
+            }
+            pending = 0;
+        }
+        if (i < n && entries[i].type == -1 && shard_of(entries[i].inum) != shard_of(inum))
+        {
+            which[pending] = i;
+            handles[pending] = MFS_StatAsync(entries[i].inum, &st[pending]);
+            pending++;
+        }
+    }
+    return n;
 }
 
-// Function to shutdown the server
+// Function to read count consecutive blocks of a file
+int MFS_ReadRangeAsync(int inum, char *buffer, int block, int count)
+{
+    if (count < 1 || count > MFS_MAX_RANGE)
+    {
+        return -1;
+    }
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_READ_RANGE;
+    req.inum = inum;
+    req.arg0 = block;
+    req.arg1 = count;
+    return submit(&req, NULL, buffer, count * MFS_BLOCK_SIZE, NULL);
+}
+
+// Function to write count consecutive blocks of a file
+int MFS_WriteRangeAsync(int inum, char *buffer, int block, int count)
+{
+    if (count < 1 || count > MFS_MAX_RANGE)
+    {
+        return -1;
+    }
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_WRITE_RANGE;
+    req.inum = inum;
+    req.arg0 = block;
+    req.arg1 = count;
+    attr_cache_drop(inum); // The size may change
+    for (int i = 0; i < count && block_slots > 0; i++)
+        block_cache_drop(inum, block + i);
+    return submit(&req, buffer, NULL, 0, NULL);
+}
+
+// Moves count blocks in requests of up to MFS_MAX_RANGE blocks, keeping
+// RANGE_WINDOW of them in flight
+static int transfer_range(int write, int inum, char *buffer, int block, int count)
+{
+    if (count < 1)
+    {
+        return -1;
+    }
+    int nreq = (count + MFS_MAX_RANGE - 1) / MFS_MAX_RANGE;
+    int handles[RANGE_WINDOW];
+    int rc = 0;
+    for (int i = 0; i < nreq + RANGE_WINDOW; i++)
+    {
+        int w = i % RANGE_WINDOW;
+        if (i >= RANGE_WINDOW && MFS_Wait(handles[w]) != 0)
+            rc = -1;
+        if (i >= nreq)
+            continue;
+        int first = i * MFS_MAX_RANGE;
+        int n = count - first < MFS_MAX_RANGE ? count - first : MFS_MAX_RANGE;
+        char *buf = buffer + (size_t)first * MFS_BLOCK_SIZE;
+        handles[w] = write ? MFS_WriteRangeAsync(inum, buf, block + first, n)
+                           : MFS_ReadRangeAsync(inum, buf, block + first, n);
+    }
+    return rc;
+}
+
+int MFS_ReadRange(int inum, char *buffer, int block, int count)
+{
+    return transfer_range(0, inum, buffer, block, count);
+}
+
+int MFS_WriteRange(int inum, char *buffer, int block, int count)
+{
+    return transfer_range(1, inum, buffer, block, count);
+}
+
+void MFS_CacheStats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = cache_hits;
+    *misses = cache_misses;
+}
+
+int MFS_SetBlockCache(int nblocks)
+{
+    free(block_cache);
+    free(block_data);
+    block_cache = NULL;
+    block_data = NULL;
+    block_slots = 0;
+    block_hits = block_misses = 0;
+    if (nblocks <= 0)
+    {
+        return 0;
+    }
+
+    block_cache = calloc(nblocks, sizeof(block_entry_t));
+    block_data = malloc((size_t)nblocks * MFS_BLOCK_SIZE);
+    if (block_cache == NULL || block_data == NULL)
+    {
+        free(block_cache);
+        free(block_data);
+        block_cache = NULL;
+        block_data = NULL;
+        return -1;
+    }
+    for (int i = 0; i < nblocks; i++)
+        block_cache[i].data = block_data + (size_t)i * MFS_BLOCK_SIZE;
+    block_slots = nblocks;
+    return 0;
+}
+
+void MFS_BlockCacheStats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = block_hits;
+    *misses = block_misses;
+}
+
+// Function to shutdown the servers
 int MFS_Shutdown()
 {
-    char send_buffer[BUFFER_SIZE];
-    snprintf(send_buffer, BUFFER_SIZE, "SHUTDOWN"); // Format the request
+    int rc = 0;
+    for (int i = 0; i < nshards; i++)
+    {
+        mfs_hdr_t req = {0};
+        req.opcode = MFS_OP_SHUTDOWN;
+        req.inum = i * MFS_SHARD_SPAN;
+        if (MFS_Wait(submit(&req, NULL, NULL, 0, NULL)) != 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+int MFS_SetTimeouts(const MFS_Timeouts_t *t)
+{
+    if (t->min_ms < 1 || t->max_ms < t->min_ms || t->initial_ms < t->min_ms || t->initial_ms > t->max_ms ||
+        t->attempts < 1)
+    {
+        return -1;
+    }
+    policy = *t;
+    for (int i = 0; i < nshards; i++)
+    {
+        if (shards[i].rtt.valid)
+            rtt_update_rto(&shards[i].rtt);
+        for (int r = 0; r < nreplicas[i]; r++)
+        {
+            if (replicas[i][r].rtt.valid)
+                rtt_update_rto(&replicas[i][r].rtt);
+        }
+    }
+    return 0;
+}
 
-    char recv_buffer[BUFFER_SIZE];
-    struct sockaddr_in response_addr;
-    socklen_t addr_len = sizeof(response_addr);
+void MFS_GetTimeouts(MFS_Timeouts_t *t)
+{
+    *t = policy;
+}
 
-    // Send the shutdown request to the server
-    sendto(sockfd, send_buffer, strlen(send_buffer), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    // Receive the response from the server
-    recvfrom(sockfd, recv_buffer, BUFFER_SIZE, 0, (struct sockaddr *)&response_addr, &addr_len);
+void MFS_RttStats(int *srtt_us, int *rto_us, unsigned long *retransmits)
+{
+    const rtt_t *rtt = &shards[0].rtt;
+    *srtt_us = (int)(rtt->srtt * 1e6);
+    *rto_us = (int)((rtt->valid ? rtt->rto : policy.initial_ms / 1000.0) * 1e6);
+    *retransmits = retransmit_count;
+}
 
-    int result;
-    sscanf(recv_buffer, "%d", &result); // Parse the response to get the result
-    return result;
+// Function to fetch a server's counters
+int MFS_ShardStats(int shard, char *buffer, int len)
+{
+    mfs_hdr_t req = {0};
+    req.opcode = MFS_OP_STATS;
+    req.inum = shard * MFS_SHARD_SPAN;
+    if (len <= 0)
+    {
+        return -1;
+    }
+    int n = MFS_Wait(submit(&req, NULL, buffer, len - 1, NULL));
+    if (n < 0)
+    {
+        return -1;
+    }
+    buffer[n] = '\0';
+    return n;
+}
+
+int MFS_Stats(char *buffer, int len)
+{
+    return MFS_ShardStats(0, buffer, len);
 }
@@ -10,10 +10,30 @@
 typedef struct {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
     int size;   // bytes
-    unsigned int direct[14]; // pointers to data blocks
 } MFS_Stat_t;
 
+typedef struct {
+    int inum;      // Inode number of the entry
+    int type;      // MFS_DIRECTORY or MFS_REGULAR_FILE, or -1 if not fetched
+    int size;      // bytes, or -1 if not fetched
+    char name[28]; // Entry name
+} MFS_DirEnt_t;
+
+// Sets up the client. hostname is a server, "host" or "host:port" with port
+// as the default port, or a comma-separated list of them: one per shard, in
+// the order of their -S numbers (see proto.h). Entries of the root directory
+// are spread over the shards by name, and all other files go on their
+// directory's shard.
 int MFS_Init(char *hostname, int port);
+
+// Adds a backup server of shard shard ("host" or "host:port", see the
+// server's -R option), after MFS_Init(). Lookups, stats, reads and listings
+// of the shard's inodes are then spread round-robin over its primary and
+// backups. The primary replies to a mutation only once every backup has
+// applied it, so a backup lags only by mutations still in progress. A read
+// that a backup does not answer in time is retried at the primary. Returns
+// 0, or -1.
+int MFS_AddReplica(int shard, char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int block);
@@ -22,4 +42,99 @@ int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
 
+// Fills buffer with the server's counters as "name value" lines and returns
+// the number of bytes written (at most len - 1, always '\0'-terminated), or -1.
+int MFS_Stats(char *buffer, int len);
+
+// MFS_Stats() for the server of shard shard (MFS_Stats() asks shard 0's).
+int MFS_ShardStats(int shard, char *buffer, int len);
+
+// Lists the live entries of directory inum, in one round trip per up to
+// several hundred entries. Set *cookie to 0 to start; up to max entries are
+// stored in entries and *cookie is set to where the next call continues, or
+// to -1 once the listing is complete. With plus set, each entry's type and
+// size are filled in as well. Returns the number of entries stored, or -1.
+int MFS_ReadDir(int inum, int *cookie, MFS_DirEnt_t *entries, int max, int plus);
+
+// Resolves a '/'-separated path, starting from directory pinum, in one round
+// trip (or none if every component is cached); empty components are skipped.
+// Returns the inode number of the last component, or -1. If resolved is not
+// NULL, it is set to the number of components resolved, which on failure is
+// the index of the component that could not be. The inodes of the first max
+// of those components are stored in inums, unless it is NULL.
+int MFS_LookupPath(int pinum, char *path, int *inums, int max, int *resolved);
+
+// MFS_Lookup() and MFS_Stat() answers are cached for as long as the server's
+// lease allows (server option -E), and dropped early when this client
+// changes the directory or file or the server reports a newer version of it.
+// Reports how many lookups and stats were answered from the cache and how
+// many went to the server.
+void MFS_CacheStats(unsigned long *hits, unsigned long *misses);
+
+// Keeps up to nblocks blocks read with MFS_Read() in client memory (0, the
+// default, turns this off). The server promises a callback for each cached
+// block and sends it when another client changes the file, so cached blocks
+// stay coherent; a block is also dropped when the promise lapses (server
+// option -C). Returns 0, or -1 if the memory cannot be had.
+int MFS_SetBlockCache(int nblocks);
+void MFS_BlockCacheStats(unsigned long *hits, unsigned long *misses);
+
+// Retransmission policy. Every request is retransmitted if its reply is
+// late. The timeout adapts to the server: it is the smoothed round-trip
+// time plus four times its mean deviation (Jacobson/Karels), measured on
+// replies to requests sent only once, and kept within [min_ms, max_ms]. Each
+// retransmission of a request doubles its timeout, up to max_ms, with up to
+// 25% random jitter either way so that clients that lost replies together
+// do not retry together, and also doubles the timeout of later requests
+// until a round trip is measured again. A request fails after attempts
+// transmissions.
+typedef struct {
+    int initial_ms; // Timeout until the first round trip has been measured
+    int min_ms;     // Bounds of the timeout
+    int max_ms;
+    int attempts;   // Transmissions of a request before it fails
+} MFS_Timeouts_t;
+
+// Replaces the policy (defaults: 1000, 5, 5000, 10); it applies to requests
+// sent from then on. Returns 0, or -1 if a value is out of range.
+int MFS_SetTimeouts(const MFS_Timeouts_t *t);
+void MFS_GetTimeouts(MFS_Timeouts_t *t);
+
+// Reports the smoothed round-trip time and current timeout of the first
+// server, in microseconds, and how many retransmissions have been sent since
+// MFS_Init(). Each server has a timeout of its own.
+void MFS_RttStats(int *srtt_us, int *rto_us, unsigned long *retransmits);
+
+// Range transfers: count consecutive blocks of a file, starting at block, to
+// or from buffer (count * MFS_BLOCK_SIZE bytes). Each request moves up to
+// MFS_MAX_RANGE blocks in large datagrams; longer ranges are split into
+// several requests that are in flight together. Return 0 or -1, like
+// MFS_Read() and MFS_Write().
+#define MFS_MAX_RANGE (64) // Also the server's limit (proto.h)
+
+int MFS_ReadRange(int inum, char *buffer, int block, int count);
+int MFS_WriteRange(int inum, char *buffer, int block, int count);
+
+// Asynchronous requests. Each *Async call sends its request and returns a
+// handle right away (or -1). Up to MFS_MAX_INFLIGHT requests can be in flight
+// at once; replies are matched to requests by id, in whatever order they
+// arrive, and overdue requests are retransmitted. Buffers passed in must stay
+// valid until the request has been collected with MFS_Wait() or MFS_Poll(),
+// which return what the synchronous call would have returned and free the
+// handle. MFS_Poll() returns MFS_PENDING instead of blocking while the reply
+// is still outstanding.
+#define MFS_MAX_INFLIGHT 64
+#define MFS_PENDING (-2)
+
+int MFS_LookupAsync(int pinum, char *name);
+int MFS_StatAsync(int inum, MFS_Stat_t *m);
+int MFS_WriteAsync(int inum, char *buffer, int block);
+int MFS_ReadAsync(int inum, char *buffer, int block);
+int MFS_CreatAsync(int pinum, int type, char *name);
+int MFS_UnlinkAsync(int pinum, char *name);
+int MFS_ReadRangeAsync(int inum, char *buffer, int block, int count);
+int MFS_WriteRangeAsync(int inum, char *buffer, int block, int count);
+int MFS_Wait(int handle);
+int MFS_Poll(int handle);
+
 #endif // MFS_H
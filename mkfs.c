@@ -63,6 +63,7 @@ int main(int argc, char *argv[]) {
     super_t s;
 
     // totals
+    s.magic = UFS_MAGIC;
     s.num_inodes = num_inodes;
     s.num_data = num_data;
 
@@ -148,11 +149,11 @@ int main(int argc, char *argv[]) {
     } inode_block;
 
     inode_block itable;
+    memset(&itable, 0, sizeof(itable));
     itable.inodes[0].type = UFS_DIRECTORY;
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
-    for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
+    itable.inodes[0].nextents = 1;
+    itable.inodes[0].extents[0] = (extent_t){0, s.data_region_addr, 1};
 
     rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
@@ -0,0 +1,136 @@
+#ifndef __proto_h__
+#define __proto_h__
+
+#include "mfs.h" // MFS_MAX_RANGE, shared with the client API
+#include <stdint.h>
+
+// Wire protocol shared by libmfs and the server.
+//
+// Every datagram starts with a fixed 64-byte header. Any payload (the data
+// block of a WRITE request or READ reply) follows immediately, so the
+// receiver can scatter it straight into a block-aligned buffer and hand that
+// to pwrite()/pread() without copying. Fields are in host byte order; a peer
+// with the other endianness fails the magic check.
+//
+// READ_RANGE and WRITE_RANGE move up to MFS_MAX_RANGE consecutive blocks of a
+// file in one request. Their payload travels in fragments of up to
+// MFS_FRAG_BLOCKS blocks, one per datagram (large datagrams, which IP
+// fragments further on the wire); fragment i carries blocks
+// arg0 + i * MFS_FRAG_BLOCKS onwards and has frag = i. A WRITE_RANGE request
+// is executed once every fragment has arrived and gets a single reply; a
+// READ_RANGE request gets one reply per fragment, or a single reply with
+// len = 0 if it fails.
+
+#define MFS_PROTO_MAGIC (0x4d465331) // "MFS1"
+#define MFS_PROTO_VERSION (1)
+
+#define MFS_NAME_LEN (28)     // Matches dir_ent_t.name, including the '\0'
+#define MFS_FRAG_BLOCKS (8)   // Blocks per range fragment
+#define MFS_MAX_PAYLOAD (MFS_FRAG_BLOCKS * 4096) // One range fragment
+#define MFS_MAX_PATH (1024)   // LOOKUP_PATH path, including the '\0'
+
+// Sharding: a namespace can be split over several servers. The server
+// started with -S k owns inode numbers k * MFS_SHARD_SPAN onwards (shard 0,
+// the default, holds the root), and inode numbers on the wire and in
+// directory entries are these global numbers, so an entry may name an inode
+// on another shard. A server rejects inode numbers it does not own. The
+// client creates an entry for an inode on another shard in two steps: ALLOC
+// on the child's shard, then LINK on the parent's, with FREE undoing the
+// ALLOC if the LINK fails. It removes one with UNLINK on the parent's shard,
+// which only drops the entry, then FREE on the child's, which fails for a
+// non-empty directory; the client then LINKs the entry back. Neither
+// sequence is atomic. LINK only takes inodes of other shards, and FREE only
+// inodes made by ALLOC.
+#define MFS_SHARD_SPAN (1 << 20) // Inode numbers per shard
+#define MFS_MAX_SHARDS (16)
+
+enum
+{
+    MFS_OP_LOOKUP = 1, // inum = pinum, name           -> status = inum, payload = mfs_lease_t
+    MFS_OP_STAT,       // inum                         -> status, arg0 = type, arg1 = size, payload = mfs_lease_t
+    MFS_OP_WRITE,      // inum, arg0 = block, payload  -> status
+    MFS_OP_READ,       // inum, arg0 = block           -> status, payload, arg1 = callback ms
+    MFS_OP_CREAT,      // inum = pinum, arg0 = type, name -> status
+    MFS_OP_UNLINK,     // inum = pinum, name           -> status
+    MFS_OP_SHUTDOWN,   //                              -> status
+    MFS_OP_STATS,      //                              -> status, payload = "name value\n" text
+    MFS_OP_READ_RANGE,  // inum, arg0 = block, arg1 = count -> status, payload fragments
+    MFS_OP_WRITE_RANGE, // inum, arg0 = block, arg1 = count, payload fragments -> status
+    MFS_OP_CALLBACK,    // Server to client, unsolicited: inum has changed
+    MFS_OP_READDIR,     // inum, arg0 = cookie, arg1 = max entries -> status = entries, arg0 = next cookie, payload
+    MFS_OP_LOOKUP_PATH, // inum = start, payload = path -> status = inum, arg0 = components resolved, payload
+    MFS_OP_ALLOC,       // inum = any of the shard's, arg0 = type, arg1 = parent inum -> status = new inum
+    MFS_OP_LINK,        // inum = pinum, name, arg0 = child inum -> status = 0, or 1 if the name exists
+    MFS_OP_FREE,        // inum                         -> status
+};
+
+// Request flags
+#define MFS_FLAG_CALLBACK (0x1) // READ: the client will cache the block
+#define MFS_FLAG_PLUS (0x2)     // READDIR: fill in each entry's type and size
+
+// Callbacks: a READ with MFS_FLAG_CALLBACK asks the server to promise a
+// callback. If it does, the reply has arg1 = how long the promise holds, in
+// milliseconds (0: no promise, do not cache). Until then, the first WRITE,
+// WRITE_RANGE or UNLINK that changes the inode makes the server send the
+// client a CALLBACK for it, which ends the promise. A callback is sent once
+// and may be lost, so the promise's lifetime bounds how stale a cached block
+// can get.
+
+typedef struct
+{
+    uint32_t magic;     // MFS_PROTO_MAGIC
+    uint8_t version;    // MFS_PROTO_VERSION
+    uint8_t opcode;     // MFS_OP_*
+    uint8_t frag;       // Range ops: fragment index; otherwise 0
+    uint8_t flags;      // MFS_FLAG_*
+    uint32_t client_id; // Chosen by the client at MFS_Init
+    uint32_t req_id;    // Echoed back in the reply
+    int32_t status;     // Reply: result code (0 or inum on success, -1 on failure)
+    int32_t inum;       // Target inode (or parent inode for directory ops)
+    int32_t arg0;       // Per-opcode argument, see above
+    int32_t arg1;       // Per-opcode argument, see above
+    uint32_t len;       // Bytes of payload following the header
+    char name[MFS_NAME_LEN];
+} mfs_hdr_t;
+
+// Payload of READDIR replies: the directory's live entries, packed, in
+// position order starting at the cookie. The reply's arg0 is the cookie to
+// continue from, or -1 once the listing is complete. type and size are -1
+// unless the request had MFS_FLAG_PLUS (and for ".." if its inode is busy).
+typedef struct
+{
+    int32_t inum;
+    int32_t type;
+    int32_t size;
+    char name[MFS_NAME_LEN];
+} mfs_dirent_t;
+
+// Payload of LOOKUP_PATH replies: one step per component resolved, in path
+// order. The request's payload is a '/'-separated path of at most
+// MFS_MAX_PATH bytes including its '\0'; empty components are skipped. Each
+// component is looked up in the directory the previous one resolved to,
+// starting from the request's inum, exactly as a LOOKUP would. The reply's
+// status is the inode of the last component, or -1 with arg0 = the index of
+// the component that could not be resolved. Resolution also stops there when
+// the previous component is a directory on another shard, where the client
+// continues. arg1 is the lease on the steps,
+// in milliseconds, as for LOOKUP.
+typedef struct
+{
+    int32_t inum;     // Inode the component resolved to
+    uint32_t version; // Version of the directory it was found in
+} mfs_pathstep_t;
+
+// Payload of LOOKUP and STAT replies: a lease on the answer. version is that
+// of the directory searched (LOOKUP) or of the inode (STAT); every mutation
+// of an inode changes it. The client may reuse the answer for lease_ms
+// milliseconds, and drops it early once it sees a different version.
+typedef struct
+{
+    uint32_t version;  // Inode version the answer was read at
+    uint32_t lease_ms; // How long the answer may be cached (0: not at all)
+} mfs_lease_t;
+
+_Static_assert(sizeof(mfs_hdr_t) == 64, "mfs_hdr_t must stay 64 bytes");
+
+#endif // __proto_h__
@@ -0,0 +1,350 @@
+#include "repl.h" // Replication stream
+#include <netdb.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_BACKUPS 8
+#define MAX_RECORD (MFS_MAX_RANGE * 4096) // Largest payload: a whole WRITE_RANGE
+#define REPL_TIMEOUT_MS 5000              // A backup this far behind is dropped
+#define REPL_DIVERGED ((uint64_t)-1)      // Acknowledgement of a backup whose image differs
+
+typedef struct
+{
+    int fd;              // Stream to the backup
+    int failed;          // Dropped; fd is shut down
+    unsigned long acked; // Records it has applied
+    char addr[64];       // host:port, for messages
+} backup_t;
+
+static backup_t backups[MAX_BACKUPS];
+static int nbackups;
+static unsigned long sent; // Records sent; the last one's sequence number
+static pthread_mutex_t ack_lock = PTHREAD_MUTEX_INITIALIZER; // Guards acked and failed
+static pthread_cond_t ack_cond = PTHREAD_COND_INITIALIZER;
+static repl_stats_t stats; // Backup counters, updated by the one applier
+
+static int (*apply_fn)(mfs_hdr_t *rec, char *data, const repl_version_t *versions, int n);
+static int (*commit_fn)(void);
+static int listen_fd;
+
+// Reads exactly len bytes; returns -1 on an error or at the end of the
+// stream
+static int read_full(int fd, void *buf, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = recv(fd, (char *)buf + done, len - done, 0);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Writes all of iov; returns -1 on an error, including the send timeout
+static int write_full(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL); // A dead peer must not kill the server
+        if (n < 0)
+            return -1;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Drops backup b, saying why; waiters stop waiting for it. The caller holds
+// ack_lock.
+static void backup_drop(backup_t *b, const char *why)
+{
+    if (!b->failed)
+    {
+        b->failed = 1;
+        shutdown(b->fd, SHUT_RDWR); // Its acknowledgement reader sees the end
+        fprintf(stderr, "Backup %s %s; continuing without it\n", b->addr, why);
+    }
+    pthread_cond_broadcast(&ack_cond);
+}
+
+static void backup_fail(backup_t *b, const char *why)
+{
+    pthread_mutex_lock(&ack_lock);
+    backup_drop(b, why);
+    pthread_mutex_unlock(&ack_lock);
+}
+
+// Reads the acknowledgements of one backup until its stream fails
+static void *ack_main(void *arg)
+{
+    backup_t *b = arg;
+    uint64_t acked;
+    while (read_full(b->fd, &acked, sizeof(acked)) == 0)
+    {
+        if (acked == REPL_DIVERGED)
+        {
+            backup_fail(b, "reports that its image differs");
+            return NULL;
+        }
+        pthread_mutex_lock(&ack_lock);
+        b->acked = acked;
+        pthread_cond_broadcast(&ack_cond);
+        pthread_mutex_unlock(&ack_lock);
+    }
+    backup_fail(b, "closed its stream");
+    return NULL;
+}
+
+int repl_add_backup(const char *addr)
+{
+    if (nbackups == MAX_BACKUPS)
+    {
+        fprintf(stderr, "More than %d backups\n", MAX_BACKUPS);
+        return -1;
+    }
+    backup_t *b = &backups[nbackups];
+    snprintf(b->addr, sizeof(b->addr), "%s", addr);
+    char *colon = strrchr(b->addr, ':');
+    if (colon == NULL)
+    {
+        fprintf(stderr, "Backup must be host:port: %s\n", addr);
+        return -1;
+    }
+    *colon = '\0';
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(b->addr, colon + 1, &hints, &res);
+    *colon = ':';
+    if (err != 0)
+    {
+        fprintf(stderr, "getaddrinfo failed for %s: %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+    b->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (b->fd < 0 || connect(b->fd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        fprintf(stderr, "Cannot connect to backup %s: ", addr);
+        perror(NULL);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    // Records are small and each one holds up a client. A send runs under
+    // the primary's ordering lock, so it must not block for long on a
+    // backup that stopped reading.
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {REPL_TIMEOUT_MS / 1000, REPL_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(b->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, ack_main, b) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(t);
+    nbackups++;
+    return 0;
+}
+
+unsigned long repl_send(const mfs_hdr_t *rec, const char *data, const repl_version_t *versions, int nversions)
+{
+    if (nbackups == 0)
+        return 0;
+
+    // The header's frag (unused by mutations but WRITE_RANGE, which resets
+    // it) counts the versions
+    mfs_hdr_t hdr = *rec;
+    hdr.frag = nversions;
+    unsigned long seq = ++sent;
+    for (int i = 0; i < nbackups; i++)
+    {
+        backup_t *b = &backups[i];
+        if (__atomic_load_n(&b->failed, __ATOMIC_RELAXED))
+            continue;
+        struct iovec iov[3] = {{&hdr, sizeof(hdr)},
+                               {(void *)data, rec->len},
+                               {(void *)versions, nversions * sizeof(repl_version_t)}};
+        if (write_full(b->fd, iov, 3) < 0)
+            backup_fail(b, errno == EAGAIN || errno == EWOULDBLOCK ? "stopped taking records" : "failed");
+    }
+    return seq;
+}
+
+void repl_wait(unsigned long seq)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPL_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += REPL_TIMEOUT_MS % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&ack_lock);
+    for (int i = 0; i < nbackups; i++)
+    {
+        while (!backups[i].failed && backups[i].acked < seq)
+        {
+            if (pthread_cond_timedwait(&ack_cond, &ack_lock, &deadline) == ETIMEDOUT &&
+                backups[i].acked < seq)
+            {
+                backup_drop(&backups[i], "stopped acknowledging");
+            }
+        }
+    }
+    pthread_mutex_unlock(&ack_lock);
+}
+
+// Tells the primary that this backup's image differs from its own, then
+// waits for the primary to drop the stream and stops the server
+static void diverged(int fd)
+{
+    uint64_t marker = REPL_DIVERGED;
+    struct iovec iov = {&marker, sizeof(marker)};
+    write_full(fd, &iov, 1);
+    char buf[4096];
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+        ; // Records already on the way are not applied
+    printf("Replication stream ended after %lu records; stopping\n", stats.applied);
+    exit(1);
+}
+
+// Applies the primary's stream; the server stops when it ends
+static void *apply_main(void *arg)
+{
+    (void)arg;
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+        perror("accept");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    printf("Replication stream connected\n");
+
+    char *data = malloc(MAX_RECORD);
+    if (data == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    mfs_hdr_t rec;
+    repl_version_t versions[REPL_MAX_VERSIONS];
+    while (read_full(fd, &rec, sizeof(rec)) == 0)
+    {
+        if (rec.magic != MFS_PROTO_MAGIC || rec.version != MFS_PROTO_VERSION || rec.len > MAX_RECORD ||
+            rec.frag > REPL_MAX_VERSIONS || read_full(fd, data, rec.len) < 0 ||
+            read_full(fd, versions, rec.frag * sizeof(repl_version_t)) < 0)
+        {
+            fprintf(stderr, "Malformed replication record\n");
+            exit(1);
+        }
+        int rc = apply_fn(&rec, data, versions, rec.frag);
+        if (rc != rec.status)
+        {
+            fprintf(stderr, "Record %lu (opcode %d, inum %d) gave %d here and %d on the primary; images differ\n",
+                    stats.applied + 1, rec.opcode, rec.inum, rc, rec.status);
+            diverged(fd);
+        }
+        __atomic_add_fetch(&stats.applied, 1, __ATOMIC_RELAXED);
+
+        // Commit and acknowledge once the primary has sent all it has
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, 0) == 0)
+        {
+            if (commit_fn() < 0)
+            {
+                fprintf(stderr, "Commit failed\n");
+                exit(1);
+            }
+            uint64_t acked = stats.applied;
+            struct iovec iov = {&acked, sizeof(acked)};
+            if (write_full(fd, &iov, 1) < 0)
+                break;
+            __atomic_add_fetch(&stats.acks, 1, __ATOMIC_RELAXED);
+        }
+    }
+    commit_fn();
+    printf("Replication stream ended after %lu records; stopping\n", stats.applied);
+    exit(0);
+}
+
+int repl_serve(int port, int (*apply)(mfs_hdr_t *rec, char *data, const repl_version_t *versions, int n),
+               int (*commit)(void))
+{
+    apply_fn = apply;
+    commit_fn = commit;
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        perror("socket creation failed");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0)
+    {
+        perror("replication bind failed");
+        return -1;
+    }
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, apply_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+void repl_get_stats(repl_stats_t *st)
+{
+    int live = 0;
+    pthread_mutex_lock(&ack_lock);
+    for (int i = 0; i < nbackups; i++)
+        live += !backups[i].failed;
+    pthread_mutex_unlock(&ack_lock);
+    st->backups = live;
+    st->sent = __atomic_load_n(&sent, __ATOMIC_RELAXED);
+    st->applied = __atomic_load_n(&stats.applied, __ATOMIC_RELAXED);
+    st->acks = __atomic_load_n(&stats.acks, __ATOMIC_RELAXED);
+}
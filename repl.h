@@ -0,0 +1,70 @@
+#ifndef __repl_h__
+#define __repl_h__
+
+#include "proto.h" // mfs_hdr_t
+
+// Primary/backup replication by log shipping.
+//
+// A primary keeps a TCP stream open to each of its backups and sends every
+// mutation it applies down all of them as a record: the request's header,
+// with status set to the primary's result and len to the payload that
+// follows (the block of a WRITE, all blocks of a WRITE_RANGE), then the
+// versions the mutation gave the inodes it changed, which the backup takes
+// over so that a client sees the same version from every server. The caller
+// sends records in the order it applied the mutations, and waits with
+// repl_wait() before acknowledging one. A backup applies the records in
+// stream order, commits, and acknowledges with the number of records it has
+// applied so far, whenever no more records are waiting; so an acknowledged
+// mutation is durable on every backup, and one commit covers a burst.
+//
+// A backup whose stream fails is dropped and the primary carries on without
+// it, as is one that takes longer than REPL_TIMEOUT_MS (repl.c) to accept a
+// record or to acknowledge one, so a stuck backup holds up the primary for
+// that long at most. A backup on which a record gives a different result than
+// it did on the primary reports that its image has diverged, and the primary
+// drops it too. A backup stops once its stream ends, since it can no longer
+// be kept current. Backups must start from a copy of the primary's image.
+
+#define REPL_MAX_VERSIONS 8 // Inodes one mutation can change, with room to spare
+
+// The version a mutation gave an inode (a local inode number)
+typedef struct
+{
+    int32_t inum;
+    uint32_t version;
+} repl_version_t;
+
+typedef struct
+{
+    int backups;           // Primary: backups still connected
+    unsigned long sent;    // Primary: records sent
+    unsigned long applied; // Backup: records applied
+    unsigned long acks;    // Backup: acknowledgements sent (one commit each)
+} repl_stats_t;
+
+// Primary: connects to the backup at "host:port" and starts reading its
+// acknowledgements. Returns 0, or -1 with a message printed.
+int repl_add_backup(const char *addr);
+
+// Primary: sends the record rec, followed by rec->len bytes of data and the
+// nversions versions, to every backup. The caller serializes calls. Returns
+// the record's sequence number, for repl_wait(); 0 if there are no backups.
+unsigned long repl_send(const mfs_hdr_t *rec, const char *data, const repl_version_t *versions, int nversions);
+
+// Primary: waits until every backup still connected has applied record seq.
+void repl_wait(unsigned long seq);
+
+// Backup: listens on TCP port port and starts a thread that takes the
+// primary's stream, applies each record with apply(), which also sets the
+// record's n versions, and commits with commit() before acknowledging. apply() returns the result the mutation
+// has here; a result other than the primary's means the images have
+// diverged, which is reported to the primary instead of acknowledging, and
+// the server exits once the primary has dropped the stream. Returns 0, or -1
+// with a message printed.
+int repl_serve(int port, int (*apply)(mfs_hdr_t *rec, char *data, const repl_version_t *versions, int n),
+               int (*commit)(void));
+
+// Copies the current counters into st.
+void repl_get_stats(repl_stats_t *st);
+
+#endif // __repl_h__
@@ -1,556 +1,2996 @@
-
-#include "ufs.h"        // Custom header file for file system structures and definitions
-#include <assert.h>     // Assert function for error checking
-#include <errno.h>      // Error number definitions
-#include <fcntl.h>      // File control options
-#include <netinet/in.h> // Internet address family structures
-#include <stdio.h>      // Standard input/output library
-#include <stdlib.h>     // Standard library for memory allocation and process control
-#include <string.h>     // String handling functions
-#include <sys/socket.h> // Socket functions
-#include <unistd.h>     // Standard symbolic constants and types
-
-#define PORT 12345
-#define BUFFER_SIZE 4096 // Match BUFFER_SIZE with UFS_BLOCK_SIZE
-
-typedef struct
-{
-    super_t superblock;   // Superblock of the file system
-    inode_t inodes[4096]; // In-memory inode table
-} fs_state_t;
-
-fs_state_t fs_state; // Global file system state
-int fd;              // File descriptor for the file system image
-
-// Function to initialize or load the file system
-void init_or_load_fs(const char *fs_image);
-
-// Function to process incoming requests
-void process_request(char *buffer, int sockfd, struct sockaddr_in client_addr, socklen_t addr_size);
-
-// Helper functions for different file operations
-int handle_lookup(int pinum, char *name);
-int handle_stat(int inum, inode_t *inode);
-int handle_write(int inum, char *buffer, int block);
-int handle_read(int inum, char *buffer, int block);
-int handle_creat(int pinum, int type, char *name);
-int handle_unlink(int pinum, char *name);
-
-int main(int argc, char *argv[])
-{
-    if (argc != 3)
-    {
-        fprintf(stderr, "Usage: %s [portnum] [file-system-image]\n", argv[0]);
-        exit(1);
-    }
-
-    int port = atoi(argv[1]); // Convert port number from string to integer
-    char *fs_image = argv[2]; // Get file system image file name from command line arguments
-
-    // Initialize or load the file system image
-    init_or_load_fs(fs_image);
-
-    int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    char buffer[BUFFER_SIZE];
-    socklen_t addr_size;
-
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
-    {
-        perror("socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    memset(&server_addr, 0, sizeof(server_addr)); // Clear server address structure
-    memset(&client_addr, 0, sizeof(client_addr)); // Clear client address structure
-
-    // Fill server information
-    server_addr.sin_family = AF_INET;         // IPv4
-    server_addr.sin_addr.s_addr = INADDR_ANY; // Any incoming interface
-    server_addr.sin_port = htons(port);       // Port number in network byte order
-
-    // Bind the socket with the server address
-    if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("UDP Server listening on port %d\n", port);
-
-    while (1)
-    {
-        addr_size = sizeof(client_addr);
-        int len = recvfrom(sockfd, (char *)buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &addr_size);
-        buffer[len] = '\0'; // Null-terminate the received message
-        printf("Received: %s\n", buffer);
-
-        // Process received message and prepare a response
-        process_request(buffer, sockfd, client_addr, addr_size);
-    }
-
-    return 0;
-}
-
-void init_or_load_fs(const char *fs_image)
-{
-    fd = open(fs_image, O_RDWR | O_CREAT, 0666); // Open or create the file system image with read-write permissions
-    if (fd < 0)
-    {
-        perror("open");
-        exit(EXIT_FAILURE);
-    }
-
-    off_t size = lseek(fd, 0, SEEK_END); // Seek to the end of the file to check its size
-    if (size == 0)
-    {
-        // Initialization of the File System Image:
-        printf("Initializing file system image...\n");
-
-        super_t *s = &fs_state.superblock;
-        int num_inodes = 32; // Number of inodes
-        int num_data = 32;   // Number of data blocks
-
-        unsigned char *empty_buffer = calloc(UFS_BLOCK_SIZE, 1); // Allocate zeroed buffer for initialization
-        if (empty_buffer == NULL)
-        {
-            perror("calloc");
-            exit(1);
-        }
-
-        int bits_per_block = (8 * UFS_BLOCK_SIZE); // Bits per block (8 bits per byte)
-
-        // Set up superblock fields
-        s->num_inodes = num_inodes;
-        s->num_data = num_data;
-        s->inode_bitmap_addr = 1;                          // Inode bitmap starts at block 1
-        s->inode_bitmap_len = num_inodes / bits_per_block; // Length of inode bitmap in blocks
-        if (num_inodes % bits_per_block != 0)
-            s->inode_bitmap_len++;
-
-        s->data_bitmap_addr = s->inode_bitmap_addr + s->inode_bitmap_len;
-        s->data_bitmap_len = num_data / bits_per_block;
-        if (num_data % bits_per_block != 0)
-            s->data_bitmap_len++;
-
-        s->inode_region_addr = s->data_bitmap_addr + s->data_bitmap_len;
-        int total_inode_bytes = num_inodes * sizeof(inode_t);
-        s->inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-        if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
-            s->inode_region_len++;
-
-        s->data_region_addr = s->inode_region_addr + s->inode_region_len;
-        s->data_region_len = num_data;
-
-        int total_blocks = 1 + s->inode_bitmap_len + s->data_bitmap_len + s->inode_region_len + s->data_region_len;
-
-        // Write superblock to disk
-        int rc = pwrite(fd, s, sizeof(super_t), 0);
-        if (rc != sizeof(super_t))
-        {
-            perror("write");
-            exit(1);
-        }
-
-        // Zero out all blocks
-        for (int i = 1; i < total_blocks; i++)
-        {
-            rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-            if (rc != UFS_BLOCK_SIZE)
-            {
-                perror("write");
-                exit(1);
-            }
-        }
-
-        // Bitmap initialization
-        typedef struct
-        {
-            unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
-        } bitmap_t;
-        bitmap_t b;
-        for (int i = 0; i < 1024; i++)
-            b.bits[i] = 0;
-        b.bits[0] = 0x1 << 31; // First entry is allocated
-
-        rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s->inode_bitmap_addr * UFS_BLOCK_SIZE);
-        assert(rc == UFS_BLOCK_SIZE);
-
-        rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s->data_bitmap_addr * UFS_BLOCK_SIZE);
-        assert(rc == UFS_BLOCK_SIZE);
-
-        // Inode table initialization
-        typedef struct
-        {
-            inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-        } inode_block;
-
-        inode_block itable;
-        itable.inodes[0].type = UFS_DIRECTORY;
-        itable.inodes[0].size = 2 * sizeof(dir_ent_t);
-        itable.inodes[0].direct[0] = s->data_region_addr;
-        for (int i = 1; i < DIRECT_PTRS; i++)
-            itable.inodes[0].direct[i] = -1;
-
-        rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s->inode_region_addr * UFS_BLOCK_SIZE);
-        assert(rc == UFS_BLOCK_SIZE);
-
-        // Root directory initialization
-        typedef struct
-        {
-            dir_ent_t entries[128];
-        } dir_block_t;
-        dir_block_t parent;
-        strcpy(parent.entries[0].name, ".");
-        parent.entries[0].inum = 0;
-
-        strcpy(parent.entries[1].name, "..");
-        parent.entries[1].inum = 0;
-
-        for (int i = 2; i < 128; i++)
-            parent.entries[i].inum = -1;
-
-        rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s->data_region_addr * UFS_BLOCK_SIZE);
-        assert(rc == UFS_BLOCK_SIZE);
-
-        free(empty_buffer);
-        (void)fsync(fd);
-    }
-    else
-    {
-        // Load Existing File System Image:
-        printf("Loading file system image...\n");
-
-        lseek(fd, 0, SEEK_SET);                                   // Seek to the beginning of the file
-        int rc = read(fd, &fs_state.superblock, sizeof(super_t)); // Read the superblock
-        if (rc != sizeof(super_t))
-        {
-            perror("read");
-            exit(1);
-        }
-
-        // Read the inode table
-        for (int i = 0; i < fs_state.superblock.num_inodes; i++)
-        {
-            lseek(fd, (fs_state.superblock.inode_region_addr * UFS_BLOCK_SIZE) + (i * sizeof(inode_t)), SEEK_SET);
-            rc = read(fd, &fs_state.inodes[i], sizeof(inode_t));
-            if (rc != sizeof(inode_t))
-            {
-                perror("read");
-                exit(1);
-            }
-        }
-    }
-}
-
-// Helper function to handle LOOKUP request
-int handle_lookup(int pinum, char *name)
-{
-    if (pinum < 0 || pinum >= (int)fs_state.superblock.num_inodes)
-    {
-        printf("Invalid pinum: %d\n", pinum);
-        return -1; // Invalid pinum
-    }
-
-    inode_t *dir_inode = &fs_state.inodes[pinum];
-    if (dir_inode->type != UFS_DIRECTORY)
-    {
-        printf("Not a directory: %d\n", pinum);
-        return -1; // Not a directory
-    }
-
-    // Iterate over the directory entries to find the matching name
-    for (int i = 0; i < DIRECT_PTRS && (int)dir_inode->direct[i] != -1; i++)
-    {
-        typedef struct
-        {
-            dir_ent_t entries[128];
-        } dir_block_t;
-        dir_block_t dir_block;
-        lseek(fd, dir_inode->direct[i] * UFS_BLOCK_SIZE, SEEK_SET); // Seek to the data block
-        read(fd, &dir_block, sizeof(dir_block_t));                  // Read the directory block
-
-        for (int j = 0; j < 128; j++)
-        {
-            if (dir_block.entries[j].inum != -1 && strcmp(dir_block.entries[j].name, name) == 0)
-            {
-                return dir_block.entries[j].inum; // Return the inode number
-            }
-        }
-    }
-
-    printf("Name not found: %s\n", name);
-    return -1; // Name not found
-}
-
-// Helper function to handle STAT request
-int handle_stat(int inum, inode_t *inode)
-{
-    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
-    {
-        return -1; // Invalid inum
-    }
-
-    *inode = fs_state.inodes[inum];
-    return 0;
-}
-
-// Helper function to handle WRITE request
-int handle_write(int inum, char *buffer, int block)
-{
-    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
-    {
-        return -1; // Invalid inum
-    }
-
-    inode_t *inode = &fs_state.inodes[inum];
-    if (inode->type != UFS_REGULAR_FILE)
-    {
-        return -1; // Not a regular file
-    }
-
-    if (block < 0 || (unsigned int)block >= DIRECT_PTRS)
-    {
-        return -1; // Invalid block number
-    }
-
-    // Allocate a new block if necessary
-    if ((int)inode->direct[block] == -1)
-    {
-        inode->direct[block] = fs_state.superblock.data_region_addr + inode->size / UFS_BLOCK_SIZE;
-        inode->size += UFS_BLOCK_SIZE;
-    }
-
-    // Write the data to the allocated block
-    pwrite(fd, buffer, UFS_BLOCK_SIZE, inode->direct[block] * UFS_BLOCK_SIZE);
-    fsync(fd); // Force the data to be written to disk
-
-    return 0;
-}
-
-// Helper function to handle READ request
-int handle_read(int inum, char *buffer, int block)
-{
-    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
-    {
-        return -1; // Invalid inum
-    }
-
-    inode_t *inode = &fs_state.inodes[inum];
-    if (block < 0 || (unsigned int)block >= DIRECT_PTRS || (int)inode->direct[block] == -1)
-    {
-        return -1; // Invalid block number or unallocated block
-    }
-
-    // Read the data from the specified block
-    pread(fd, buffer, UFS_BLOCK_SIZE, inode->direct[block] * UFS_BLOCK_SIZE);
-    return 0;
-}
-
-// Helper function to handle CREAT request
-int handle_creat(int pinum, int type, char *name)
-{
-    if (pinum < 0 || pinum >= (int)fs_state.superblock.num_inodes)
-    {
-        printf("Invalid pinum: %d\n", pinum);
-        return -1; // Invalid pinum
-    }
-
-    inode_t *dir_inode = &fs_state.inodes[pinum];
-    if (dir_inode->type != UFS_DIRECTORY)
-    {
-        printf("Not a directory: %d\n", pinum);
-        return -1; // Not a directory
-    }
-
-    // Check if the name already exists
-    int existing_inum = handle_lookup(pinum, name);
-    if (existing_inum != -1)
-    {
-        printf("Name already exists: %s\n", name);
-        return 0; // Name already exists
-    }
-
-    // Find an empty inode
-    int new_inum = -1;
-    for (int i = 0; i < (int)fs_state.superblock.num_inodes; i++)
-    {
-        if (fs_state.inodes[i].type == -1)
-        {
-            new_inum = i;
-            break;
-        }
-    }
-
-    if (new_inum == -1)
-    {
-        printf("No empty inode available\n");
-        return -1; // No empty inode available
-    }
-
-    // Initialize the new inode
-    inode_t *new_inode = &fs_state.inodes[new_inum];
-    new_inode->type = type;
-    new_inode->size = 0;
-    memset(new_inode->direct, -1, sizeof(new_inode->direct));
-
-    // Add the new entry to the parent directory
-    for (int i = 0; i < DIRECT_PTRS && (int)dir_inode->direct[i] != -1; i++)
-    {
-        typedef struct
-        {
-            dir_ent_t entries[128];
-        } dir_block_t;
-        dir_block_t dir_block;
-        lseek(fd, dir_inode->direct[i] * UFS_BLOCK_SIZE, SEEK_SET);
-        read(fd, &dir_block, sizeof(dir_block_t));
-
-        for (int j = 0; j < 128; j++)
-        {
-            if (dir_block.entries[j].inum == -1)
-            {
-                strcpy(dir_block.entries[j].name, name);
-                dir_block.entries[j].inum = new_inum;
-                pwrite(fd, &dir_block, sizeof(dir_block_t), dir_inode->direct[i] * UFS_BLOCK_SIZE);
-                fsync(fd); // Force the data to be written to disk
-                return 0;
-            }
-        }
-    }
-
-    printf("Directory is full\n");
-    return -1; // Directory is full
-}
-
-// Helper function to handle UNLINK request
-int handle_unlink(int pinum, char *name)
-{
-    if (pinum < 0 || pinum >= (int)fs_state.superblock.num_inodes)
-    {
-        return -1; // Invalid pinum
-    }
-
-    inode_t *dir_inode = &fs_state.inodes[pinum];
-    if (dir_inode->type != UFS_DIRECTORY)
-    {
-        return -1; // Not a directory
-    }
-
-    // Find the directory entry
-    for (int i = 0; i < DIRECT_PTRS && (int)dir_inode->direct[i] != -1; i++)
-    {
-        typedef struct
-        {
-            dir_ent_t entries[128];
-        } dir_block_t;
-        dir_block_t dir_block;
-        lseek(fd, dir_inode->direct[i] * UFS_BLOCK_SIZE, SEEK_SET);
-        read(fd, &dir_block, sizeof(dir_block_t));
-
-        for (int j = 0; j < 128; j++)
-        {
-            if (dir_block.entries[j].inum != -1 && strcmp(dir_block.entries[j].name, name) == 0)
-            {
-                int inum = dir_block.entries[j].inum;
-                dir_block.entries[j].inum = -1;
-                pwrite(fd, &dir_block, sizeof(dir_block_t), dir_inode->direct[i] * UFS_BLOCK_SIZE);
-                fsync(fd); // Force the data to be written to disk
-
-                // Mark the inode as free
-                fs_state.inodes[inum].type = -1;
-                return 0;
-            }
-        }
-    }
-
-    return -1; // Name not found
-}
-
-// Function to process incoming requests
-void process_request(char *buffer, int sockfd, struct sockaddr_in client_addr, socklen_t addr_size)
-{
-    char command[BUFFER_SIZE];
-    sscanf(buffer, "%s", command); // Extract the command from the buffer
-
-    char response[BUFFER_SIZE];
-    memset(response, 0, BUFFER_SIZE); // Clear the response buffer
-
-    if (strcmp(command, "LOOKUP") == 0)
-    {
-        int pinum;
-        char name[28];
-        sscanf(buffer + strlen(command) + 1, "%d %s", &pinum, name);
-        int inum = handle_lookup(pinum, name);
-        snprintf(response, BUFFER_SIZE, "%d", inum);
-    }
-    else if (strcmp(command, "STAT") == 0)
-    {
-        int inum;
-        sscanf(buffer + strlen(command) + 1, "%d", &inum);
-        inode_t inode;
-        int rc = handle_stat(inum, &inode);
-        if (rc == 0)
-        {
-            snprintf(response, BUFFER_SIZE, "%d %d %u", inode.type, inode.size, inode.direct[0]);
-        }
-        else
-        {
-            snprintf(response, BUFFER_SIZE, "%d", rc);
-        }
-    }
-    else if (strcmp(command, "WRITE") == 0)
-    {
-        int inum, block;
-        char write_buffer[UFS_BLOCK_SIZE];
-        sscanf(buffer + strlen(command) + 1, "%d %d", &inum, &block);
-        memcpy(write_buffer, buffer + strlen(command) + 1 + sizeof(int) * 2, UFS_BLOCK_SIZE);
-        int rc = handle_write(inum, write_buffer, block);
-        snprintf(response, BUFFER_SIZE, "%d", rc);
-    }
-    else if (strcmp(command, "READ") == 0)
-    {
-        int inum, block;
-        char read_buffer[UFS_BLOCK_SIZE];
-        sscanf(buffer + strlen(command) + 1, "%d %d", &inum, &block);
-        int rc = handle_read(inum, read_buffer, block);
-        if (rc == 0)
-        {
-            memcpy(response, read_buffer, UFS_BLOCK_SIZE);
-        }
-        else
-        {
-            snprintf(response, BUFFER_SIZE, "%d", rc);
-        }
-    }
-    else if (strcmp(command, "CREAT") == 0)
-    {
-        int pinum, type;
-        char name[28];
-        sscanf(buffer + strlen(command) + 1, "%d %d %s", &pinum, &type, name);
-        int rc = handle_creat(pinum, type, name);
-        snprintf(response, BUFFER_SIZE, "%d", rc);
-    }
-    else if (strcmp(command, "UNLINK") == 0)
-    {
-        int pinum;
-        char name[28];
-        sscanf(buffer + strlen(command) + 1, "%d %s", &pinum, name);
-        int rc = handle_unlink(pinum, name);
-        snprintf(response, BUFFER_SIZE, "%d", rc);
-    }
-    else if (strcmp(command, "SHUTDOWN") == 0)
-    {
-        fsync(fd); // Force all data to be written to disk
-        snprintf(response, BUFFER_SIZE, "0");
-        sendto(sockfd, response, strlen(response), 0, (const struct sockaddr *)&client_addr, addr_size);
-        exit(0); // Shutdown the server
-    }
-    else
-    {
-        // Unknown command
-        snprintf(response, BUFFER_SIZE, "Unknown command");
-    }
-
-    sendto(sockfd, response, strlen(response), 0, (const struct sockaddr *)&client_addr, addr_size);
-}
+#define _GNU_SOURCE // recvmmsg() and sendmmsg()
+
+#include "ufs.h"        // Custom header file for file system structures and definitions
+#include "proto.h"      // Wire protocol shared with libmfs
+#include "bcache.h"     // Server block buffer cache
+#include "dirindex.h"   // Per-directory name hash index
+#include "extmap.h"     // Per-file extent map
+#include "lfs.h"        // Log-structured image format
+#include "balloc.h"     // Bitmap block allocator
+#include "diskio.h"     // Batched commit writes (io_uring or pwritev)
+#include "drc.h"        // Duplicate request cache
+#include "repl.h"       // Primary/backup replication stream
+#include <assert.h>     // Assert function for error checking
+#include <errno.h>      // Error number definitions
+#include <fcntl.h>      // File control options
+#include <netinet/in.h> // Internet address family structures
+#include <pthread.h>    // Worker threads and inode locks
+#include <stdio.h>      // Standard input/output library
+#include <stdlib.h>     // Standard library for memory allocation and process control
+#include <string.h>     // String handling functions
+#include <sys/epoll.h>  // Event loop over the listening sockets
+#include <sys/eventfd.h> // Wakes every worker on SHUTDOWN
+#include <sys/mman.h>   // mmap for the lazily loaded inode table
+#include <sys/socket.h> // Socket functions
+#include <sys/uio.h>    // Scatter/gather I/O vectors
+#include <time.h>       // clock_gettime for the group commit window
+#include <unistd.h>     // Standard symbolic constants and types
+
+#define PORT 12345
+#define MAX_WORKERS 64   // Upper bound on the worker pool size
+#define DEFAULT_CACHE_MB 16 // Default block cache budget
+#define DEFAULT_GC_MAX_OPS 64 // Default number of mutations per group commit
+#define MAX_PORTS 8      // Listening ports per server
+#define IO_BATCH 32      // Datagrams received or sent per system call
+#define SOCK_RCVBUF (4 << 20) // Socket receive buffer, in bytes
+#define DEFAULT_LEASE_MS 1000 // Default client cache lease
+#define DEFAULT_CALLBACK_MS 30000 // Default lifetime of a callback promise
+#define DEFAULT_DRC_ENTRIES 4096 // Default size of the duplicate request cache
+#define DEFAULT_READAHEAD 128 // Default largest read-ahead window, in blocks
+#define READAHEAD_MIN 4       // First read-ahead window of a sequential stream
+#define READAHEAD_STRIPES 64  // Inode i's stream is guarded by readahead_locks[i % READAHEAD_STRIPES]
+
+typedef struct
+{
+    super_t superblock; // Superblock of the file system
+    inode_t *inodes;    // In-memory inode table (num_inodes entries)
+} fs_state_t;
+
+fs_state_t fs_state; // Global file system state
+int fd;              // File descriptor for the file system image
+int lfs_mode;        // Image is log-structured (see lfs.h) rather than fixed-layout
+int lazy_inodes;     // Map the inode table and let it fault in on first use
+
+// Global number of local inode 0 (see MFS_SHARD_SPAN): requests and
+// directory entries carry global inode numbers, and everything else is
+// indexed by local ones. Entries may name inodes of other shards.
+int shard_base;
+
+// Replication (see repl.h). A primary (-B) applies mutations one at a time,
+// under order_lock, so that its backups can apply them in the same order and
+// get the same results, inode numbers included. A backup (-R) takes
+// mutations only from its primary's stream and serves reads. The versions
+// the running mutation gives inodes are collected in bumped, under
+// order_lock, and go with its record so that every server has the same.
+int replicating;
+int backup_mode;
+pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+repl_version_t bumped[REPL_MAX_VERSIONS];
+int nbumped;
+
+// Inodes changed since the last commit. inode_mark_dirty() is called with the
+// inode's lock held exclusively; fs_commit() takes the set under dirty_lock.
+char *inode_dirty;   // Per inode: already in dirty_list
+int *dirty_list;     // Dirty inode numbers
+int dirty_count;     // Entries in dirty_list
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Data blocks of fixed-layout images given back since the last commit. They
+// only return to data_alloc once the commit that writes the inodes no longer
+// pointing to them has succeeded; until then the image still gives them to
+// their old owner, so no other file may take and overwrite them. A block is
+// queued under dirty_lock together with marking its inode dirty, so the
+// commit that takes it also writes that inode.
+unsigned int *freed_list; // Queued block addresses
+int freed_count;          // Entries in freed_list
+int freed_cap;            // Allocated entries
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes fs_commit()
+
+// Locking: every inode has a reader/writer lock. Read-only requests (LOOKUP,
+// STAT, READ) take it shared, mutations take it exclusive. Operations that
+// touch a directory and one of its children always lock the parent first.
+// Both allocators below are protected by alloc_lock.
+pthread_rwlock_t *inode_locks;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Inode allocator: the on-disk inode bitmap of fixed-layout images, or one
+// derived from the inode map of log-structured images. Bit i is inode i.
+balloc_t *inode_alloc;
+
+// Data block allocator of fixed-layout images, loaded from the on-disk data
+// bitmap and protected by alloc_lock. Bit i is block data_region_addr + i.
+balloc_t *data_alloc;
+int data_alloc_hint; // Where a file with no blocks yet starts looking
+
+// Version of every inode, changed by each mutation of it: CREAT and UNLINK
+// bump the directory and the child, WRITE the file. LOOKUP and STAT replies
+// carry it with a lease of lease_ms (see mfs_lease_t) so that clients can
+// cache them. Bumped under the inode's lock held exclusively; versions are
+// not persistent and restart at 0 with the server. A backup takes its
+// primary's versions from the replication stream.
+uint32_t *inode_versions;
+int lease_ms = DEFAULT_LEASE_MS;
+
+// Callback promises (see proto.h): for each inode, the clients caching some
+// of its blocks. A promise is added before the READ that asks for it reads
+// the block, and broken with a CALLBACK datagram by the first mutation of the
+// inode after that, under the inode's lock held exclusively. Protected by
+// callback_lock.
+typedef struct callback
+{
+    uint32_t client_id;      // Client holding the promise
+    int sockfd;              // Socket its READ arrived on
+    struct sockaddr_in addr; // Where to send the callback
+    socklen_t addr_size;     // Length of addr
+    double expires;          // When the promise lapses on its own
+    struct callback *next;
+} callback_t;
+
+callback_t **callbacks;
+int callback_ms = DEFAULT_CALLBACK_MS;
+pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Name index of each directory, built on first use and then kept up to date
+// under the directory's lock. dir_index_lock only serializes the lazy build,
+// which can be triggered by readers holding the lock shared.
+dir_index_t **dir_indexes;
+pthread_mutex_t dir_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Extent map of each inode, built on first use from the inode (and its
+// extent blocks) and written back to them after every change, under the
+// inode's lock. extent_map_lock only serializes the lazy build.
+extent_map_t **extent_maps;
+pthread_mutex_t extent_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Sequential read detection: each inode remembers where its last READ or
+// READ_RANGE ended. A read starting there continues a stream, and the blocks
+// after it are prefetched into the block cache (see readahead_note()). The
+// window doubles each time it is refilled, up to readahead_max blocks, and
+// drops back to nothing on a non-sequential read.
+typedef struct
+{
+    unsigned int next;   // File block right after the last read
+    unsigned int window; // Current window in blocks (0: not in a stream)
+    unsigned int ahead;  // File block up to which prefetches were queued
+} readahead_t;
+
+readahead_t *readaheads;
+int readahead_max = DEFAULT_READAHEAD;
+pthread_mutex_t readahead_locks[READAHEAD_STRIPES];
+
+typedef struct
+{
+    int id;           // Worker index
+    const int *ports; // UDP ports to bind
+    int nports;       // Entries in ports
+} worker_t;
+
+// Group commit: instead of fsyncing after every mutation, workers queue the
+// reply and move on. The committer thread waits until gc_window_us has passed
+// since the first queued reply (or gc_max_ops replies are queued), makes the
+// whole batch durable with one fs_commit(), and only then sends the replies.
+// With gc_window_us == 0 every mutation commits on its own, as before.
+typedef struct
+{
+    int sockfd;              // Socket the request arrived on
+    struct sockaddr_in addr; // Client address
+    socklen_t addr_size;     // Length of addr
+    mfs_hdr_t reply;         // Reply to send once the batch is durable
+} pending_reply_t;
+
+int gc_window_us = 0;                  // Batching window in microseconds (0 = off)
+int gc_max_ops = DEFAULT_GC_MAX_OPS;   // Commit early once this many replies wait
+pending_reply_t *gc_queue;             // Replies waiting for the next commit
+int gc_count;                          // Entries in gc_queue
+int gc_stop;                           // Committer exits once gc_queue is empty
+pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gc_cond = PTHREAD_COND_INITIALIZER;
+
+// SHUTDOWN: the worker that takes the first one records its reply and sets
+// stopping, and stop_fd wakes every worker. Each sends the replies of the
+// batch it has, then exits; main() lets the committer drain gc_queue, commits
+// and only then answers the SHUTDOWN and exits.
+int stopping;
+int stop_fd;
+pending_reply_t stop_reply;
+
+// Replies to one batch of received requests. They are sent together once
+// the whole batch has been processed. Without group commit, the replies to
+// mutations are held back until one fs_commit() has made the batch durable.
+typedef struct
+{
+    int count;                         // Queued replies
+    int commit;                        // Some queued reply waits for a commit
+    unsigned long repl_seq;            // Last replication record the replies wait for, or 0
+    pending_reply_t replies[IO_BATCH]; // Destination and header of each reply
+    char *data[IO_BATCH];              // Payload of each reply, or NULL
+    char durable[IO_BATCH];            // Reply waits for the commit
+    char *bufs;                        // IO_BATCH payload buffers, block-aligned
+    char *range_buf;                   // MFS_MAX_RANGE blocks for a READ_RANGE reply
+} reply_batch_t;
+
+// WRITE_RANGE requests whose fragments are still arriving, keyed by client
+// and request id. When every slot is taken the oldest partial request is
+// dropped; its client retransmits it.
+#define REASM_SLOTS 32
+typedef struct
+{
+    uint32_t client_id;     // Request being reassembled
+    uint32_t req_id;        // (in_use only)
+    int in_use;             // Slot holds a partial request
+    unsigned int have;      // Bit i: fragment i has arrived
+    unsigned long age;      // Order in which slots were started
+    char *buf;              // MFS_MAX_RANGE blocks, allocated on first use
+} reasm_t;
+
+reasm_t reasm[REASM_SLOTS];
+unsigned long reasm_clock;
+pthread_mutex_t reasm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long stat_commits;    // fs_commit() calls (one fsync each)
+unsigned long stat_commit_ops; // Mutations acknowledged after a commit
+unsigned long stat_inode_blocks; // Inode table blocks written back (fixed layout)
+unsigned long stat_inode_writes; // pwritev() calls that wrote them
+unsigned long stat_startup_us;   // Time taken to load the image at startup
+unsigned long stat_rx_calls;     // recvmmsg() calls that returned datagrams
+unsigned long stat_rx_msgs;      // Datagrams received
+unsigned long stat_tx_calls;     // sendmmsg() calls
+unsigned long stat_tx_msgs;      // Replies sent
+unsigned long stat_range_reads;  // READ_RANGE requests served
+unsigned long stat_range_writes; // WRITE_RANGE requests executed
+unsigned long stat_range_blocks; // Blocks moved by both
+unsigned long stat_callbacks_granted; // Callback promises made
+unsigned long stat_callbacks_broken;  // CALLBACK datagrams sent
+unsigned long stat_readdirs;          // READDIR requests served
+unsigned long stat_readdir_entries;   // Entries they returned
+unsigned long stat_path_lookups;      // LOOKUP_PATH requests served
+unsigned long stat_path_components;   // Components they resolved
+
+// Function to initialize or load the file system; a new image is created
+// log-structured if use_lfs is set
+void init_or_load_fs(const char *fs_image, int use_lfs);
+
+// Function to make all changes so far durable: write back dirty cached
+// blocks (and, for log-structured images, append the dirty inodes and write
+// a checkpoint), then fsync the image
+int fs_commit(void);
+
+// Function to record that an inode changed and must be part of the next commit
+void inode_mark_dirty(int inum);
+
+// Function to acknowledge a successful mutation once it is durable, either
+// with the commit that ends the current receive batch or as part of the next
+// group commit
+void commit_and_reply(reply_batch_t *rb, int sockfd, mfs_hdr_t *reply, struct sockaddr_in client_addr,
+                      socklen_t addr_size);
+
+// Group committer thread body
+void *committer_main(void *arg);
+
+// Function to set up the per-inode locks and directory index table once the
+// superblock is known
+void init_inode_state(void);
+
+// Worker thread body: owns one SO_REUSEPORT socket per port and serves
+// requests on them in batches
+void *worker_main(void *arg);
+
+// Function to process one decoded request; data holds req->len payload bytes.
+// The reply is queued in rb (or in the group commit queue).
+void process_request(mfs_hdr_t *req, char *data, int sockfd, struct sockaddr_in client_addr, socklen_t addr_size,
+                     reply_batch_t *rb);
+
+// Function to send n replies, each a header followed by reply.len bytes of
+// data[i] (data may be NULL when no reply carries a payload)
+void send_replies(pending_reply_t *replies, char **data, int n);
+
+// Function to format the server's counters for a STATS reply
+int format_stats(char *buf, int len);
+
+// Helper functions for different file operations
+int handle_lookup(int pinum, char *name, uint32_t *version);
+int handle_stat(int inum, inode_t *inode, uint32_t *version);
+int handle_write(int inum, char *buffer, int block);
+int handle_read(int inum, char *buffer, int block);
+int handle_read_range(int inum, char *buffer, int block, int count);
+int handle_write_range(int inum, char *buffer, int block, int count);
+int handle_readdir(int inum, int *cookie, int max, int plus, mfs_dirent_t *entries);
+int handle_lookup_path(int inum, char *path, mfs_pathstep_t *steps, int *resolved);
+int handle_creat(int pinum, int type, char *name);
+int handle_unlink(int pinum, char *name);
+int handle_alloc(int type, int parent);
+int handle_link(int pinum, char *name, int child);
+int handle_free(int inum);
+int apply_record(mfs_hdr_t *rec, char *data, const repl_version_t *versions, int n);
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-c cache-mb] [-g window-us] [-G max-ops] [-E lease-ms] [-C callback-ms] [-D drc-entries] [-A readahead-blocks] [-S shard] [-B backup-host:port]... [-R replication-port] [-L] [-l] [-U] [-P extra-port]... [portnum] [file-system-image]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int num_workers = 1;             // Number of worker threads
+    int cache_mb = DEFAULT_CACHE_MB; // Block cache budget in MB (0 disables it)
+    int use_lfs = 0;                 // Create new images log-structured
+    int use_uring = 0;               // Issue commit I/O through io_uring
+    int ports[MAX_PORTS];            // Listening ports; the positional one first
+    int nports = 1;
+    int drc_entries = DEFAULT_DRC_ENTRIES; // Duplicate request cache size (0 disables it)
+    int shard = 0;                         // Index of this server's shard
+    char *backup_addrs[MAX_PORTS];         // -B: backups to replicate to
+    int nbackup_addrs = 0;
+    int repl_port = 0;                     // -R: port of the primary's stream
+    int ch;
+
+    while ((ch = getopt(argc, argv, "t:c:g:G:E:C:D:A:S:B:R:LlUP:")) != -1)
+    {
+        switch (ch)
+        {
+        case 't':
+            num_workers = atoi(optarg);
+            break;
+        case 'c':
+            cache_mb = atoi(optarg);
+            break;
+        case 'g':
+            gc_window_us = atoi(optarg);
+            break;
+        case 'G':
+            gc_max_ops = atoi(optarg);
+            break;
+        case 'E':
+            lease_ms = atoi(optarg);
+            break;
+        case 'C':
+            callback_ms = atoi(optarg);
+            break;
+        case 'D':
+            drc_entries = atoi(optarg);
+            break;
+        case 'A':
+            readahead_max = atoi(optarg);
+            break;
+        case 'S':
+            shard = atoi(optarg);
+            break;
+        case 'B':
+            if (nbackup_addrs == MAX_PORTS)
+                usage(argv[0]);
+            backup_addrs[nbackup_addrs++] = optarg;
+            break;
+        case 'R':
+            repl_port = atoi(optarg);
+            break;
+        case 'L':
+            use_lfs = 1;
+            break;
+        case 'l':
+            lazy_inodes = 1;
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'P':
+            if (nports == MAX_PORTS)
+                usage(argv[0]);
+            ports[nports++] = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2 || num_workers < 1 || num_workers > MAX_WORKERS || cache_mb < 0 ||
+        gc_window_us < 0 || gc_max_ops < 1 || lease_ms < 0 || callback_ms < 0 ||
+        drc_entries < 0 || readahead_max < 0 || shard < 0 || shard >= MFS_MAX_SHARDS || repl_port < 0 ||
+        (repl_port > 0 && nbackup_addrs > 0))
+    {
+        usage(argv[0]);
+    }
+    shard_base = shard * MFS_SHARD_SPAN;
+
+    ports[0] = atoi(argv[optind]);     // Convert port number from string to integer
+    char *fs_image = argv[optind + 1]; // Get file system image file name from command line arguments
+
+    // Initialize or load the file system image
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    init_or_load_fs(fs_image, use_lfs);
+    if (fs_state.superblock.num_inodes > MFS_SHARD_SPAN)
+    {
+        fprintf(stderr, "Image has more than %d inodes\n", MFS_SHARD_SPAN);
+        exit(1);
+    }
+    init_inode_state();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stat_startup_us = (end.tv_sec - start.tv_sec) * 1000000UL + (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("Loaded %d inodes in %.3f ms%s\n", fs_state.superblock.num_inodes, stat_startup_us / 1000.0,
+           lazy_inodes && !lfs_mode ? " (inode table mapped lazily)" : "");
+    if (bcache_init(fd, (size_t)cache_mb << 20) < 0)
+    {
+        exit(1);
+    }
+    printf("Commit I/O: %s\n", diskio_init(fd, use_uring) ? "io_uring" : "pwritev/fsync");
+    if (drc_init(drc_entries) < 0)
+    {
+        perror("drc_init");
+        exit(1);
+    }
+
+    // Backups first, so that they see every mutation
+    for (int i = 0; i < nbackup_addrs; i++)
+    {
+        if (repl_add_backup(backup_addrs[i]) < 0)
+        {
+            exit(1);
+        }
+        printf("Replicating to %s\n", backup_addrs[i]);
+    }
+    replicating = nbackup_addrs > 0;
+    if (repl_port > 0)
+    {
+        if (repl_serve(repl_port, apply_record, fs_commit) < 0)
+        {
+            exit(1);
+        }
+        backup_mode = 1;
+        printf("Backup: taking the replication stream on TCP port %d\n", repl_port);
+    }
+
+    pthread_t committer;
+    if (gc_window_us > 0)
+    {
+        gc_queue = malloc(gc_max_ops * sizeof(pending_reply_t));
+        if (gc_queue == NULL || pthread_create(&committer, NULL, committer_main, NULL) != 0)
+        {
+            perror("group commit setup");
+            exit(EXIT_FAILURE);
+        }
+        printf("Group commit: window %d us, up to %d ops\n", gc_window_us, gc_max_ops);
+    }
+
+    printf("UDP Server listening on port");
+    for (int i = 0; i < nports; i++)
+        printf(" %d", ports[i]);
+    printf(" with %d worker(s)\n", num_workers);
+
+    stop_fd = eventfd(0, EFD_NONBLOCK);
+    if (stop_fd < 0)
+    {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every worker binds its own socket to each port; the kernel spreads
+    // incoming datagrams across them, so a slow request only stalls its worker.
+    pthread_t threads[MAX_WORKERS];
+    worker_t workers[MAX_WORKERS];
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i].id = i;
+        workers[i].ports = ports;
+        workers[i].nports = nports;
+        if (i > 0 && pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    worker_main(&workers[0]); // The main thread serves as worker 0
+
+    // SHUTDOWN: every reply already owed goes out before the server exits
+    for (int i = 1; i < num_workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    if (gc_window_us > 0)
+    {
+        pthread_mutex_lock(&gc_lock);
+        gc_stop = 1;
+        pthread_cond_broadcast(&gc_cond);
+        pthread_mutex_unlock(&gc_lock);
+        pthread_join(committer, NULL);
+    }
+    stop_reply.reply.status = fs_commit(); // Force all data to be written to disk
+    send_replies(&stop_reply, NULL, 1);
+    return 0;
+}
+
+void init_inode_state(void)
+{
+    inode_locks = calloc(fs_state.superblock.num_inodes, sizeof(pthread_rwlock_t));
+    dir_indexes = calloc(fs_state.superblock.num_inodes, sizeof(dir_index_t *));
+    inode_dirty = calloc(fs_state.superblock.num_inodes, sizeof(char));
+    dirty_list = calloc(fs_state.superblock.num_inodes, sizeof(int));
+    inode_versions = calloc(fs_state.superblock.num_inodes, sizeof(uint32_t));
+    callbacks = calloc(fs_state.superblock.num_inodes, sizeof(callback_t *));
+    extent_maps = calloc(fs_state.superblock.num_inodes, sizeof(extent_map_t *));
+    readaheads = calloc(fs_state.superblock.num_inodes, sizeof(readahead_t));
+    if (inode_locks == NULL || dir_indexes == NULL || inode_dirty == NULL || dirty_list == NULL ||
+        inode_versions == NULL || callbacks == NULL || extent_maps == NULL || readaheads == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < fs_state.superblock.num_inodes; i++)
+    {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    for (int i = 0; i < READAHEAD_STRIPES; i++)
+    {
+        pthread_mutex_init(&readahead_locks[i], NULL);
+    }
+}
+
+// Opens a UDP socket bound to port, shared with the other workers
+static int open_port(int port)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        perror("setsockopt SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Pipelined clients send dozens of WRITEs back to back; the default
+    // buffer holds only a couple of dozen 4 KB datagrams
+    int rcvbuf = SOCK_RCVBUF;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;         // IPv4
+    server_addr.sin_addr.s_addr = INADDR_ANY; // Any incoming interface
+    server_addr.sin_port = htons(port);       // Port number in network byte order
+    if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+void *worker_main(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+
+    // Each datagram's header and payload are scattered into separate
+    // buffers so that a WRITE payload lands block-aligned
+    mfs_hdr_t reqs[IO_BATCH];
+    struct sockaddr_in addrs[IO_BATCH];
+    struct iovec iov[IO_BATCH][2];
+    struct mmsghdr msgs[IO_BATCH];
+    char *data;
+    reply_batch_t *rb = calloc(1, sizeof(reply_batch_t));
+    if (rb == NULL || posix_memalign((void **)&data, UFS_BLOCK_SIZE, IO_BATCH * MFS_MAX_PAYLOAD) != 0 ||
+        posix_memalign((void **)&rb->bufs, UFS_BLOCK_SIZE, IO_BATCH * UFS_BLOCK_SIZE) != 0 ||
+        posix_memalign((void **)&rb->range_buf, UFS_BLOCK_SIZE, MFS_MAX_RANGE * UFS_BLOCK_SIZE) != 0)
+    {
+        perror("worker buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < w->nports; i++)
+    {
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = open_port(w->ports[i])};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0)
+        {
+            perror("epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct epoll_event stop_ev = {.events = EPOLLIN, .data.fd = stop_fd};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd, &stop_ev) < 0)
+    {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+    {
+        struct epoll_event events[MAX_PORTS + 1];
+        int nev = epoll_wait(epfd, events, MAX_PORTS + 1, -1);
+        if (nev < 0)
+        {
+            if (errno != EINTR)
+                perror("epoll_wait failed");
+            continue;
+        }
+
+        for (int e = 0; e < nev; e++)
+        {
+            int sockfd = events[e].data.fd;
+            if (sockfd == stop_fd)
+                continue; // Stays readable; the loop condition sees stopping
+
+            // Drain up to a batch of datagrams in one call
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < IO_BATCH; i++)
+            {
+                iov[i][0] = (struct iovec){&reqs[i], sizeof(reqs[i])};
+                iov[i][1] = (struct iovec){data + (size_t)i * MFS_MAX_PAYLOAD, MFS_MAX_PAYLOAD};
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+                msgs[i].msg_hdr.msg_iov = iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 2;
+            }
+            int n = recvmmsg(sockfd, msgs, IO_BATCH, MSG_DONTWAIT, NULL);
+            if (n < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("recvmmsg failed");
+                continue; // Another worker took them
+            }
+            __atomic_add_fetch(&stat_rx_calls, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stat_rx_msgs, n, __ATOMIC_RELAXED);
+
+            for (int i = 0; i < n; i++)
+            {
+                mfs_hdr_t *req = &reqs[i];
+                ssize_t len = msgs[i].msg_len;
+
+                // Drop anything that is not a well-formed request of our version
+                if (len < (ssize_t)sizeof(*req) || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+                    req->magic != MFS_PROTO_MAGIC || req->version != MFS_PROTO_VERSION ||
+                    req->len != (uint32_t)len - sizeof(*req))
+                {
+                    printf("[worker %d] Dropped malformed request (%zd bytes)\n", w->id, len);
+                    continue;
+                }
+                req->name[MFS_NAME_LEN - 1] = '\0';
+
+                process_request(req, data + (size_t)i * MFS_MAX_PAYLOAD, sockfd, addrs[i],
+                                msgs[i].msg_hdr.msg_namelen, rb);
+            }
+
+            // One commit for the batch's mutations, then every reply at once
+            if (rb->commit)
+            {
+                int rc = fs_commit();
+                for (int i = 0; i < rb->count; i++)
+                {
+                    if (rb->durable[i] && rc < 0)
+                        rb->replies[i].reply.status = -1;
+                    if (rb->durable[i])
+                        __atomic_add_fetch(&stat_commit_ops, 1, __ATOMIC_RELAXED);
+                }
+            }
+            if (rb->repl_seq != 0)
+            {
+                repl_wait(rb->repl_seq); // The backups commit meanwhile
+                rb->repl_seq = 0;
+            }
+            send_replies(rb->replies, rb->data, rb->count);
+            rb->count = 0;
+            rb->commit = 0;
+        }
+    }
+
+    close(epfd);
+    return NULL;
+}
+
+// Reads len bytes at off, exiting on failure or a short image
+static void pread_full(void *buf, size_t len, off_t off, const char *what)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t rc = pread(fd, (char *)buf + done, len - done, off + done);
+        if (rc <= 0)
+        {
+            perror(what);
+            exit(1);
+        }
+        done += rc;
+    }
+}
+
+// Loads the inode table of a fixed-layout image. By default it is read with
+// one large pread(); in lazy mode it is mapped privately, so each block is
+// only read when an inode in it is first touched. Changes still reach the
+// image through fixed_write_inodes(), never through the mapping.
+static void load_inode_table(void)
+{
+    super_t *s = &fs_state.superblock;
+    size_t table_bytes = (size_t)s->num_inodes * sizeof(inode_t);
+    off_t table_off = (off_t)s->inode_region_addr * UFS_BLOCK_SIZE;
+
+    if (lazy_inodes && table_off % sysconf(_SC_PAGESIZE) == 0)
+    {
+        void *map = mmap(NULL, table_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, table_off);
+        if (map != MAP_FAILED)
+        {
+            fs_state.inodes = map;
+            return;
+        }
+        perror("mmap inode table");
+    }
+
+    lazy_inodes = 0;
+    fs_state.inodes = malloc(table_bytes);
+    if (fs_state.inodes == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    pread_full(fs_state.inodes, table_bytes, table_off, "read inode table");
+}
+
+void init_or_load_fs(const char *fs_image, int use_lfs)
+{
+    fd = open(fs_image, O_RDWR | O_CREAT, 0666); // Open or create the file system image with read-write permissions
+    if (fd < 0)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END); // Seek to the end of the file to check its size
+    if (size == 0 && use_lfs)
+    {
+        printf("Initializing log-structured file system image...\n");
+        if (lfs_format(fd) < 0)
+        {
+            exit(1);
+        }
+    }
+    else if (size == 0)
+    {
+        // Initialization of the File System Image:
+        printf("Initializing file system image...\n");
+
+        super_t *s = &fs_state.superblock;
+        int num_inodes = 32; // Number of inodes
+        int num_data = 32;   // Number of data blocks
+
+        unsigned char *empty_buffer = calloc(UFS_BLOCK_SIZE, 1); // Allocate zeroed buffer for initialization
+        if (empty_buffer == NULL)
+        {
+            perror("calloc");
+            exit(1);
+        }
+
+        int bits_per_block = (8 * UFS_BLOCK_SIZE); // Bits per block (8 bits per byte)
+
+        // Set up superblock fields
+        s->magic = UFS_MAGIC;
+        s->num_inodes = num_inodes;
+        s->num_data = num_data;
+        s->inode_bitmap_addr = 1;                          // Inode bitmap starts at block 1
+        s->inode_bitmap_len = num_inodes / bits_per_block; // Length of inode bitmap in blocks
+        if (num_inodes % bits_per_block != 0)
+            s->inode_bitmap_len++;
+
+        s->data_bitmap_addr = s->inode_bitmap_addr + s->inode_bitmap_len;
+        s->data_bitmap_len = num_data / bits_per_block;
+        if (num_data % bits_per_block != 0)
+            s->data_bitmap_len++;
+
+        s->inode_region_addr = s->data_bitmap_addr + s->data_bitmap_len;
+        int total_inode_bytes = num_inodes * sizeof(inode_t);
+        s->inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
+        if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
+            s->inode_region_len++;
+
+        s->data_region_addr = s->inode_region_addr + s->inode_region_len;
+        s->data_region_len = num_data;
+
+        int total_blocks = 1 + s->inode_bitmap_len + s->data_bitmap_len + s->inode_region_len + s->data_region_len;
+
+        // Write superblock to disk
+        int rc = pwrite(fd, s, sizeof(super_t), 0);
+        if (rc != sizeof(super_t))
+        {
+            perror("write");
+            exit(1);
+        }
+
+        // Zero out all blocks
+        for (int i = 1; i < total_blocks; i++)
+        {
+            rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
+            if (rc != UFS_BLOCK_SIZE)
+            {
+                perror("write");
+                exit(1);
+            }
+        }
+
+        // Bitmap initialization
+        typedef struct
+        {
+            unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
+        } bitmap_t;
+        bitmap_t b;
+        for (int i = 0; i < 1024; i++)
+            b.bits[i] = 0;
+        b.bits[0] = 0x1 << 31; // First entry is allocated
+
+        rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s->inode_bitmap_addr * UFS_BLOCK_SIZE);
+        assert(rc == UFS_BLOCK_SIZE);
+
+        rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s->data_bitmap_addr * UFS_BLOCK_SIZE);
+        assert(rc == UFS_BLOCK_SIZE);
+
+        // Inode table initialization
+        typedef struct
+        {
+            inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
+        } inode_block;
+
+        inode_block itable;
+        memset(&itable, 0, sizeof(itable));
+        itable.inodes[0].type = UFS_DIRECTORY;
+        itable.inodes[0].size = 2 * sizeof(dir_ent_t);
+        itable.inodes[0].nextents = 1;
+        itable.inodes[0].extents[0] = (extent_t){0, s->data_region_addr, 1};
+
+        rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s->inode_region_addr * UFS_BLOCK_SIZE);
+        assert(rc == UFS_BLOCK_SIZE);
+
+        // Root directory initialization
+        typedef struct
+        {
+            dir_ent_t entries[128];
+        } dir_block_t;
+        dir_block_t parent;
+        strcpy(parent.entries[0].name, ".");
+        parent.entries[0].inum = 0;
+
+        strcpy(parent.entries[1].name, "..");
+        parent.entries[1].inum = 0;
+
+        for (int i = 2; i < 128; i++)
+            parent.entries[i].inum = -1;
+
+        rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s->data_region_addr * UFS_BLOCK_SIZE);
+        assert(rc == UFS_BLOCK_SIZE);
+
+        free(empty_buffer);
+        (void)fsync(fd);
+    }
+
+    if (lfs_is_image(fd))
+    {
+        printf("Loading log-structured file system image...\n");
+        lfs_mode = 1;
+        fs_state.superblock.num_inodes = LFS_MAX_INODES;
+        fs_state.inodes = calloc(LFS_MAX_INODES, sizeof(inode_t));
+        if (fs_state.inodes == NULL || lfs_load(fd, fs_state.inodes) < 0)
+        {
+            exit(1);
+        }
+
+        // The inode map is the record of which inodes are live
+        unsigned int words[LFS_MAX_INODES / 32] = {0};
+        for (int i = 0; i < LFS_MAX_INODES; i++)
+        {
+            if (fs_state.inodes[i].type != -1)
+                words[i / 32] |= 0x80000000u >> (i % 32);
+        }
+        inode_alloc = balloc_create(words, LFS_MAX_INODES);
+        if (inode_alloc == NULL)
+        {
+            perror("balloc_create");
+            exit(1);
+        }
+    }
+    else
+    {
+        // Load Existing File System Image:
+        printf("Loading file system image...\n");
+
+        super_t *s = &fs_state.superblock;
+        pread_full(s, sizeof(super_t), 0, "read superblock");
+        if (s->magic != UFS_MAGIC)
+        {
+            fprintf(stderr, "%s is not a file system image in this version's format; make a new one\n", fs_image);
+            exit(1);
+        }
+
+        // Both bitmaps sit between the superblock and the inode table; read
+        // them in one go
+        size_t bitmap_bytes = (size_t)(s->inode_region_addr - s->inode_bitmap_addr) * UFS_BLOCK_SIZE;
+        unsigned int *bitmaps = malloc(bitmap_bytes);
+        if (bitmaps == NULL)
+        {
+            perror("malloc");
+            exit(1);
+        }
+        pread_full(bitmaps, bitmap_bytes, (off_t)s->inode_bitmap_addr * UFS_BLOCK_SIZE, "read bitmaps");
+        inode_alloc = balloc_create(bitmaps, s->num_inodes);
+        data_alloc = balloc_create(bitmaps + (size_t)(s->data_bitmap_addr - s->inode_bitmap_addr) * UFS_BLOCK_SIZE /
+                                                 sizeof(unsigned int),
+                                   s->num_data);
+        free(bitmaps);
+        if (inode_alloc == NULL || data_alloc == NULL)
+        {
+            perror("balloc_create");
+            exit(1);
+        }
+
+        // The inode bitmap, not the type field, says which inodes are live
+        // (see inode_in_use()), so the table needs no pass over it here
+        load_inode_table();
+    }
+}
+
+// Returns whether inum is an allocated inode. Callers hold the inode's lock,
+// which orders this against CREAT and UNLINK changing it.
+static int inode_in_use(int inum)
+{
+    return balloc_test(inode_alloc, inum);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Records a callback promise on inum to the client that sent req. Returns
+// the promise's lifetime in milliseconds, or 0 if none was made.
+static int callback_add(int inum, mfs_hdr_t *req, int sockfd, struct sockaddr_in *addr, socklen_t addr_size)
+{
+    if (callback_ms == 0 || inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+        return 0;
+
+    pthread_mutex_lock(&callback_lock);
+    callback_t *cb = callbacks[inum];
+    while (cb != NULL && cb->client_id != req->client_id)
+        cb = cb->next;
+    if (cb == NULL && (cb = malloc(sizeof(callback_t))) != NULL)
+    {
+        cb->client_id = req->client_id;
+        cb->next = callbacks[inum];
+        callbacks[inum] = cb;
+    }
+    if (cb != NULL)
+    {
+        cb->sockfd = sockfd;
+        cb->addr = *addr;
+        cb->addr_size = addr_size;
+        cb->expires = now_sec() + callback_ms / 1000.0;
+    }
+    pthread_mutex_unlock(&callback_lock);
+    if (cb == NULL)
+        return 0;
+    __atomic_add_fetch(&stat_callbacks_granted, 1, __ATOMIC_RELAXED);
+    return callback_ms;
+}
+
+// Breaks every promise on inum, sending a CALLBACK to each client whose
+// promise has not lapsed yet
+static void callback_break(int inum)
+{
+    pthread_mutex_lock(&callback_lock);
+    callback_t *cb = callbacks[inum];
+    callbacks[inum] = NULL;
+    pthread_mutex_unlock(&callback_lock);
+
+    double t = now_sec();
+    while (cb != NULL)
+    {
+        callback_t *next = cb->next;
+        if (cb->expires > t)
+        {
+            mfs_hdr_t msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.magic = MFS_PROTO_MAGIC;
+            msg.version = MFS_PROTO_VERSION;
+            msg.opcode = MFS_OP_CALLBACK;
+            msg.client_id = cb->client_id;
+            msg.inum = inum + shard_base;
+            sendto(cb->sockfd, &msg, sizeof(msg), 0, (struct sockaddr *)&cb->addr, cb->addr_size);
+            __atomic_add_fetch(&stat_callbacks_broken, 1, __ATOMIC_RELAXED);
+        }
+        free(cb);
+        cb = next;
+    }
+}
+
+// Records a mutation of the inode for client caches: bumps its version and
+// breaks the callback promises on it. The caller holds the inode's lock
+// exclusively.
+static void inode_bump(int inum)
+{
+    uint32_t version = __atomic_add_fetch(&inode_versions[inum], 1, __ATOMIC_RELAXED);
+    if (replicating && nbumped < REPL_MAX_VERSIONS)
+        bumped[nbumped++] = (repl_version_t){inum, version};
+    if (__atomic_load_n(&callbacks[inum], __ATOMIC_RELAXED) != NULL)
+        callback_break(inum);
+}
+
+// Adds inum to the dirty set. The caller holds dirty_lock.
+static void mark_dirty_locked(int inum)
+{
+    if (!inode_dirty[inum])
+    {
+        inode_dirty[inum] = 1;
+        dirty_list[dirty_count++] = inum;
+    }
+}
+
+void inode_mark_dirty(int inum)
+{
+    pthread_mutex_lock(&dirty_lock);
+    mark_dirty_locked(inum);
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// Queues data block blk for freed_list. The caller holds dirty_lock. If the
+// list cannot grow, the block stays allocated for good.
+static void freed_add(unsigned int blk)
+{
+    if (freed_count == freed_cap)
+    {
+        int cap = freed_cap > 0 ? 2 * freed_cap : 256;
+        unsigned int *list = realloc(freed_list, cap * sizeof(unsigned int));
+        if (list == NULL)
+        {
+            perror("freed_add");
+            return;
+        }
+        freed_list = list;
+        freed_cap = cap;
+    }
+    freed_list[freed_count++] = blk;
+}
+
+// Takes the dirty inode set and, if freed is not NULL, the queued freed
+// blocks; inodes dirtied and blocks freed from here on go to the next commit.
+// Returns the number of inodes, stored in a malloc'd *inums, or -1. The
+// blocks are stored in a malloc'd *freed (NULL if there are none), and their
+// number in *nfreed.
+static int dirty_take(int **inums, unsigned int **freed, int *nfreed)
+{
+    pthread_mutex_lock(&dirty_lock);
+    int n = dirty_count;
+    *inums = malloc((n > 0 ? n : 1) * sizeof(int));
+    if (*inums == NULL)
+    {
+        pthread_mutex_unlock(&dirty_lock);
+        return -1;
+    }
+    memcpy(*inums, dirty_list, n * sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        inode_dirty[(*inums)[i]] = 0;
+    }
+    dirty_count = 0;
+    if (freed != NULL)
+    {
+        *freed = freed_list;
+        *nfreed = freed_count;
+        freed_list = NULL;
+        freed_count = freed_cap = 0;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+    return n;
+}
+
+// Puts inodes and freed blocks taken by dirty_take() back after a failed
+// commit, so the next commit writes them, and frees inums and freed
+static void dirty_restore(int *inums, int n, unsigned int *freed, int nfreed)
+{
+    pthread_mutex_lock(&dirty_lock);
+    for (int i = 0; i < n; i++)
+    {
+        mark_dirty_locked(inums[i]);
+    }
+    for (int i = 0; i < nfreed; i++)
+    {
+        freed_add(freed[i]);
+    }
+    pthread_mutex_unlock(&dirty_lock);
+    free(inums);
+    free(freed);
+}
+
+// Allocates a data block of a fixed-layout image. The search starts right
+// after image block after (or where the last search ended, if after is -1),
+// so files written sequentially get contiguous runs. Returns the block
+// address, or -1 if the image is full.
+static int fixed_alloc_block(unsigned int after)
+{
+    int data_start = fs_state.superblock.data_region_addr;
+
+    pthread_mutex_lock(&alloc_lock);
+    int goal = data_alloc_hint;
+    if ((int)after != -1)
+        goal = after - data_start + 1;
+
+    int bit = balloc_alloc(data_alloc, goal);
+    if (bit != -1)
+        data_alloc_hint = bit + 1;
+    pthread_mutex_unlock(&alloc_lock);
+
+    return bit == -1 ? -1 : data_start + bit;
+}
+
+// Gives back data block blk, which inode inum let go of, once the next commit
+// has written the inode (see freed_list)
+static void fixed_free_block(int inum, unsigned int blk)
+{
+    pthread_mutex_lock(&dirty_lock);
+    mark_dirty_locked(inum);
+    freed_add(blk);
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// Returns the extent map of inode inum, building it on first use, or NULL if
+// it cannot be built. The caller must hold the inode's lock.
+static extent_map_t *extent_map_get(int inum)
+{
+    extent_map_t *m = __atomic_load_n(&extent_maps[inum], __ATOMIC_ACQUIRE);
+    if (m != NULL)
+    {
+        return m;
+    }
+
+    pthread_mutex_lock(&extent_map_lock);
+    m = extent_maps[inum];
+    inode_t *inode = &fs_state.inodes[inum];
+    if (m == NULL && inode->nextents <= INODE_EXTENTS)
+    {
+        m = extmap_create(inode->extents, inode->nextents);
+    }
+    else if (m == NULL && inode->nextents <= MAX_EXTENTS)
+    {
+        extent_t *e = malloc(inode->nextents * sizeof(extent_t));
+        for (unsigned int i = 0; e != NULL && i < inode->nextents; i += EXTENTS_PER_BLOCK)
+        {
+            extent_t block[EXTENTS_PER_BLOCK];
+            bcache_read(inode->extent_blocks[i / EXTENTS_PER_BLOCK], block);
+            unsigned int n = inode->nextents - i < EXTENTS_PER_BLOCK ? inode->nextents - i : EXTENTS_PER_BLOCK;
+            memcpy(&e[i], block, n * sizeof(extent_t));
+        }
+        m = e == NULL ? NULL : extmap_create(e, inode->nextents);
+        free(e);
+    }
+    __atomic_store_n(&extent_maps[inum], m, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&extent_map_lock);
+    return m;
+}
+
+// Drops the extent map of an inode that is being freed
+static void extent_map_drop(int inum)
+{
+    extmap_free(extent_maps[inum]);
+    extent_maps[inum] = NULL;
+}
+
+// Returns the image block holding the inode's block'th block, or -1 for a
+// hole. The caller must hold the inode's lock.
+static unsigned int inode_block(int inum, int block)
+{
+    extent_map_t *m = extent_map_get(inum);
+    return m == NULL ? (unsigned int)-1 : extmap_lookup(m, block, NULL);
+}
+
+// Writes extent block b of the list in m to image block blk
+static void write_extent_block(extent_map_t *m, int b, unsigned int blk)
+{
+    extent_t block[EXTENTS_PER_BLOCK];
+    int count = extmap_count(m) - b * (int)EXTENTS_PER_BLOCK;
+    if (count > (int)EXTENTS_PER_BLOCK)
+        count = EXTENTS_PER_BLOCK;
+    memset(block, 0, sizeof(block));
+    memcpy(block, &extmap_extents(m)[b * EXTENTS_PER_BLOCK], count * sizeof(extent_t));
+    bcache_write(blk, block);
+}
+
+// Writes the extent list of m back to the inode, of which extents from index
+// from on have changed: inline if it fits, otherwise into extent blocks. Only
+// the extent blocks holding changed extents are rewritten. In a log-
+// structured image those are only marked (-1) here and appended to the log
+// by the next commit, together with the inode, so that data written in
+// between stays contiguous. Returns 0, or -1 if the list is too long or no
+// block is free, in which case the inode is unchanged. The caller holds the
+// inode's lock exclusively.
+static int store_extents(int inum, inode_t *inode, extent_map_t *m, int from)
+{
+    int n = extmap_count(m);
+    if (from >= n && (unsigned int)n == inode->nextents)
+    {
+        return 0; // Nothing changed
+    }
+    int had = inode->nextents > INODE_EXTENTS ? (inode->nextents + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK : 0;
+    int need = n > INODE_EXTENTS ? (n + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK : 0;
+    if (need > INODE_EXTENT_BLOCKS)
+    {
+        return -1; // Too fragmented
+    }
+
+    // Find a block for every extent block that changes and has none yet
+    unsigned int blks[INODE_EXTENT_BLOCKS];
+    int first = had > 0 ? from / (int)EXTENTS_PER_BLOCK : 0;
+    for (int b = 0; b < need; b++)
+    {
+        blks[b] = b < had ? inode->extent_blocks[b] : (unsigned int)-1;
+        if (lfs_mode || b < first)
+        {
+            blks[b] = lfs_mode && b >= first ? (unsigned int)-1 : blks[b];
+            continue;
+        }
+        if (b >= had)
+        {
+            blks[b] = fixed_alloc_block(-1);
+        }
+        if ((int)blks[b] == -1)
+        {
+            for (int i = had; i < b; i++)
+                fixed_free_block(inum, blks[i]);
+            return -1; // No free block
+        }
+        write_extent_block(m, b, blks[b]);
+    }
+    for (int b = need; b < had && !lfs_mode; b++)
+    {
+        fixed_free_block(inum, inode->extent_blocks[b]);
+    }
+
+    if (need == 0)
+    {
+        memset(inode->extents, 0, sizeof(inode->extents));
+        memcpy(inode->extents, extmap_extents(m), n * sizeof(extent_t));
+    }
+    else
+    {
+        memcpy(inode->extent_blocks, blks, need * sizeof(unsigned int));
+    }
+    inode->nextents = n;
+    inode_mark_dirty(inum);
+    return 0;
+}
+
+// Appends the extent blocks of inode inum that store_extents() marked as
+// changed to the log. Returns -1 if the log is full. The caller holds the
+// inode's lock exclusively.
+static int lfs_store_extent_blocks(int inum, inode_t *inode)
+{
+    if (!inode_in_use(inum) || inode->nextents <= INODE_EXTENTS || extent_maps[inum] == NULL)
+    {
+        return 0;
+    }
+    int need = (inode->nextents + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+    for (int b = 0; b < need; b++)
+    {
+        if ((int)inode->extent_blocks[b] == -1)
+        {
+            inode->extent_blocks[b] = lfs_alloc_block(1);
+            if ((int)inode->extent_blocks[b] == -1)
+                return -1;
+            write_extent_block(extent_maps[inum], b, inode->extent_blocks[b]);
+        }
+    }
+    return 0;
+}
+
+// Gives back the blocks of a fixed-layout inode, data and extent blocks, once
+// the next commit has written the inode (see freed_list). The caller holds
+// the inode's lock exclusively.
+static void fixed_free_blocks(int inum, inode_t *inode)
+{
+    extent_map_t *m = extent_map_get(inum);
+
+    pthread_mutex_lock(&dirty_lock);
+    mark_dirty_locked(inum);
+    for (int i = 0; m != NULL && i < extmap_count(m); i++)
+    {
+        const extent_t *e = &extmap_extents(m)[i];
+        for (unsigned int j = 0; j < e->len; j++)
+            freed_add(e->pblk + j);
+    }
+    for (unsigned int i = 0; inode->nextents > INODE_EXTENTS && i < inode->nextents; i += EXTENTS_PER_BLOCK)
+    {
+        freed_add(inode->extent_blocks[i / EXTENTS_PER_BLOCK]);
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// Returns the block that new contents of the inode's block'th block should be
+// written to, updating the inode's extents if it moves, or -1 if no block is
+// free or the file has too many extents. In a fixed-layout image a block is
+// written in place once allocated, and a new one goes right after the file's
+// previous block if that is free; in a log-structured image every write goes
+// to a fresh block at the end of the log. The caller holds the inode's lock
+// exclusively.
+static unsigned int fs_block_for_write(int inum, inode_t *inode, int block)
+{
+    extent_map_t *m = extent_map_get(inum);
+    if (m == NULL)
+    {
+        return -1;
+    }
+    unsigned int old = extmap_lookup(m, block, NULL);
+    if (!lfs_mode && (int)old != -1)
+    {
+        return old;
+    }
+
+    unsigned int blk;
+    if (lfs_mode)
+    {
+        blk = lfs_alloc_block(0);
+        if ((int)blk == -1)
+            return -1;
+    }
+    else
+    {
+        blk = fixed_alloc_block(block > 0 ? extmap_lookup(m, block - 1, NULL) : (unsigned int)-1);
+        if ((int)blk == -1)
+            return -1;
+    }
+
+    int from = extmap_set(m, block, blk);
+    if (from < 0 || store_extents(inum, inode, m, from) < 0)
+    {
+        if (from >= 0)
+            extmap_set(m, block, old); // Back to the list the inode still holds
+        if (!lfs_mode)
+            fixed_free_block(inum, blk);
+        return -1;
+    }
+    return blk;
+}
+
+// Undoes fs_block_for_write() for file blocks block..block+n-1, which were
+// mapped to old[i] before and to blks[i] since: gives back the blocks taken
+// and puts the inode's previous extents back. In a log-structured image the
+// blocks taken stay behind in the log, unreferenced. The caller holds the
+// inode's lock exclusively.
+static void fs_unmap_blocks(int inum, inode_t *inode, int block, const unsigned int *old, const unsigned int *blks,
+                            int n)
+{
+    extent_map_t *m = extent_maps[inum];
+    if (n == 0)
+    {
+        return;
+    }
+    for (int i = n - 1; i >= 0; i--)
+    {
+        if (blks[i] == old[i])
+            continue; // Written in place; nothing was taken
+        extmap_set(m, block + i, old[i]);
+        if (!lfs_mode)
+            fixed_free_block(inum, blks[i]);
+    }
+    // The list is canonical, so it is the one the inode held before; this
+    // only rewrites it, with the data blocks above already given back
+    store_extents(inum, inode, m, 0);
+}
+
+// Commit for log-structured images: the changed data and directory blocks
+// were written to fresh log blocks, so append the changed extent blocks,
+// flush them all, then append the inodes that point to them and let
+// lfs_commit() write the checkpoint. The caller holds commit_lock.
+static int lfs_fs_commit(void)
+{
+    int *inums;
+    int n = dirty_take(&inums, NULL, NULL);
+    if (n < 0)
+        return -1;
+    inode_t *copies = malloc((n > 0 ? n : 1) * sizeof(inode_t));
+    if (copies == NULL)
+    {
+        dirty_restore(inums, n, NULL, 0);
+        return -1;
+    }
+
+    int rc = 0;
+    for (int i = 0; i < n; i++)
+    {
+        pthread_rwlock_wrlock(&inode_locks[inums[i]]);
+        if (lfs_store_extent_blocks(inums[i], &fs_state.inodes[inums[i]]) < 0)
+            rc = -1;
+        copies[i] = fs_state.inodes[inums[i]];
+        pthread_rwlock_unlock(&inode_locks[inums[i]]);
+    }
+
+    // An inode pointing past the end of the log must not be checkpointed
+    if (rc < 0)
+        fprintf(stderr, "lfs: the log is full; commit refused\n");
+    else if (bcache_flush() < 0 || lfs_commit(inums, copies, n) < 0)
+        rc = -1;
+    if (rc < 0)
+        dirty_restore(inums, n, NULL, 0);
+    else
+        free(inums);
+    free(copies);
+    return rc;
+}
+
+// Commit for fixed-layout images: the dirty blocks of the inode table are
+// copied first, then the bitmaps and the changed data and directory blocks
+// are flushed from the block cache, and finally the copies are written
+// followed by an fsync, as one diskio batch. Workers keep running meanwhile,
+// so the copies are taken before the flush: every block they point to was
+// allocated and written before it, and is on disk once the flush is. A block
+// is dirty when any inode in it is; each is copied under the locks of its
+// inodes, and every run of adjacent dirty blocks is a single vectored write.
+// The caller holds commit_lock.
+static int fixed_fs_commit(void)
+{
+    int *inums;
+    unsigned int *freed;
+    int nfreed;
+    int n = dirty_take(&inums, &freed, &nfreed);
+    if (n < 0)
+        return -1;
+
+    const int per_block = UFS_BLOCK_SIZE / sizeof(inode_t);
+    int num_inodes = fs_state.superblock.num_inodes;
+    int nblocks = (num_inodes + per_block - 1) / per_block;
+    char *block_dirty = calloc(nblocks, sizeof(char));
+    if (block_dirty == NULL)
+    {
+        dirty_restore(inums, n, freed, nfreed);
+        return -1;
+    }
+    int ndirty = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int b = inums[i] / per_block;
+        ndirty += !block_dirty[b];
+        block_dirty[b] = 1;
+    }
+
+    // Snapshot the dirty blocks, in block order
+    inode_t *copies = calloc((size_t)(ndirty > 0 ? ndirty : 1) * per_block, sizeof(inode_t));
+    struct iovec *iov = malloc((ndirty > 0 ? ndirty : 1) * sizeof(struct iovec));
+    if (copies == NULL || iov == NULL)
+    {
+        dirty_restore(inums, n, freed, nfreed);
+        free(block_dirty);
+        free(copies);
+        free(iov);
+        return -1;
+    }
+    for (int b = 0, k = 0; b < nblocks; b++)
+    {
+        if (!block_dirty[b])
+            continue;
+        inode_t *dst = copies + (size_t)k * per_block;
+        for (int i = b * per_block; i < num_inodes && i < (b + 1) * per_block; i++)
+        {
+            pthread_rwlock_rdlock(&inode_locks[i]);
+            dst[i - b * per_block] = fs_state.inodes[i];
+            pthread_rwlock_unlock(&inode_locks[i]);
+        }
+        iov[k].iov_base = dst;
+        iov[k].iov_len = UFS_BLOCK_SIZE;
+        k++;
+    }
+
+    // Inodes must not reach the disk pointing at blocks that did not; they
+    // stay dirty for the next commit
+    pthread_mutex_lock(&alloc_lock);
+    balloc_sync(inode_alloc, fs_state.superblock.inode_bitmap_addr);
+    balloc_sync(data_alloc, fs_state.superblock.data_bitmap_addr);
+    pthread_mutex_unlock(&alloc_lock);
+    if (bcache_flush() < 0)
+    {
+        dirty_restore(inums, n, freed, nfreed);
+        free(block_dirty);
+        free(copies);
+        free(iov);
+        return -1;
+    }
+
+    int rc = 0;
+    diskio_batch_t batch;
+    diskio_batch_init(&batch);
+    for (int b = 0, k = 0; b < nblocks;)
+    {
+        if (!block_dirty[b])
+        {
+            b++;
+            continue;
+        }
+        int run = 1;
+        while (b + run < nblocks && block_dirty[b + run] && run < UIO_MAXIOV)
+            run++;
+
+        off_t off = ((off_t)fs_state.superblock.inode_region_addr + b) * UFS_BLOCK_SIZE;
+        if (diskio_add_write(&batch, iov + k, run, off) < 0)
+            rc = -1;
+        __atomic_add_fetch(&stat_inode_writes, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stat_inode_blocks, run, __ATOMIC_RELAXED);
+        b += run;
+        k += run;
+    }
+    if (diskio_add_fsync(&batch) < 0 || diskio_submit(&batch) < 0)
+        rc = -1;
+    diskio_batch_free(&batch);
+    if (rc < 0)
+    {
+        dirty_restore(inums, n, freed, nfreed);
+    }
+    else
+    {
+        // No inode on disk points to the freed blocks any more
+        pthread_mutex_lock(&alloc_lock);
+        for (int i = 0; i < nfreed; i++)
+        {
+            balloc_free(data_alloc, freed[i] - fs_state.superblock.data_region_addr);
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        free(inums);
+        free(freed);
+    }
+
+    free(block_dirty);
+    free(copies);
+    free(iov);
+    return rc;
+}
+
+int fs_commit(void)
+{
+    int rc;
+    pthread_mutex_lock(&commit_lock);
+    if (lfs_mode)
+    {
+        rc = lfs_fs_commit();
+    }
+    else
+    {
+        rc = fixed_fs_commit();
+    }
+    pthread_mutex_unlock(&commit_lock);
+    __atomic_add_fetch(&stat_commits, 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+// Queues a reply in rb; data holds reply->len payload bytes. With durable
+// set, the reply is only sent after the commit that ends the batch.
+static void queue_reply(reply_batch_t *rb, int sockfd, mfs_hdr_t *reply, char *data, struct sockaddr_in *addr,
+                        socklen_t addr_size, int durable)
+{
+    pending_reply_t *p = &rb->replies[rb->count];
+    p->sockfd = sockfd;
+    p->addr = *addr;
+    p->addr_size = addr_size;
+    p->reply = *reply;
+    rb->data[rb->count] = data;
+    rb->durable[rb->count] = durable;
+    rb->commit |= durable;
+    rb->count++;
+}
+
+// Returns the payload buffer of the next reply queued in rb
+static char *reply_buffer(reply_batch_t *rb)
+{
+    return rb->bufs + (size_t)rb->count * UFS_BLOCK_SIZE;
+}
+
+void commit_and_reply(reply_batch_t *rb, int sockfd, mfs_hdr_t *reply, struct sockaddr_in client_addr,
+                      socklen_t addr_size)
+{
+    if (gc_window_us == 0)
+    {
+        queue_reply(rb, sockfd, reply, NULL, &client_addr, addr_size, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&gc_lock);
+    while (gc_count == gc_max_ops)
+    {
+        pthread_cond_wait(&gc_cond, &gc_lock); // Batch is full and not yet taken
+    }
+    pending_reply_t *p = &gc_queue[gc_count++];
+    p->sockfd = sockfd;
+    p->addr = client_addr;
+    p->addr_size = addr_size;
+    p->reply = *reply;
+    if (gc_count == 1 || gc_count == gc_max_ops)
+    {
+        pthread_cond_broadcast(&gc_cond); // Start the window, or cut it short
+    }
+    pthread_mutex_unlock(&gc_lock);
+}
+
+void *committer_main(void *arg)
+{
+    (void)arg;
+    pending_reply_t *batch = malloc(gc_max_ops * sizeof(pending_reply_t));
+    if (batch == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&gc_lock);
+    while (1)
+    {
+        while (gc_count == 0 && !gc_stop)
+        {
+            pthread_cond_wait(&gc_cond, &gc_lock);
+        }
+        if (gc_count == 0)
+            break; // Stopping, and every batch has been answered
+
+        // Let more mutations join until the window closes or the batch fills
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)gc_window_us * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (gc_count < gc_max_ops && pthread_cond_timedwait(&gc_cond, &gc_lock, &deadline) == 0)
+        {
+        }
+
+        // Take the batch; mutations arriving from now on go to the next one
+        pending_reply_t *tmp = batch;
+        batch = gc_queue;
+        gc_queue = tmp;
+        int n = gc_count;
+        gc_count = 0;
+        pthread_cond_broadcast(&gc_cond); // Wake workers waiting for room
+        pthread_mutex_unlock(&gc_lock);
+
+        // Every mutation in the batch was applied before it was queued, so
+        // one commit covers them all
+        int rc = fs_commit();
+        __atomic_add_fetch(&stat_commit_ops, n, __ATOMIC_RELAXED);
+        for (int i = 0; i < n; i++)
+        {
+            if (rc < 0)
+                batch[i].reply.status = -1;
+        }
+        send_replies(batch, NULL, n);
+
+        pthread_mutex_lock(&gc_lock);
+    }
+    pthread_mutex_unlock(&gc_lock);
+    free(batch);
+    return NULL;
+}
+
+// Directory block layout: 128 entries of 32 bytes fill one 4 KB block
+typedef struct
+{
+    dir_ent_t entries[128];
+} dir_block_t;
+
+// Returns the name index of directory dinum, building it on first use, or
+// NULL if it cannot be built. The caller must hold the directory's lock.
+static dir_index_t *dir_index_get(int dinum)
+{
+    dir_index_t *idx = __atomic_load_n(&dir_indexes[dinum], __ATOMIC_ACQUIRE);
+    if (idx != NULL)
+    {
+        return idx;
+    }
+
+    pthread_mutex_lock(&dir_index_lock);
+    idx = dir_indexes[dinum];
+    if (idx == NULL)
+    {
+        // A directory's blocks have no holes
+        extent_map_t *m = extent_map_get(dinum);
+        int nblocks = m == NULL ? 0 : extmap_end(m);
+        unsigned int *blocks = malloc((nblocks > 0 ? nblocks : 1) * sizeof(unsigned int));
+        for (int i = 0; blocks != NULL && i < nblocks; i++)
+            blocks[i] = extmap_lookup(m, i, NULL);
+        idx = m == NULL || blocks == NULL ? NULL : dirindex_build(blocks, nblocks);
+        free(blocks);
+        __atomic_store_n(&dir_indexes[dinum], idx, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&dir_index_lock);
+    return idx;
+}
+
+// Searches the directory for name. The caller must hold the directory's lock.
+// Returns the inode number, or -1 if the name is not present. When found and
+// pos_out is non-NULL, the entry's index position is reported as well.
+static int dir_find(int dinum, char *name, int *pos_out)
+{
+    dir_index_t *idx = dir_index_get(dinum);
+    int pos = idx != NULL ? dirindex_find(idx, name) : -1;
+    if (pos == -1)
+    {
+        return -1;
+    }
+    if (pos_out != NULL)
+        *pos_out = pos;
+    return dirindex_inum(idx, pos);
+}
+
+// Helper function to handle LOOKUP request
+int handle_lookup(int pinum, char *name, uint32_t *version)
+{
+    if (pinum < 0 || pinum >= (int)fs_state.superblock.num_inodes)
+    {
+        printf("Invalid pinum: %d\n", pinum);
+        return -1; // Invalid pinum
+    }
+
+    pthread_rwlock_rdlock(&inode_locks[pinum]);
+    inode_t *dir_inode = &fs_state.inodes[pinum];
+    if (!inode_in_use(pinum) || dir_inode->type != UFS_DIRECTORY)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        printf("Not a directory: %d\n", pinum);
+        return -1; // Not a directory
+    }
+
+    int inum = dir_find(pinum, name, NULL);
+    *version = __atomic_load_n(&inode_versions[pinum], __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&inode_locks[pinum]);
+
+    if (inum == -1)
+    {
+        printf("Name not found: %s\n", name);
+    }
+    return inum;
+}
+
+// Helper function to handle LOOKUP_PATH request: resolves each component of
+// path (modified in place) with handle_lookup(), recording the inode and the
+// directory's version in steps. Sets *resolved to the number of components
+// resolved. Returns the global inode of the last one (of inum itself for an
+// empty path), or -1, also when a component leads to another shard.
+int handle_lookup_path(int inum, char *path, mfs_pathstep_t *steps, int *resolved)
+{
+    *resolved = 0;
+    int found = inum + shard_base;
+    char *p = path;
+    while (*p != '\0')
+    {
+        if (*p == '/')
+        {
+            p++;
+            continue; // Empty component
+        }
+        char *name = p;
+        while (*p != '\0' && *p != '/')
+            p++;
+        if (*p == '/')
+            *p++ = '\0';
+        if (strlen(name) >= MFS_NAME_LEN)
+        {
+            printf("Name too long: %s\n", name);
+            return -1;
+        }
+        if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+        {
+            return -1; // The directory is on another shard, which goes on
+        }
+        found = handle_lookup(inum, name, &steps[*resolved].version);
+        if (found == -1)
+        {
+            return -1;
+        }
+        steps[*resolved].inum = found;
+        (*resolved)++;
+        inum = found - shard_base;
+    }
+    return found;
+}
+
+// Helper function to handle STAT request
+int handle_stat(int inum, inode_t *inode, uint32_t *version)
+{
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+    {
+        return -1; // Invalid inum
+    }
+
+    pthread_rwlock_rdlock(&inode_locks[inum]);
+    int rc = inode_in_use(inum) ? 0 : -1;
+    *inode = fs_state.inodes[inum];
+    *version = __atomic_load_n(&inode_versions[inum], __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    return rc;
+}
+
+// Helper function to handle WRITE request
+int handle_write(int inum, char *buffer, int block)
+{
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+    {
+        return -1; // Invalid inum
+    }
+
+    if (block < 0 || block >= MAX_FILE_BLOCKS)
+    {
+        return -1; // Invalid block number
+    }
+
+    pthread_rwlock_wrlock(&inode_locks[inum]);
+    inode_t *inode = &fs_state.inodes[inum];
+    if (!inode_in_use(inum) || inode->type != UFS_REGULAR_FILE)
+    {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+        return -1; // Not a regular file
+    }
+
+    // Allocate a new block if necessary
+    unsigned int blk = fs_block_for_write(inum, inode, block);
+    if ((int)blk == -1)
+    {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+        return -1; // No free data block
+    }
+    if (inode->size < (block + 1) * UFS_BLOCK_SIZE)
+    {
+        inode->size = (block + 1) * UFS_BLOCK_SIZE;
+        inode_mark_dirty(inum);
+    }
+
+    // Write the data to the allocated block
+    bcache_write(blk, buffer);
+    inode_bump(inum);
+    pthread_rwlock_unlock(&inode_locks[inum]);
+
+    return 0; // Made durable by the caller before replying
+}
+
+// Records a read of count blocks from file block block on, and prefetches
+// the blocks after it if the read continues a sequential stream. Prefetching
+// is refilled once less than half a window is left ahead of the reader, so
+// the blocks are already cached when the next reads arrive. The stream only
+// counts as ahead up to the first block the prefetch queue had no room for.
+// The caller holds the inode's lock and has looked up its extent map.
+static void readahead_note(int inum, unsigned int block, int count)
+{
+    if (readahead_max == 0)
+    {
+        return;
+    }
+    readahead_t *ra = &readaheads[inum];
+    unsigned int end = block + count;
+    unsigned int from = 0, to = 0;
+
+    pthread_mutex_lock(&readahead_locks[inum % READAHEAD_STRIPES]);
+    if (block == ra->next)
+    {
+        if (ra->window == 0)
+        {
+            ra->window = 2 * count > READAHEAD_MIN ? 2 * count : READAHEAD_MIN;
+            ra->ahead = end;
+        }
+        else if (ra->ahead < end + ra->window / 2)
+        {
+            ra->window *= 2;
+        }
+        if (ra->window > (unsigned int)readahead_max)
+            ra->window = readahead_max;
+        if (ra->ahead < end + ra->window / 2)
+        {
+            from = ra->ahead > end ? ra->ahead : end;
+            to = end + ra->window;
+        }
+    }
+    else
+    {
+        ra->window = 0; // Random access: stop prefetching
+    }
+    ra->next = end;
+    pthread_mutex_unlock(&readahead_locks[inum % READAHEAD_STRIPES]);
+
+    // Queue each extent piece of [from, to) that holds data
+    extent_map_t *m = extent_maps[inum];
+    unsigned int reached = to, last = to < extmap_end(m) ? to : extmap_end(m);
+    for (unsigned int b = from; b < last;)
+    {
+        unsigned int run;
+        unsigned int blk = extmap_lookup(m, b, &run);
+        if ((int)blk == -1)
+        {
+            b++; // Hole
+            continue;
+        }
+        if (run > last - b)
+            run = last - b;
+        unsigned int queued = bcache_prefetch(blk, run);
+        if (queued < run)
+        {
+            reached = b + queued; // The rest is asked for again by a later read
+            break;
+        }
+        b += run;
+    }
+
+    if (to > from)
+    {
+        pthread_mutex_lock(&readahead_locks[inum % READAHEAD_STRIPES]);
+        if (ra->ahead < reached)
+            ra->ahead = reached;
+        pthread_mutex_unlock(&readahead_locks[inum % READAHEAD_STRIPES]);
+    }
+}
+
+// Helper function to handle READ request
+int handle_read(int inum, char *buffer, int block)
+{
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+    {
+        return -1; // Invalid inum
+    }
+
+    pthread_rwlock_rdlock(&inode_locks[inum]);
+    unsigned int blk = inode_in_use(inum) && block >= 0 ? inode_block(inum, block) : (unsigned int)-1;
+    if ((int)blk == -1)
+    {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+        return -1; // Invalid block number or unallocated block
+    }
+
+    // Read the data from the specified block
+    readahead_note(inum, block, 1);
+    int rc = bcache_read(blk, buffer);
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    return rc;
+}
+
+// Helper function to handle READ_RANGE request: reads count consecutive
+// blocks of the file, starting at block, into buffer
+int handle_read_range(int inum, char *buffer, int block, int count)
+{
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+    {
+        return -1; // Invalid inum
+    }
+    if (block < 0 || count < 1 || count > MFS_MAX_RANGE || block > MAX_FILE_BLOCKS - count)
+    {
+        return -1; // Invalid range
+    }
+
+    pthread_rwlock_rdlock(&inode_locks[inum]);
+    extent_map_t *m = inode_in_use(inum) ? extent_map_get(inum) : NULL;
+    unsigned int blks[MFS_MAX_RANGE];
+    int rc = m != NULL ? 0 : -1;
+    for (int i = 0; i < count && rc == 0;)
+    {
+        // One lookup per extent the range crosses
+        unsigned int run;
+        unsigned int blk = extmap_lookup(m, block + i, &run);
+        if ((int)blk == -1)
+            rc = -1; // Unallocated block
+        for (unsigned int j = 0; j < run && i < count; j++, i++)
+            blks[i] = blk + j;
+    }
+    if (rc == 0)
+    {
+        readahead_note(inum, block, count);
+        rc = bcache_read_range(blks, count, buffer);
+    }
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    return rc;
+}
+
+// Helper function to handle WRITE_RANGE request: writes count consecutive
+// blocks of the file, starting at block, from buffer. Every block is mapped
+// before any is written, so if the image fills up part way the file is left
+// as it was and -1 is returned.
+int handle_write_range(int inum, char *buffer, int block, int count)
+{
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+    {
+        return -1; // Invalid inum
+    }
+    if (block < 0 || count < 1 || count > MFS_MAX_RANGE || block > MAX_FILE_BLOCKS - count)
+    {
+        return -1; // Invalid range
+    }
+
+    pthread_rwlock_wrlock(&inode_locks[inum]);
+    inode_t *inode = &fs_state.inodes[inum];
+    if (!inode_in_use(inum) || inode->type != UFS_REGULAR_FILE)
+    {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+        return -1; // Not a regular file
+    }
+
+    extent_map_t *m = extent_map_get(inum);
+    unsigned int blks[MFS_MAX_RANGE], old[MFS_MAX_RANGE];
+    for (int n = 0; n < count; n++)
+    {
+        old[n] = m != NULL ? extmap_lookup(m, block + n, NULL) : (unsigned int)-1;
+        blks[n] = m != NULL ? fs_block_for_write(inum, inode, block + n) : (unsigned int)-1;
+        if ((int)blks[n] == -1)
+        {
+            fs_unmap_blocks(inum, inode, block, old, blks, n);
+            pthread_rwlock_unlock(&inode_locks[inum]);
+            return -1; // No free data block, or too many extents
+        }
+    }
+    if (inode->size < (block + count) * UFS_BLOCK_SIZE)
+    {
+        inode->size = (block + count) * UFS_BLOCK_SIZE;
+        inode_mark_dirty(inum);
+    }
+
+    int rc = bcache_write_range(blks, count, buffer);
+    inode_bump(inum);
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    return rc; // Made durable by the caller before replying
+}
+
+// Helper function to handle READDIR request: packs up to max live entries of
+// directory inum, from position *cookie on, into entries and sets *cookie to
+// where the next call should resume (-1 once the listing is complete). With
+// plus set, each child's type and size are filled in under its lock.
+// Returns the number of entries, or -1.
+int handle_readdir(int inum, int *cookie, int max, int plus, mfs_dirent_t *entries)
+{
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes || *cookie < 0)
+    {
+        return -1; // Invalid inum or cookie
+    }
+
+    pthread_rwlock_rdlock(&inode_locks[inum]);
+    inode_t *dir_inode = &fs_state.inodes[inum];
+    dir_index_t *idx = inode_in_use(inum) && dir_inode->type == UFS_DIRECTORY ? dir_index_get(inum) : NULL;
+    if (idx == NULL)
+    {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+        return -1; // Not a directory
+    }
+
+    int n = 0;
+    int pos = dirindex_next(idx, *cookie);
+    for (; pos != -1 && n < max; pos = dirindex_next(idx, pos + 1), n++)
+    {
+        mfs_dirent_t *e = &entries[n];
+        e->inum = dirindex_inum(idx, pos);
+        e->type = -1;
+        e->size = -1;
+        strcpy(e->name, dirindex_name(idx, pos));
+        if (!plus)
+            continue;
+
+        // The child is locked after its directory, as usual. The directory
+        // itself is already held, and ".." would have to be locked out of
+        // order, so it is only read if that can be done without waiting.
+        // A child on another shard is left to the client.
+        int child = e->inum - shard_base;
+        if (child < 0 || child >= (int)fs_state.superblock.num_inodes)
+        {
+            continue;
+        }
+        int self = child == inum;
+        if (!self && (strcmp(e->name, "..") == 0 ? pthread_rwlock_tryrdlock(&inode_locks[child]) != 0
+                                                 : pthread_rwlock_rdlock(&inode_locks[child]) != 0))
+        {
+            continue;
+        }
+        if (self || inode_in_use(child))
+        {
+            e->type = fs_state.inodes[child].type;
+            e->size = fs_state.inodes[child].size;
+        }
+        if (!self)
+            pthread_rwlock_unlock(&inode_locks[child]);
+    }
+    *cookie = pos;
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    return n;
+}
+
+// Gives back local inode inum, which the caller holds write-locked: its
+// blocks, its extent map and its directory index go with it
+static void inode_release(int inum)
+{
+    inode_t *inode = &fs_state.inodes[inum];
+    if (!lfs_mode)
+        fixed_free_blocks(inum, inode);
+    extent_map_drop(inum);
+    inode->type = -1;
+    pthread_mutex_lock(&alloc_lock);
+    balloc_free(inode_alloc, inum);
+    pthread_mutex_unlock(&alloc_lock);
+    inode_mark_dirty(inum);
+    dirindex_free(dir_indexes[inum]); // Drop the index if it was a directory
+    dir_indexes[inum] = NULL;
+}
+
+// Takes a free inode and makes it an empty file or directory; a directory
+// gets its first block, holding "." and ".." (parent, a global inode
+// number). Returns the local inode number with the inode write-locked, or -1.
+static int inode_new(int type, int parent)
+{
+    // Take a free inode from the inode bitmap
+    pthread_mutex_lock(&alloc_lock);
+    int inum = balloc_alloc(inode_alloc, 0);
+    pthread_mutex_unlock(&alloc_lock);
+    if (inum == -1)
+    {
+        return -1;
+    }
+
+    // Nobody can reach the inode before an entry names it, but STAT by
+    // number can, so it is filled in under its own lock
+    pthread_rwlock_wrlock(&inode_locks[inum]);
+    inode_t *inode = &fs_state.inodes[inum];
+    inode->type = type;
+    inode->size = 0;
+    inode->nextents = 0;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->flags = 0;
+    extent_map_drop(inum);
+    inode_mark_dirty(inum);
+
+    if (type == UFS_DIRECTORY)
+    {
+        unsigned int blk = fs_block_for_write(inum, inode, 0);
+        if ((int)blk == -1)
+        {
+            inode_release(inum);
+            pthread_rwlock_unlock(&inode_locks[inum]);
+            return -1;
+        }
+        dir_block_t dir_block;
+        strcpy(dir_block.entries[0].name, ".");
+        dir_block.entries[0].inum = inum + shard_base;
+        strcpy(dir_block.entries[1].name, "..");
+        dir_block.entries[1].inum = parent;
+        for (int i = 2; i < 128; i++)
+            dir_block.entries[i].inum = -1;
+        bcache_write(blk, &dir_block);
+        inode->size = 2 * sizeof(dir_ent_t);
+    }
+    inode_bump(inum);
+    return inum;
+}
+
+// Write-locks directory pinum and returns its index, or NULL (nothing
+// locked) if pinum is not a directory or its index cannot be built
+static dir_index_t *dir_lock(int pinum)
+{
+    if (pinum < 0 || pinum >= (int)fs_state.superblock.num_inodes)
+    {
+        printf("Invalid pinum: %d\n", pinum);
+        return NULL; // Invalid pinum
+    }
+
+    pthread_rwlock_wrlock(&inode_locks[pinum]);
+    if (!inode_in_use(pinum) || fs_state.inodes[pinum].type != UFS_DIRECTORY)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        printf("Not a directory: %d\n", pinum);
+        return NULL; // Not a directory
+    }
+
+    dir_index_t *idx = dir_index_get(pinum);
+    if (idx == NULL)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        return NULL; // Out of memory
+    }
+    return idx;
+}
+
+// Adds the entry name -> child (a global inode number) to directory pinum,
+// which the caller holds write-locked, growing it by a block if every slot
+// is taken. Returns 0, or -1 if the directory is full or no block is left,
+// in which case the directory is unchanged.
+static int dir_add_entry(int pinum, dir_index_t *idx, char *name, int child)
+{
+    inode_t *dir_inode = &fs_state.inodes[pinum];
+    dir_block_t dir_block;
+    unsigned int blk;
+    int pos = dirindex_alloc_slot(idx);
+    if (pos == -1)
+    {
+        // The new block goes out once, already holding the entry
+        int nblocks = dirindex_capacity(idx) / DIRINDEX_ENTS_PER_BLOCK;
+        blk = nblocks < MAX_FILE_BLOCKS ? fs_block_for_write(pinum, dir_inode, nblocks) : (unsigned int)-1;
+        if ((int)blk == -1)
+        {
+            return -1;
+        }
+        if (dirindex_add_block(idx) < 0)
+        {
+            unsigned int hole = -1;
+            fs_unmap_blocks(pinum, dir_inode, nblocks, &hole, &blk, 1);
+            return -1;
+        }
+        memset(&dir_block, 0, sizeof(dir_block));
+        for (int i = 0; i < 128; i++)
+            dir_block.entries[i].inum = -1;
+        pos = dirindex_alloc_slot(idx); // One of the new block's
+    }
+    else
+    {
+        // In a log-structured image the block moves, which can fail
+        int b = pos / DIRINDEX_ENTS_PER_BLOCK;
+        bcache_read(inode_block(pinum, b), &dir_block);
+        blk = fs_block_for_write(pinum, dir_inode, b);
+        if ((int)blk == -1)
+        {
+            dirindex_release_slot(idx, pos);
+            return -1;
+        }
+    }
+
+    strcpy(dir_block.entries[pos % DIRINDEX_ENTS_PER_BLOCK].name, name);
+    dir_block.entries[pos % DIRINDEX_ENTS_PER_BLOCK].inum = child;
+    bcache_write(blk, &dir_block);
+    dirindex_insert(idx, pos, name, child);
+    inode_bump(pinum);
+    return 0;
+}
+
+// Clears the entry at index position pos of directory pinum, which the
+// caller holds write-locked. Returns 0, or -1 (entry left in place) if the
+// block cannot be rewritten.
+static int dir_remove_entry(int pinum, int pos)
+{
+    int b = pos / DIRINDEX_ENTS_PER_BLOCK;
+    dir_block_t dir_block;
+    bcache_read(inode_block(pinum, b), &dir_block);
+    unsigned int blk = fs_block_for_write(pinum, &fs_state.inodes[pinum], b);
+    if ((int)blk == -1)
+    {
+        return -1;
+    }
+    dir_block.entries[pos % DIRINDEX_ENTS_PER_BLOCK].inum = -1;
+    bcache_write(blk, &dir_block);
+    dirindex_remove(dir_index_get(pinum), pos);
+    inode_bump(pinum);
+    return 0;
+}
+
+// Helper function to handle CREAT request
+int handle_creat(int pinum, int type, char *name)
+{
+    dir_index_t *idx = dir_lock(pinum);
+    if (idx == NULL)
+    {
+        return -1;
+    }
+
+    // Check if the name already exists
+    if (dirindex_find(idx, name) != -1)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        printf("Name already exists: %s\n", name);
+        return 0; // Name already exists
+    }
+
+    int new_inum = inode_new(type, pinum + shard_base);
+    if (new_inum == -1)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        printf("No empty inode available\n");
+        return -1; // No empty inode, or no block for a directory
+    }
+
+    if (dir_add_entry(pinum, idx, name, new_inum + shard_base) == -1)
+    {
+        inode_release(new_inum); // Give the inode back
+        pthread_rwlock_unlock(&inode_locks[new_inum]);
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        printf("Directory is full\n");
+        return -1; // Directory is full, or no block for it
+    }
+    pthread_rwlock_unlock(&inode_locks[new_inum]);
+    pthread_rwlock_unlock(&inode_locks[pinum]);
+
+    return 0; // Made durable by the caller before replying
+}
+
+// Helper function to handle ALLOC request: makes the inode of an entry that
+// the client adds on another shard with LINK. parent is the global number of
+// the directory that will hold it. Returns the new inode's global number, or
+// -1.
+int handle_alloc(int type, int parent)
+{
+    if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE)
+    {
+        return -1; // Invalid type
+    }
+    int inum = inode_new(type, parent);
+    if (inum == -1)
+    {
+        printf("No empty inode available\n");
+        return -1;
+    }
+    fs_state.inodes[inum].flags |= INODE_REMOTE; // Only FREE gives it back
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    return inum + shard_base; // Made durable by the caller before replying
+}
+
+// Helper function to handle LINK request: adds the entry name -> child (a
+// global inode number made by ALLOC on another shard) to directory pinum.
+// Returns 0, 1 if the name already exists, or -1.
+int handle_link(int pinum, char *name, int child)
+{
+    if (child < 0 || child >= MFS_MAX_SHARDS * MFS_SHARD_SPAN)
+    {
+        return -1; // Invalid inode number
+    }
+    if (child >= shard_base && child < shard_base + MFS_SHARD_SPAN)
+    {
+        return -1; // One of ours: a second name for it would outlive UNLINK
+    }
+
+    dir_index_t *idx = dir_lock(pinum);
+    if (idx == NULL)
+    {
+        return -1;
+    }
+    if (dirindex_find(idx, name) != -1)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        return 1; // Name already exists; the client frees its inode
+    }
+    int rc = dir_add_entry(pinum, idx, name, child);
+    pthread_rwlock_unlock(&inode_locks[pinum]);
+    return rc; // Made durable by the caller before replying
+}
+
+// Helper function to handle FREE request: gives back an inode made by ALLOC,
+// once its entry on another shard is gone or could not be made. Inodes that
+// CREAT made have their entry here and are only freed by UNLINK. A directory
+// must hold nothing but "." and "..".
+int handle_free(int inum)
+{
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+    {
+        return -1; // Invalid inum
+    }
+
+    pthread_rwlock_wrlock(&inode_locks[inum]);
+    if (inum == 0 || !inode_in_use(inum) || !(fs_state.inodes[inum].flags & INODE_REMOTE))
+    {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+        return -1; // Not an inode that can be freed
+    }
+    if (fs_state.inodes[inum].type == UFS_DIRECTORY)
+    {
+        dir_index_t *idx = dir_index_get(inum);
+        if (idx == NULL || dirindex_count(idx) > 2)
+        {
+            pthread_rwlock_unlock(&inode_locks[inum]);
+            return -1; // Directory is not empty
+        }
+    }
+    inode_release(inum);
+    inode_bump(inum);
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    return 0; // Made durable by the caller before replying
+}
+
+// Helper function to handle UNLINK request
+int handle_unlink(int pinum, char *name)
+{
+    if (pinum < 0 || pinum >= (int)fs_state.superblock.num_inodes)
+    {
+        return -1; // Invalid pinum
+    }
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return -1; // Would break the parent-before-child lock order
+    }
+
+    pthread_rwlock_wrlock(&inode_locks[pinum]);
+    inode_t *dir_inode = &fs_state.inodes[pinum];
+    if (!inode_in_use(pinum) || dir_inode->type != UFS_DIRECTORY)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        return -1; // Not a directory
+    }
+
+    // Find the directory entry
+    int pos;
+    int child = dir_find(pinum, name, &pos);
+    if (child == -1)
+    {
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        return -1; // Name not found
+    }
+
+    // An inode on another shard is freed there by the client once the entry
+    // is gone; only the entry goes here
+    int inum = child - shard_base;
+    if (inum < 0 || inum >= (int)fs_state.superblock.num_inodes)
+    {
+        int rc = dir_remove_entry(pinum, pos);
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        return rc;
+    }
+
+    // A directory can only be removed once it holds nothing but "." and ".."
+    pthread_rwlock_wrlock(&inode_locks[inum]);
+    inode_t *inode = &fs_state.inodes[inum];
+    if (inode->type == UFS_DIRECTORY)
+    {
+        dir_index_t *child_idx = dir_index_get(inum);
+        if (child_idx == NULL || dirindex_count(child_idx) > 2)
+        {
+            pthread_rwlock_unlock(&inode_locks[inum]);
+            pthread_rwlock_unlock(&inode_locks[pinum]);
+            return -1; // Directory is not empty
+        }
+    }
+
+    if (dir_remove_entry(pinum, pos) == -1)
+    {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+        pthread_rwlock_unlock(&inode_locks[pinum]);
+        return -1; // No block for the directory
+    }
+
+    // Release the inode's blocks, then mark the inode as free
+    inode_release(inum);
+    inode_bump(inum);
+    pthread_rwlock_unlock(&inode_locks[inum]);
+    pthread_rwlock_unlock(&inode_locks[pinum]);
+
+    return 0; // Made durable by the caller before replying
+}
+
+// Function to format the server's counters as "name value" lines
+int format_stats(char *buf, int len)
+{
+    bcache_stats_t st;
+    bcache_get_stats(&st);
+    int n = snprintf(buf, len,
+                     "cache_frames %lu\ncache_hits %lu\ncache_misses %lu\n"
+                     "cache_evictions %lu\ncache_writebacks %lu\ncache_flush_writes %lu\ncache_dirty %lu\n"
+                     "cache_prefetched %lu\ncache_prefetch_hits %lu\ncache_prefetch_unused %lu\n"
+                     "commits %lu\ncommit_ops %lu\ninode_blocks_written %lu\ninode_writes %lu\n"
+                     "startup_us %lu\n",
+                     st.frames, st.hits, st.misses, st.evictions, st.writebacks, st.flush_writes, st.dirty, st.prefetched,
+                     st.prefetch_hits, st.prefetch_unused,
+                     __atomic_load_n(&stat_commits, __ATOMIC_RELAXED),
+                     __atomic_load_n(&stat_commit_ops, __ATOMIC_RELAXED),
+                     __atomic_load_n(&stat_inode_blocks, __ATOMIC_RELAXED),
+                     __atomic_load_n(&stat_inode_writes, __ATOMIC_RELAXED), stat_startup_us);
+    diskio_stats_t io;
+    diskio_get_stats(&io);
+    if (n < len)
+    {
+        n += snprintf(buf + n, len - n, "io_uring %d\nio_submits %lu\nio_ops %lu\n", io.uring, io.submits, io.ops);
+    }
+    if (n < len)
+    {
+        n += snprintf(buf + n, len - n, "net_rx_calls %lu\nnet_rx_msgs %lu\nnet_tx_calls %lu\nnet_tx_msgs %lu\n",
+                      __atomic_load_n(&stat_rx_calls, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_rx_msgs, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_tx_calls, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_tx_msgs, __ATOMIC_RELAXED));
+    }
+    if (n < len)
+    {
+        n += snprintf(buf + n, len - n,
+                      "range_reads %lu\nrange_writes %lu\nrange_blocks %lu\n"
+                      "callbacks_granted %lu\ncallbacks_broken %lu\nreaddirs %lu\nreaddir_entries %lu\n"
+                      "path_lookups %lu\npath_components %lu\n",
+                      __atomic_load_n(&stat_range_reads, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_range_writes, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_range_blocks, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_callbacks_granted, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_callbacks_broken, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_readdirs, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_readdir_entries, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_path_lookups, __ATOMIC_RELAXED),
+                      __atomic_load_n(&stat_path_components, __ATOMIC_RELAXED));
+    }
+    drc_stats_t drc;
+    drc_get_stats(&drc);
+    if (n < len)
+    {
+        n += snprintf(buf + n, len - n, "drc_entries %d\ndrc_replays %lu\ndrc_drops %lu\n", drc.entries, drc.replays,
+                      drc.drops);
+    }
+    repl_stats_t repl;
+    repl_get_stats(&repl);
+    if (n < len)
+    {
+        n += snprintf(buf + n, len - n, "repl_backups %d\nrepl_sent %lu\nrepl_applied %lu\nrepl_acks %lu\n",
+                      repl.backups, repl.sent, repl.applied, repl.acks);
+    }
+    if (lfs_mode && n < len)
+    {
+        unsigned int log_end;
+        unsigned long checkpoints;
+        lfs_get_stats(&log_end, &checkpoints);
+        n += snprintf(buf + n, len - n, "lfs_log_end %u\nlfs_checkpoints %lu\n", log_end, checkpoints);
+    }
+    return n < len ? n : len - 1;
+}
+
+// Returns whether opcode changes the file system
+static int is_mutation(int opcode)
+{
+    return opcode == MFS_OP_WRITE || opcode == MFS_OP_CREAT || opcode == MFS_OP_UNLINK ||
+           opcode == MFS_OP_WRITE_RANGE || opcode == MFS_OP_ALLOC || opcode == MFS_OP_LINK || opcode == MFS_OP_FREE;
+}
+
+// Checks a mutation against the duplicate request cache. Returns 1 if it is
+// new and should be executed; otherwise it is a retransmission, which is
+// answered from the cache (or dropped while the original is running).
+static int drc_admit(mfs_hdr_t *req, reply_batch_t *rb, int sockfd, struct sockaddr_in *addr, socklen_t addr_size)
+{
+    int32_t status;
+    switch (drc_begin(req->client_id, req->req_id, &status))
+    {
+    case DRC_NEW:
+        return 1;
+    case DRC_DONE:
+    {
+        mfs_hdr_t reply = *req;
+        reply.frag = 0;
+        reply.len = 0;
+        reply.status = status;
+        queue_reply(rb, sockfd, &reply, NULL, addr, addr_size, 0);
+        return 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Function to send replies, one sendmmsg() per run of replies that leave
+// through the same socket
+void send_replies(pending_reply_t *replies, char **data, int n)
+{
+    struct mmsghdr msgs[IO_BATCH];
+    struct iovec iov[IO_BATCH][2];
+
+    // Mutations are durable by now; retransmissions get the same answer
+    for (int i = 0; i < n; i++)
+    {
+        mfs_hdr_t *reply = &replies[i].reply;
+        if (is_mutation(reply->opcode))
+            drc_finish(reply->client_id, reply->req_id, reply->status);
+    }
+
+    for (int i = 0; i < n;)
+    {
+        int sockfd = replies[i].sockfd;
+        int k = 0;
+        memset(msgs, 0, sizeof(msgs));
+        for (; i < n && k < IO_BATCH && replies[i].sockfd == sockfd; i++, k++)
+        {
+            mfs_hdr_t *reply = &replies[i].reply;
+            iov[k][0] = (struct iovec){reply, sizeof(*reply)};
+            iov[k][1] = (struct iovec){data != NULL ? data[i] : NULL, reply->len};
+            msgs[k].msg_hdr.msg_name = &replies[i].addr;
+            msgs[k].msg_hdr.msg_namelen = replies[i].addr_size;
+            msgs[k].msg_hdr.msg_iov = iov[k];
+            msgs[k].msg_hdr.msg_iovlen = reply->len > 0 ? 2 : 1;
+        }
+
+        for (int sent = 0; sent < k;)
+        {
+            int rc = sendmmsg(sockfd, msgs + sent, k - sent, 0);
+            if (rc < 0)
+            {
+                perror("sendmmsg failed");
+                break;
+            }
+            sent += rc;
+            __atomic_add_fetch(&stat_tx_calls, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stat_tx_msgs, rc, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Number of fragments the payload of a count-block range travels in
+static int range_frags(int count)
+{
+    return (count + MFS_FRAG_BLOCKS - 1) / MFS_FRAG_BLOCKS;
+}
+
+// Payload bytes of fragment frag of a count-block range
+static uint32_t range_frag_len(int count, int frag)
+{
+    int blocks = count - frag * MFS_FRAG_BLOCKS;
+    return (blocks < MFS_FRAG_BLOCKS ? blocks : MFS_FRAG_BLOCKS) * UFS_BLOCK_SIZE;
+}
+
+// Adds one fragment of a WRITE_RANGE request. Once the last one is in,
+// returns the whole payload, which the caller then owns and frees; returns
+// NULL while fragments are missing or if the fragment is malformed.
+static char *reasm_add(mfs_hdr_t *req, const char *data)
+{
+    int count = req->arg1;
+    if (count < 1 || count > MFS_MAX_RANGE || req->frag >= range_frags(count) ||
+        req->len != range_frag_len(count, req->frag))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&reasm_lock);
+    reasm_t *r = NULL;
+    for (int i = 0; i < REASM_SLOTS && r == NULL; i++)
+    {
+        if (reasm[i].in_use && reasm[i].client_id == req->client_id && reasm[i].req_id == req->req_id)
+            r = &reasm[i];
+    }
+    if (r == NULL)
+    {
+        // Start a new request in a free slot, or in place of the oldest one
+        r = &reasm[0];
+        for (int i = 0; i < REASM_SLOTS && r->in_use; i++)
+        {
+            if (!reasm[i].in_use || reasm[i].age < r->age)
+                r = &reasm[i];
+        }
+        if (r->buf == NULL && posix_memalign((void **)&r->buf, UFS_BLOCK_SIZE, MFS_MAX_RANGE * UFS_BLOCK_SIZE) != 0)
+        {
+            r->buf = NULL;
+            pthread_mutex_unlock(&reasm_lock);
+            return NULL;
+        }
+        r->client_id = req->client_id;
+        r->req_id = req->req_id;
+        r->in_use = 1;
+        r->have = 0;
+        r->age = reasm_clock++;
+    }
+
+    memcpy(r->buf + (size_t)req->frag * MFS_MAX_PAYLOAD, data, req->len);
+    r->have |= 1u << req->frag;
+    char *done = NULL;
+    if (r->have == (1u << range_frags(count)) - 1)
+    {
+        done = r->buf;
+        r->buf = NULL;
+        r->in_use = 0;
+    }
+    pthread_mutex_unlock(&reasm_lock);
+    return done;
+}
+
+// Function to send the reply to a successful READ_RANGE request, one
+// datagram per fragment of the count blocks in buf
+static void send_range(mfs_hdr_t *reply, char *buf, int count, int sockfd, struct sockaddr_in *addr,
+                       socklen_t addr_size)
+{
+    pending_reply_t frags[MFS_MAX_RANGE / MFS_FRAG_BLOCKS];
+    char *data[MFS_MAX_RANGE / MFS_FRAG_BLOCKS];
+    int n = range_frags(count);
+    for (int i = 0; i < n; i++)
+    {
+        frags[i].sockfd = sockfd;
+        frags[i].addr = *addr;
+        frags[i].addr_size = addr_size;
+        frags[i].reply = *reply;
+        frags[i].reply.frag = i;
+        frags[i].reply.len = range_frag_len(count, i);
+        data[i] = buf + (size_t)i * MFS_MAX_PAYLOAD;
+    }
+    send_replies(frags, data, n);
+}
+
+// Finishes a mutation that succeeded. On a primary, whose caller holds
+// order_lock, sends its record (with len bytes of data) to the backups and
+// lets the next mutation run; the reply waits until the backups have applied
+// the record, which without group commit is checked once for the whole
+// batch. Then commits and replies. A mutation that fails leaves nothing
+// behind, so backups only ever need the ones that succeeded.
+static void replicate_and_reply(reply_batch_t *rb, int sockfd, mfs_hdr_t *reply, const char *data, uint32_t len,
+                                struct sockaddr_in client_addr, socklen_t addr_size)
+{
+    if (replicating)
+    {
+        mfs_hdr_t rec = *reply;
+        rec.len = len;
+        unsigned long seq = repl_send(&rec, data, bumped, nbumped);
+        pthread_mutex_unlock(&order_lock);
+        if (gc_window_us == 0)
+            rb->repl_seq = seq;
+        else
+            repl_wait(seq);
+    }
+    commit_and_reply(rb, sockfd, reply, client_addr, addr_size);
+}
+
+// Applies a mutation from the primary's stream on a backup, then gives the
+// inodes it changed the primary's versions of them. Returns its result,
+// which must match the primary's.
+int apply_record(mfs_hdr_t *rec, char *data, const repl_version_t *versions, int n)
+{
+    int inum = rec->inum - shard_base;
+    int rc = -1;
+    switch (rec->opcode)
+    {
+    case MFS_OP_WRITE:
+        rc = rec->len == UFS_BLOCK_SIZE ? handle_write(inum, data, rec->arg0) : -1;
+        break;
+    case MFS_OP_WRITE_RANGE:
+        rc = rec->len == (uint32_t)rec->arg1 * UFS_BLOCK_SIZE ? handle_write_range(inum, data, rec->arg0, rec->arg1)
+                                                               : -1;
+        break;
+    case MFS_OP_CREAT:
+        rc = handle_creat(inum, rec->arg0, rec->name);
+        break;
+    case MFS_OP_UNLINK:
+        rc = handle_unlink(inum, rec->name);
+        break;
+    case MFS_OP_ALLOC:
+        rc = handle_alloc(rec->arg0, rec->arg1);
+        break;
+    case MFS_OP_LINK:
+        rc = handle_link(inum, rec->name, rec->arg0);
+        break;
+    case MFS_OP_FREE:
+        rc = handle_free(inum);
+        break;
+    }
+
+    // The bumps above broke this server's callbacks; the versions are the
+    // primary's
+    for (int i = 0; i < n; i++)
+    {
+        if (versions[i].inum >= 0 && versions[i].inum < (int)fs_state.superblock.num_inodes)
+            __atomic_store_n(&inode_versions[versions[i].inum], versions[i].version, __ATOMIC_RELAXED);
+    }
+    return rc;
+}
+
+// Function to process incoming requests
+void process_request(mfs_hdr_t *req, char *data, int sockfd, struct sockaddr_in client_addr, socklen_t addr_size,
+                     reply_batch_t *rb)
+{
+    char *read_buffer = reply_buffer(rb); // READ and STATS payloads go straight into the reply slot
+    int inum = req->inum - shard_base;    // Local inode number (out of range if on another shard)
+
+    mfs_hdr_t reply = *req; // Echo the ids; opcode and arguments are harmless
+    reply.status = -1;
+    reply.len = 0;
+    char *reply_data = NULL;
+
+    // A backup only changes through its primary's stream
+    if (backup_mode && is_mutation(req->opcode))
+    {
+        queue_reply(rb, sockfd, &reply, NULL, &client_addr, addr_size, 0);
+        return;
+    }
+
+    // A WRITE_RANGE is checked once all of its fragments are in
+    if (is_mutation(req->opcode) && req->opcode != MFS_OP_WRITE_RANGE &&
+        !drc_admit(req, rb, sockfd, &client_addr, addr_size))
+    {
+        return;
+    }
+    int ordered = replicating && is_mutation(req->opcode) && req->opcode != MFS_OP_WRITE_RANGE;
+    if (ordered)
+    {
+        pthread_mutex_lock(&order_lock);
+        nbumped = 0;
+    }
+
+    switch (req->opcode)
+    {
+    case MFS_OP_LOOKUP:
+    {
+        mfs_lease_t *lease = (mfs_lease_t *)read_buffer;
+        reply.status = handle_lookup(inum, req->name, &lease->version);
+        if (reply.status >= 0)
+        {
+            lease->lease_ms = lease_ms;
+            reply.len = sizeof(*lease);
+            reply_data = read_buffer;
+        }
+        break;
+    }
+
+    case MFS_OP_LOOKUP_PATH:
+    {
+        // At most MFS_MAX_PATH / 2 components, which fits the reply slot
+        _Static_assert(MFS_MAX_PATH / 2 * sizeof(mfs_pathstep_t) <= UFS_BLOCK_SIZE, "path steps overflow");
+        int resolved = 0;
+        if (req->len > 0 && req->len <= MFS_MAX_PATH && data[req->len - 1] == '\0')
+        {
+            reply.status = handle_lookup_path(inum, data, (mfs_pathstep_t *)read_buffer, &resolved);
+            __atomic_add_fetch(&stat_path_lookups, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stat_path_components, resolved, __ATOMIC_RELAXED);
+        }
+        reply.arg0 = resolved;
+        reply.arg1 = lease_ms;
+        reply.len = resolved * sizeof(mfs_pathstep_t);
+        reply_data = read_buffer;
+        break;
+    }
+
+    case MFS_OP_STAT:
+    {
+        inode_t inode;
+        mfs_lease_t *lease = (mfs_lease_t *)read_buffer;
+        reply.status = handle_stat(inum, &inode, &lease->version);
+        if (reply.status == 0)
+        {
+            reply.arg0 = inode.type;
+            reply.arg1 = inode.size;
+            lease->lease_ms = lease_ms;
+            reply.len = sizeof(*lease);
+            reply_data = read_buffer;
+        }
+        break;
+    }
+
+    case MFS_OP_WRITE:
+        if (req->len == UFS_BLOCK_SIZE)
+        {
+            reply.status = handle_write(inum, data, req->arg0);
+        }
+        if (reply.status == 0)
+        {
+            replicate_and_reply(rb, sockfd, &reply, data, UFS_BLOCK_SIZE, client_addr, addr_size);
+            return;
+        }
+        break;
+
+    case MFS_OP_READ:
+        // Promise first, so a mutation racing with the read breaks it
+        reply.arg1 = 0;
+        if (req->flags & MFS_FLAG_CALLBACK)
+        {
+            reply.arg1 = callback_add(inum, req, sockfd, &client_addr, addr_size);
+        }
+        reply.status = handle_read(inum, read_buffer, req->arg0);
+        if (reply.status == 0)
+        {
+            reply.len = UFS_BLOCK_SIZE;
+            reply_data = read_buffer;
+        }
+        break;
+
+    case MFS_OP_CREAT:
+        reply.status = handle_creat(inum, req->arg0, req->name);
+        if (reply.status == 0)
+        {
+            replicate_and_reply(rb, sockfd, &reply, NULL, 0, client_addr, addr_size);
+            return;
+        }
+        break;
+
+    case MFS_OP_UNLINK:
+        reply.status = handle_unlink(inum, req->name);
+        if (reply.status == 0)
+        {
+            replicate_and_reply(rb, sockfd, &reply, NULL, 0, client_addr, addr_size);
+            return;
+        }
+        break;
+
+    case MFS_OP_ALLOC:
+        reply.status = handle_alloc(req->arg0, req->arg1);
+        if (reply.status >= 0)
+        {
+            replicate_and_reply(rb, sockfd, &reply, NULL, 0, client_addr, addr_size);
+            return;
+        }
+        break;
+
+    case MFS_OP_LINK:
+        reply.status = handle_link(inum, req->name, req->arg0);
+        if (reply.status == 0)
+        {
+            replicate_and_reply(rb, sockfd, &reply, NULL, 0, client_addr, addr_size);
+            return;
+        }
+        break;
+
+    case MFS_OP_FREE:
+        reply.status = handle_free(inum);
+        if (reply.status == 0)
+        {
+            replicate_and_reply(rb, sockfd, &reply, NULL, 0, client_addr, addr_size);
+            return;
+        }
+        break;
+
+    case MFS_OP_READ_RANGE:
+        reply.status = handle_read_range(inum, rb->range_buf, req->arg0, req->arg1);
+        if (reply.status == 0)
+        {
+            // Too many fragments for the batch; they go out right away
+            send_range(&reply, rb->range_buf, req->arg1, sockfd, &client_addr, addr_size);
+            __atomic_add_fetch(&stat_range_reads, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stat_range_blocks, req->arg1, __ATOMIC_RELAXED);
+            return;
+        }
+        break;
+
+    case MFS_OP_READDIR:
+    {
+        int cookie = req->arg0;
+        int max = (int)(MFS_MAX_PAYLOAD / sizeof(mfs_dirent_t));
+        if (req->arg1 > 0 && req->arg1 < max)
+            max = req->arg1;
+        reply.status = handle_readdir(inum, &cookie, max, req->flags & MFS_FLAG_PLUS,
+                                      (mfs_dirent_t *)rb->range_buf);
+        if (reply.status >= 0)
+        {
+            // Larger than the batch's reply buffers; it goes out right away
+            pending_reply_t p = {sockfd, client_addr, addr_size, reply};
+            p.reply.arg0 = cookie;
+            p.reply.len = reply.status * sizeof(mfs_dirent_t);
+            send_replies(&p, &rb->range_buf, 1);
+            __atomic_add_fetch(&stat_readdirs, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stat_readdir_entries, reply.status, __ATOMIC_RELAXED);
+            return;
+        }
+        break;
+    }
+
+    case MFS_OP_WRITE_RANGE:
+    {
+        char *buf = reasm_add(req, data);
+        if (buf == NULL)
+        {
+            return; // More fragments to come (or a malformed one)
+        }
+        if (!drc_admit(req, rb, sockfd, &client_addr, addr_size))
+        {
+            free(buf);
+            return;
+        }
+        ordered = replicating;
+        if (ordered)
+        {
+            pthread_mutex_lock(&order_lock);
+            nbumped = 0;
+        }
+        reply.len = 0;
+        reply.frag = 0;
+        reply.status = handle_write_range(inum, buf, req->arg0, req->arg1);
+        __atomic_add_fetch(&stat_range_writes, 1, __ATOMIC_RELAXED);
+        if (reply.status == 0)
+        {
+            __atomic_add_fetch(&stat_range_blocks, req->arg1, __ATOMIC_RELAXED);
+            replicate_and_reply(rb, sockfd, &reply, buf, req->arg1 * UFS_BLOCK_SIZE, client_addr, addr_size);
+            free(buf);
+            return;
+        }
+        free(buf);
+        break;
+    }
+
+    case MFS_OP_STATS:
+        reply.len = format_stats(read_buffer, UFS_BLOCK_SIZE);
+        reply_data = read_buffer;
+        reply.status = 0;
+        break;
+
+    case MFS_OP_SHUTDOWN:
+        // The workers finish their batches and main() answers once
+        // everything is durable; a later SHUTDOWN is answered with this batch
+        reply.status = 0;
+        if (__atomic_exchange_n(&stopping, 1, __ATOMIC_ACQ_REL))
+        {
+            queue_reply(rb, sockfd, &reply, NULL, &client_addr, addr_size, 1);
+            return;
+        }
+        stop_reply = (pending_reply_t){sockfd, client_addr, addr_size, reply};
+        eventfd_write(stop_fd, 1);
+        return;
+
+    default:
+        printf("Unknown opcode: %d\n", req->opcode);
+        break;
+    }
+
+    if (ordered)
+        pthread_mutex_unlock(&order_lock); // Failed; nothing to replicate
+    queue_reply(rb, sockfd, &reply, reply_data, &client_addr, addr_size, 0);
+}
@@ -6,19 +6,49 @@
 
 #define UFS_BLOCK_SIZE (4096)
 
-#define DIRECT_PTRS (30)
+// A file's blocks are mapped by extents: runs of consecutive file blocks
+// stored in consecutive image blocks. An inode lists its extents sorted by
+// file block, merged wherever two are contiguous in both; blocks no extent
+// covers are holes. Up to INODE_EXTENTS extents fit in the inode itself.
+// Beyond that, the inode instead points to extent blocks, each holding the
+// next EXTENTS_PER_BLOCK extents of the list (the last one partly filled).
+typedef struct {
+    unsigned int lblk; // first file block covered
+    unsigned int pblk; // image block it is stored in
+    unsigned int len;  // number of blocks
+} extent_t;
+
+#define INODE_EXTENTS (9)
+#define INODE_EXTENT_BLOCKS (28)
+#define EXTENTS_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(extent_t))
+#define MAX_EXTENTS (INODE_EXTENT_BLOCKS * EXTENTS_PER_BLOCK)
+#define MAX_FILE_BLOCKS (0x7fffffff / UFS_BLOCK_SIZE) // size must fit an int
+
+#define INODE_REMOTE (1) // Made by ALLOC; its entry is on another shard
 
 typedef struct {
-    int type;   // MFS_DIRECTORY or MFS_REGULAR
-    int size;   // bytes
-    unsigned int direct[DIRECT_PTRS];
+    int type;               // MFS_DIRECTORY or MFS_REGULAR
+    int size;               // bytes
+    unsigned int nextents;  // extents mapping the file's blocks
+    union {
+        extent_t extents[INODE_EXTENTS];                 // nextents <= INODE_EXTENTS
+        unsigned int extent_blocks[INODE_EXTENT_BLOCKS]; // otherwise
+    };
+    unsigned int flags;     // INODE_*
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == 128, "inode_t must stay 128 bytes");
+
 typedef struct {
     char name[28];  // up to 28 bytes of name in directory (including \0)
     int  inum;      // inode number of entry (-1 means entry not used)
 } dir_ent_t;
 
+// Identifies the current on-disk format (inode layout included) of images made
+// by mkfs; bumped whenever it changes, so that the server refuses images made
+// for another one instead of misreading them
+#define UFS_MAGIC (0x55465333) // "UFS3"
+
 // presumed: block 0 is the super block
 typedef struct __super {
     int inode_bitmap_addr; // block address (in blocks)
@@ -31,7 +61,30 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    unsigned int magic;    // UFS_MAGIC
 } super_t;
 
+// Log-structured images (see README): block 0 holds the checkpoint region,
+// everything after it is an append-only log of data blocks, inodes and
+// inode map pieces.
+#define LFS_MAGIC (0x4c465333)     // "LFS3", bumped like UFS_MAGIC; never a valid inode_bitmap_addr
+#define LFS_MAX_INODES (4096)
+#define LFS_IMAP_PIECE_ENTRIES (16)
+#define LFS_IMAP_PIECES (LFS_MAX_INODES / LFS_IMAP_PIECE_ENTRIES)
+#define LFS_MAX_BLOCKS (1u << 26)   // Piece addresses (64 per block) must fit in 32 bits
+
+// One piece of the inode map. Entries are inode addresses in units of
+// sizeof(inode_t) from the start of the image; 0 means the inode is free.
+typedef struct {
+    unsigned int inode_addr[LFS_IMAP_PIECE_ENTRIES];
+} imap_piece_t;
+
+// The checkpoint region. Piece addresses are in units of sizeof(imap_piece_t);
+// 0 means the piece has never been written (all its inodes are free).
+typedef struct {
+    unsigned int magic;    // LFS_MAGIC
+    unsigned int log_end;  // first block past the end of the log
+    unsigned int imap[LFS_IMAP_PIECES];
+} checkpoint_t;
 
 #endif // __ufs_h__